@@ -0,0 +1,174 @@
+/*
+ * avi.c - Reader for the AVI files produced by mjpeg.c
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riff.h"
+#include "avi.h"
+#include "crc32c.h"
+
+#define AVI_MAX_HDRL_SIZE	(64 * 1024)
+#define AVI_CRC_BATCH		256
+
+static void avi_copy_struct(const riff_chunk_t *chunk, void *out, size_t out_size) {
+	memset(out, 0, out_size);
+	memcpy(out, chunk->data, chunk->data_size < out_size ? chunk->data_size : out_size);
+}
+
+// The header list is small, so it is read in one go and walked in memory
+static int avi_parse_hdrl(avi_file_t *avi, uint32_t size) {
+	riff_span_t hdrl;
+	riff_span_t strl;
+	riff_chunk_t chunk;
+	uint8_t *buf;
+	int have_strl = 0;
+
+	if (size > AVI_MAX_HDRL_SIZE || !(buf = malloc(size))) return 0;
+	if (fread(buf, 1, size, avi->file) != size) {
+		free(buf);
+		return 0;
+	}
+
+	riff_span_init(&hdrl, buf, size);
+	while (riff_span_next(&hdrl, &chunk)) {
+		if (chunk.fcc == FOURCC_AVIH) {
+			avi_copy_struct(&chunk, &avi->avih, sizeof(avi->avih));
+		} else if (chunk.fcc == FOURCC_LIST && chunk.type == FOURCC_STRL && !have_strl) {
+			// Only the first (video) stream is of interest
+			riff_span_enter(&strl, &chunk);
+			while (riff_span_next(&strl, &chunk)) {
+				if (chunk.fcc == FOURCC_STRH) {
+					avi_copy_struct(&chunk, &avi->strh, sizeof(avi->strh));
+				} else if (chunk.fcc == FOURCC_STRF) {
+					avi_copy_struct(&chunk, &avi->bmph, sizeof(avi->bmph));
+				} else if (chunk.fcc == FOURCC_VPRP) {
+					avi_copy_struct(&chunk, &avi->vprp, sizeof(avi->vprp));
+					avi->has_vprp = 1;
+				}
+			}
+			have_strl = avi->strh.type == FOURCC_VIDS;
+		}
+	}
+	free(buf);
+	return have_strl;
+}
+
+// Index offsets are normally relative to the 'movi' fourcc, but some writers use absolute offsets
+static void avi_detect_idx1_base(avi_file_t *avi) {
+	IDX1 first;
+	FOURCC fcc;
+	uint32_t size;
+
+	avi->idx1_base = avi->movi_pos;
+	if (avi->idx1_count == 0 || avi_read_index(avi, 0, 1, &first) != 1) return;
+	if (fseek(avi->file, avi->movi_pos + (long)first.offset, SEEK_SET) == 0 && freadchunk(&fcc, &size, avi->file) && fcc == first.id) return;
+	if (fseek(avi->file, (long)first.offset, SEEK_SET) == 0 && freadchunk(&fcc, &size, avi->file) && fcc == first.id) {
+		avi->idx1_base = 0;
+	}
+}
+
+int avi_open(avi_file_t *avi, FILE *in) {
+	FOURCC fcc;
+	FOURCC type;
+	uint32_t size;
+	int have_hdrl = 0;
+
+	memset(avi, 0, sizeof(*avi));
+	avi->file = in;
+	if (!in || fseek(in, 0, SEEK_END) != 0) return 0;
+	avi->file_size = ftell(in);
+	rewind(in);
+
+	if (!freadchunk(&fcc, &size, in) || fcc != FOURCC_RIFF || !freadcc(&type, in) || type != FOURCC_AVI) return 0;
+
+	while (ftell(in) + (long)sizeof(CHNK) <= avi->file_size && freadchunk(&fcc, &size, in)) {
+		long body = ftell(in);
+		long next = body + (long)(size + (size & 1));
+
+		if (fcc == FOURCC_LIST && freadcc(&type, in)) {
+			if (type == FOURCC_HDRL || type == FOURCC_HDLR) {
+				if (size < sizeof(FOURCC) || !avi_parse_hdrl(avi, size - sizeof(FOURCC))) return 0;
+				have_hdrl = 1;
+			} else if (type == FOURCC_MOVI) {
+				avi->movi_pos = body;
+				avi->movi_size = size;
+			}
+		} else if (fcc == FOURCC_IDX1) {
+			avi->idx1_pos = body;
+			avi->idx1_count = size / sizeof(IDX1);
+		} else if (fcc == FOURCC_CRCS) {
+			avi->crcs_pos = body;
+			avi->crcs_count = size / sizeof(uint32_t);
+		} else if (avi->movi_pos && fcc == FOURCC_00DC) {
+			// An index written without its chunk header, it runs to the end of the file
+			avi->idx1_pos = body - (long)sizeof(CHNK);
+			avi->idx1_count = (uint32_t)((avi->file_size - avi->idx1_pos) / sizeof(IDX1));
+			break;
+		}
+		if (next > avi->file_size || fseek(in, next, SEEK_SET) != 0) break;
+	}
+
+	if (!have_hdrl || !avi->movi_pos) return 0;
+	avi_detect_idx1_base(avi);
+	return 1;
+}
+
+uint32_t avi_read_index(avi_file_t *avi, uint32_t first, uint32_t count, IDX1 *entries) {
+	if (first >= avi->idx1_count) return 0;
+	if (count > avi->idx1_count - first) count = avi->idx1_count - first;
+	if (fseek(avi->file, avi->idx1_pos + (long)first * (long)sizeof(IDX1), SEEK_SET) != 0) return 0;
+	return (uint32_t)fread(entries, sizeof(IDX1), count, avi->file);
+}
+
+int avi_is_frame(const IDX1 *entry) {
+	return entry->id == FOURCC_00DC && !(entry->flags & AVIIF_LIST);
+}
+
+// Checks entries [first, first + count) against the 'crcs' chunk. Entries are read in index order,
+// which is also file order, so the frames come off the disk in one forward sweep
+int avi_check_crc(avi_file_t *avi, uint32_t first, uint32_t count, avi_crc_result_t *result) {
+	IDX1 entries[AVI_CRC_BATCH];
+	uint32_t crcs[AVI_CRC_BATCH];
+	uint8_t *buf = NULL;
+	size_t buf_size = 0;
+
+	memset(result, 0, sizeof(*result));
+	result->first_mismatch = UINT32_MAX;
+	if (!avi->crcs_pos || first >= avi->idx1_count) return 0;
+	if (count > avi->idx1_count - first) count = avi->idx1_count - first;
+	if (first >= avi->crcs_count) return 0;
+	if (count > avi->crcs_count - first) count = avi->crcs_count - first;
+
+	while (count > 0) {
+		uint32_t n = count < AVI_CRC_BATCH ? count : AVI_CRC_BATCH;
+		if (avi_read_index(avi, first, n, entries) != n) break;
+		if (fseek(avi->file, avi->crcs_pos + (long)first * (long)sizeof(uint32_t), SEEK_SET) != 0 ||
+			fread(crcs, sizeof(uint32_t), n, avi->file) != n) break;
+
+		for (uint32_t i = 0; i < n; i++) {
+			if (!avi_is_frame(&entries[i])) continue;
+			if (entries[i].size > buf_size) {
+				uint8_t *grown = realloc(buf, entries[i].size);
+				if (!grown) goto out;
+				buf = grown;
+				buf_size = entries[i].size;
+			}
+			long data = avi->idx1_base + (long)entries[i].offset + (long)sizeof(CHNK);
+			if (fseek(avi->file, data, SEEK_SET) != 0 || fread(buf, 1, entries[i].size, avi->file) != entries[i].size) {
+				result->unreadable++;
+			} else if (crc32c_update(0, buf, entries[i].size) != crcs[i]) {
+				if (result->mismatched++ == 0) result->first_mismatch = first + i;
+			}
+			result->checked++;
+		}
+		first += n;
+		count -= n;
+	}
+out:
+	free(buf);
+	return 1;
+}
@@ -0,0 +1,50 @@
+#ifndef AVI_H
+#define AVI_H
+
+/*
+ * avi.h - Reader for the AVI files produced by mjpeg.c
+ *
+ * Locates the stream headers, the movi list and the index of a finished
+ * recording. Besides well formed files it accepts the quirks of older
+ * firmware: an 'HDLR' header list and an index written without its idx1
+ * chunk header.
+ *
+ * Recordings made with CONFIG_MJPEG_FRAME_CRC carry a CRC32C of every
+ * indexed frame, avi_check_crc() verifies any range of them.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "riff.h"
+
+typedef struct {
+	FILE    *file;
+	long     file_size;
+	AVIH     avih;
+	STRH     strh;
+	BMPH     bmph;
+	VPRP     vprp;
+	int      has_vprp;
+	long     movi_pos;		// Offset of the 'movi' fourcc
+	uint32_t movi_size;		// Size of the movi list, including the 'movi' fourcc
+	long     idx1_pos;		// Offset of the first index entry
+	uint32_t idx1_count;
+	long     idx1_base;		// Added to an entry offset to get the offset of its chunk header
+	long     crcs_pos;		// Offset of the first frame checksum, 0 when there are none
+	uint32_t crcs_count;
+} avi_file_t;
+
+typedef struct {
+	uint32_t checked;
+	uint32_t mismatched;
+	uint32_t unreadable;
+	uint32_t first_mismatch;	// Index entry, UINT32_MAX when every frame matched
+} avi_crc_result_t;
+
+int avi_open(avi_file_t *avi, FILE *in);
+uint32_t avi_read_index(avi_file_t *avi, uint32_t first, uint32_t count, IDX1 *entries);
+int avi_is_frame(const IDX1 *entry);
+int avi_check_crc(avi_file_t *avi, uint32_t first, uint32_t count, avi_crc_result_t *result);
+
+#endif /* AVI_H */
@@ -0,0 +1,141 @@
+/*
+ * burst.c - Short captures faster than the card, held in RAM until written
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "burst.h"
+
+// head, tail and state are the only fields both sides touch. Each is written by one side only, and the
+// release/acquire pairs make a frame's bytes and entry visible before the counter that publishes it
+#define LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+void burst_init(burst_t *burst, uint8_t *arena, size_t arena_size, burst_entry_t *entries, uint32_t max_entries) {
+	memset(burst, 0, sizeof(*burst));
+	burst->arena = arena;
+	burst->arena_size = arena_size;
+	burst->entries = entries;
+	burst->max_entries = max_entries;
+}
+
+// Arena bytes from the oldest frame held to the write position, the unused end of a wrapped ring included
+static size_t burst_fill(const burst_t *burst, uint32_t head, uint32_t tail) {
+	if (head == tail) return 0;
+	size_t oldest = burst->entries[tail % burst->max_entries].offset;
+	return burst->write_pos > oldest ? burst->write_pos - oldest : burst->arena_size - oldest + burst->write_pos;
+}
+
+int burst_begin(burst_t *burst, uint64_t now_us) {
+	if (LOAD(&burst->state) != BURST_IDLE) return 0;
+
+	// Nothing is held and the consumer has nothing to read, so the ring starts over
+	burst->head = 0;
+	STORE(&burst->tail, 0);
+	burst->write_pos = 0;
+	burst->peak_used = 0;
+	burst->start_us = now_us;
+	burst->captured = 0;
+	burst->lost = 0;
+	burst->written = 0;
+	burst->written_bytes = 0;
+	STORE(&burst->state, BURST_CAPTURING);
+	return 1;
+}
+
+int burst_add(burst_t *burst, const uint8_t *data, size_t len, uint64_t now_us) {
+	uint32_t head = burst->head;
+	uint32_t tail = LOAD(&burst->tail);
+	size_t pos = burst->write_pos;
+
+	if (LOAD(&burst->state) != BURST_CAPTURING) return 0;
+	burst->captured++;
+
+	// Frames are never split across the end of the ring. Free space ends strictly before the oldest frame,
+	// so a full ring is never mistaken for an empty one
+	int fits = 0;
+	if (head - tail < burst->max_entries && len > 0 && len < burst->arena_size) {
+		if (head == tail) {
+			pos = 0;
+			fits = 1;
+		} else {
+			size_t oldest = burst->entries[tail % burst->max_entries].offset;
+			if (pos > oldest) {
+				if (pos + len <= burst->arena_size) {
+					fits = 1;
+				} else if (len < oldest) {
+					pos = 0;
+					fits = 1;
+				}
+			} else {
+				fits = pos + len < oldest;
+			}
+		}
+	}
+	if (!fits) {
+		burst->lost++;
+		return 0;
+	}
+
+	memcpy(burst->arena + pos, data, len);
+	burst_entry_t *entry = &burst->entries[head % burst->max_entries];
+	entry->offset = (uint32_t)pos;
+	entry->size = (uint32_t)len;
+	entry->time_us = (uint32_t)(now_us - burst->start_us);
+	burst->write_pos = pos + len;
+	STORE(&burst->head, head + 1);
+
+	size_t used = burst_fill(burst, head + 1, tail);
+	if (used > burst->peak_used) burst->peak_used = used;
+	return 1;
+}
+
+// Either side may end the burst. Only the first call counts, a late one must not undo burst_done()
+void burst_end(burst_t *burst) {
+	uint32_t capturing = BURST_CAPTURING;
+	__atomic_compare_exchange_n(&burst->state, &capturing, BURST_ENDED, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+int burst_peek(burst_t *burst, burst_entry_t *entry, const uint8_t **data) {
+	uint32_t tail = burst->tail;
+	if (tail == LOAD(&burst->head)) return 0;
+	*entry = burst->entries[tail % burst->max_entries];
+	*data = burst->arena + entry->offset;
+	return 1;
+}
+
+void burst_pop(burst_t *burst) {
+	uint32_t tail = burst->tail;
+	if (tail == LOAD(&burst->head)) return;
+	burst->written++;
+	burst->written_bytes += burst->entries[tail % burst->max_entries].size;
+	STORE(&burst->tail, tail + 1);
+}
+
+// The state is read first: once it says ended, every frame added before is already counted in head.
+// The consumer hands the arena back with it, the next burst can only begin after
+int burst_done(burst_t *burst) {
+	if (LOAD(&burst->state) != BURST_ENDED || burst->tail != LOAD(&burst->head)) return 0;
+	STORE(&burst->state, BURST_IDLE);
+	return 1;
+}
+
+// A snapshot taken while both sides run, each figure is exact but they may be a frame apart
+void burst_status(burst_t *burst, burst_status_t *status) {
+	uint32_t head = LOAD(&burst->head);
+	uint32_t tail = LOAD(&burst->tail);
+	size_t size = burst->arena_size ? burst->arena_size : 1;
+
+	memset(status, 0, sizeof(*status));
+	status->state = LOAD(&burst->state);
+	status->captured = burst->captured;
+	status->stored = head;
+	status->lost = burst->lost;
+	status->written = burst->written;
+	status->pending = head - tail;
+	status->fill_permille = (uint32_t)((uint64_t)burst_fill(burst, head, tail) * 1000 / size);
+	status->peak_permille = (uint32_t)((uint64_t)burst->peak_used * 1000 / size);
+	status->written_bytes = burst->written_bytes;
+}
@@ -0,0 +1,82 @@
+#ifndef BURST_H
+#define BURST_H
+
+/*
+ * burst.h - Short captures faster than the card, held in RAM until written
+ *
+ * Frames are copied into a preallocated arena as they come and described by
+ * a compact index of one burst_entry_t each, so adding a frame is a memcpy
+ * and never waits on storage. A frame that finds no room in the arena or in
+ * the index is dropped and counted, the camera is never held up.
+ *
+ * The arena is a ring with one producer, the task delivering camera frames,
+ * and one consumer, the task writing the burst out. Frames stay where they
+ * were copied until the consumer releases them, so it reads them in place,
+ * and space is given back as they are written while the capture may still
+ * be going on.
+ *
+ * A burst is begun and fed by the producer, and ended by whichever side
+ * calls burst_end() first, the consumer when the producer has gone quiet.
+ * The consumer peeks at the oldest frame and pops it once written, until
+ * burst_done() says the burst has ended and the arena is empty, which also
+ * lets the next burst begin. Nothing here blocks, wake is for a consumer
+ * that waits between frames and lock for one that ends the burst while a
+ * frame may be being added. burst_status() can be called from any task.
+ *
+ * Like clip.c, functions return non-zero on success and 0 on failure.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BURST_IDLE		0	// Written out, or never begun
+#define BURST_CAPTURING		1
+#define BURST_ENDED		2	// No more frames, the rest of the arena is still to be written
+
+typedef struct {
+	uint32_t offset;		// In the arena
+	uint32_t size;
+	uint32_t time_us;		// Since the burst began
+} burst_entry_t;
+
+typedef struct {
+	uint8_t *arena;
+	size_t arena_size;
+	burst_entry_t *entries;
+	uint32_t max_entries;
+	uint32_t state;
+	uint32_t head;			// Frames added, only the producer writes it
+	uint32_t tail;			// Frames released, only the consumer writes it
+	size_t write_pos;		// Where the producer copies the next frame
+	size_t peak_used;		// Most arena bytes held at once, the unused end of a wrapped ring included
+	uint64_t start_us;
+	uint32_t captured;		// Frames offered during the burst
+	uint32_t lost;			// Frames dropped because the arena or the index was full
+	uint32_t written;		// Frames released by the consumer
+	uint64_t written_bytes;
+	void *wake;			// Signalled by the producer's wrapper after each frame and at the end, not used here
+	void *lock;			// Held by the producer's wrapper while adding, and by a consumer ending the burst, not used here
+} burst_t;
+
+typedef struct {
+	uint32_t state;
+	uint32_t captured;
+	uint32_t stored;		// Frames that made it into the arena
+	uint32_t lost;
+	uint32_t written;
+	uint32_t pending;		// In the arena, waiting to be written
+	uint32_t fill_permille;		// Of the arena
+	uint32_t peak_permille;
+	uint64_t written_bytes;
+} burst_status_t;
+
+void burst_init(burst_t *burst, uint8_t *arena, size_t arena_size, burst_entry_t *entries, uint32_t max_entries);
+int burst_begin(burst_t *burst, uint64_t now_us);
+int burst_add(burst_t *burst, const uint8_t *data, size_t len, uint64_t now_us);
+void burst_end(burst_t *burst);
+int burst_peek(burst_t *burst, burst_entry_t *entry, const uint8_t **data);
+void burst_pop(burst_t *burst);
+int burst_done(burst_t *burst);
+void burst_status(burst_t *burst, burst_status_t *status);
+
+#endif /* BURST_H */
@@ -0,0 +1,219 @@
+/*
+ * clip.c - Lossless clip extraction and concatenation
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riff.h"
+#include "avi.h"
+#include "clip.h"
+
+struct clip_source {
+	avi_file_t avi;
+	IDX1    *entries;
+	uint32_t count;
+	long     span_start;	// File offset of the first movi byte to copy
+	long     span_end;
+	long     cut_list;	// 'rec ' list the span ends inside of, its size is cut down in the copy. 0 when none
+};
+
+// Selects the index entries of the requested frames and the contiguous movi span holding them.
+// Skipped frames may point back at an earlier chunk, so the span is taken over all entries.
+// A span that starts inside a 'rec ' list leaves its header behind, the chunks then sit directly in
+// movi. Lists are not indexed in the clip, their frames are
+static int clip_load_source(struct clip_source *src, const clip_segment_t *segment) {
+	uint32_t frame = 0;
+	uint32_t kept = 0;
+	long list_start = 0;
+	long list_end = 0;
+	long cut_end = 0;
+	long movi_end;
+
+	if (!avi_open(&src->avi, segment->in) || src->avi.idx1_count == 0) return 0;
+	src->entries = malloc((size_t)src->avi.idx1_count * sizeof(IDX1));
+	if (!src->entries) return 0;
+	if (avi_read_index(&src->avi, 0, src->avi.idx1_count, src->entries) != src->avi.idx1_count) return 0;
+
+	movi_end = src->avi.movi_pos + (long)src->avi.movi_size;
+	if (src->avi.movi_size == 0 || movi_end > src->avi.idx1_pos) movi_end = src->avi.idx1_pos;
+	src->span_start = movi_end;
+	src->span_end = 0;
+
+	for (uint32_t i = 0; i < src->avi.idx1_count; i++) {
+		IDX1 entry = src->entries[i];
+		if (entry.id == FOURCC_REC && (entry.flags & AVIIF_LIST)) {
+			list_start = src->avi.idx1_base + (long)entry.offset;
+			list_end = list_start + (long)sizeof(CHNK) + (long)entry.size;
+		}
+		if (!avi_is_frame(&entry)) continue;
+		if (frame++ < segment->first) continue;
+		if (segment->count != UINT32_MAX && kept >= segment->count) break;
+
+		long start = src->avi.idx1_base + (long)entry.offset;
+		long end = start + (long)sizeof(CHNK) + (long)entry.size + (long)(entry.size & 1);
+		if (start < src->avi.movi_pos + (long)sizeof(FOURCC) || end > movi_end) return 0;
+		if (start < src->span_start) src->span_start = start;
+		if (end > src->span_end) {
+			src->span_end = end;
+			src->cut_list = start >= list_start && end <= list_end ? list_start : 0;
+			cut_end = list_end;
+		}
+		src->entries[kept++] = entry;
+	}
+	src->count = kept;
+	if (src->cut_list < src->span_start || cut_end <= src->span_end) src->cut_list = 0;
+	return kept > 0;
+}
+
+static int clip_compatible(const struct clip_source *a, const struct clip_source *b) {
+	return a->avi.avih.width == b->avi.avih.width &&
+		a->avi.avih.height == b->avi.avih.height &&
+		a->avi.strh.handler == b->avi.strh.handler &&
+		a->avi.strh.scale == b->avi.strh.scale &&
+		a->avi.strh.rate == b->avi.strh.rate;
+}
+
+static int clip_copy(clip_t *clip, FILE *out, FILE *in, long pos, uint32_t len) {
+#if defined(__linux__)
+	if (fflush(out) == 0) {
+		int in_fd = fileno(in);
+		int out_fd = fileno(out);
+		off_t in_off = pos;
+		off_t out_off = ftell(out);
+
+		while (len > 0) {
+			ssize_t moved = copy_file_range(in_fd, &in_off, out_fd, &out_off, len, 0);
+			if (moved <= 0) {
+				// Older kernels refuse to copy across filesystems, sendfile() writes at the descriptor position instead
+				if (lseek(out_fd, out_off, SEEK_SET) < 0) break;
+				moved = sendfile(out_fd, in_fd, &in_off, len);
+				if (moved <= 0) break;
+				out_off += moved;
+			}
+			len -= (uint32_t)moved;
+			pos += (long)moved;
+			clip->bytes_copied += (uint64_t)moved;
+			clip->bytes_zero_copy += (uint64_t)moved;
+		}
+		// Bring the stdio position back in line with what the kernel wrote
+		if (fseek(out, (long)out_off, SEEK_SET) != 0) return 0;
+		if (len == 0) return 1;
+	}
+#endif
+	if (!clip->buffer) {
+		clip->buffer_size = clip->buffer_size ? clip->buffer_size : CLIP_DEFAULT_BUFFER_SIZE;
+		clip->buffer = malloc(clip->buffer_size);
+		if (!clip->buffer) return 0;
+	}
+	if (fseek(in, pos, SEEK_SET) != 0) return 0;
+	if (fcopybuf(in, out, len, clip->buffer, clip->buffer_size) != len) return 0;
+	clip->bytes_copied += len;
+	return 1;
+}
+
+static int clip_write_header(FILE *out, const struct clip_source *src, uint32_t frames, uint32_t max_frame, uint32_t movi_size, uint32_t idx1_size) {
+	AVIH avih = src->avi.avih;
+	STRH strh = src->avi.strh;
+	uint32_t strl_size = sizeof(FOURCC) + sizeof(CHNK) + sizeof(STRH) + sizeof(CHNK) + sizeof(BMPH);
+	uint32_t hdrl_size;
+	uint32_t riff_size;
+
+	if (src->avi.has_vprp) strl_size += sizeof(CHNK) + sizeof(VPRP);
+	hdrl_size = sizeof(FOURCC) + sizeof(CHNK) + sizeof(AVIH) + sizeof(CHNK) + strl_size;
+	riff_size = sizeof(FOURCC) + sizeof(CHNK) + hdrl_size + sizeof(CHNK) + movi_size + sizeof(CHNK) + idx1_size;
+
+	avih.totalFrames = frames;
+	avih.flags |= AVIF_HASINDEX;
+	avih.suggestedBufferSize = max_frame;
+	strh.length = frames;
+	strh.suggestedBufferSize = max_frame;
+
+	return fwritechunk(FOURCC_RIFF, riff_size, out) &&
+		fwritecc(FOURCC_AVI, out) &&
+		fwritechunk(FOURCC_LIST, hdrl_size, out) &&
+		fwritecc(FOURCC_HDRL, out) &&
+		fwritechunk(FOURCC_AVIH, sizeof(AVIH), out) &&
+		fwritesafe(&avih, sizeof(AVIH), out) &&
+		fwritechunk(FOURCC_LIST, strl_size, out) &&
+		fwritecc(FOURCC_STRL, out) &&
+		fwritechunk(FOURCC_STRH, sizeof(STRH), out) &&
+		fwritesafe(&strh, sizeof(STRH), out) &&
+		fwritechunk(FOURCC_STRF, sizeof(BMPH), out) &&
+		fwritesafe(&src->avi.bmph, sizeof(BMPH), out) &&
+		(!src->avi.has_vprp || (fwritechunk(FOURCC_VPRP, sizeof(VPRP), out) && fwritesafe(&src->avi.vprp, sizeof(VPRP), out))) &&
+		fwritechunk(FOURCC_LIST, movi_size, out) &&
+		fwritecc(FOURCC_MOVI, out);
+}
+
+int clip_write(clip_t *clip, FILE *out, const clip_segment_t *segments, int count) {
+	struct clip_source *src;
+	uint32_t frames = 0;
+	uint32_t max_frame = 0;
+	uint32_t movi_size = sizeof(FOURCC);
+	uint32_t movi_cursor = sizeof(FOURCC);
+	int ok = 0;
+
+	if (!clip || !out || !segments || count <= 0) return 0;
+	src = calloc(count, sizeof(*src));
+	if (!src) return 0;
+
+	for (int s = 0; s < count; s++) {
+		if (!clip_load_source(&src[s], &segments[s])) goto done;
+		if (s > 0 && !clip_compatible(&src[0], &src[s])) goto done;
+		frames += src[s].count;
+		movi_size += (uint32_t)(src[s].span_end - src[s].span_start);
+		for (uint32_t i = 0; i < src[s].count; i++) {
+			if (src[s].entries[i].size > max_frame) max_frame = src[s].entries[i].size;
+		}
+	}
+
+	// Every size is known up front, so the header goes out once and is never patched
+	if (!clip_write_header(out, &src[0], frames, max_frame, movi_size, frames * sizeof(IDX1))) goto done;
+	for (int s = 0; s < count; s++) {
+		long from = src[s].span_start;
+		if (src[s].cut_list) {
+			uint32_t list_size = (uint32_t)(src[s].span_end - src[s].cut_list - (long)sizeof(CHNK));
+			if (!clip_copy(clip, out, src[s].avi.file, from, (uint32_t)(src[s].cut_list + (long)sizeof(FOURCC) - from)) ||
+				fwritesafe(&list_size, sizeof(list_size), out) != sizeof(list_size)) goto done;
+			from = src[s].cut_list + (long)sizeof(CHNK);
+		}
+		if (!clip_copy(clip, out, src[s].avi.file, from, (uint32_t)(src[s].span_end - from))) goto done;
+	}
+
+	if (!fwritechunk(FOURCC_IDX1, frames * sizeof(IDX1), out)) goto done;
+	for (int s = 0; s < count; s++) {
+		for (uint32_t i = 0; i < src[s].count; i++) {
+			IDX1 *entry = &src[s].entries[i];
+			entry->offset = (uint32_t)(src[s].avi.idx1_base + (long)entry->offset - src[s].span_start) + movi_cursor;
+		}
+		if (fwritesafe(src[s].entries, src[s].count * sizeof(IDX1), out) != src[s].count * sizeof(IDX1)) goto done;
+		movi_cursor += (uint32_t)(src[s].span_end - src[s].span_start);
+	}
+	clip->frames = frames;
+	ok = fflush(out) == 0;
+
+done:
+	for (int s = 0; s < count; s++) {
+		free(src[s].entries);
+	}
+	free(src);
+	return ok;
+}
+
+int clip_extract(clip_t *clip, FILE *out, FILE *in, uint32_t first, uint32_t count) {
+	clip_segment_t segment = {
+		.in	= in,
+		.first	= first,
+		.count	= count,
+	};
+	return clip_write(clip, out, &segment, 1);
+}
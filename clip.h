@@ -0,0 +1,38 @@
+#ifndef CLIP_H
+#define CLIP_H
+
+/*
+ * clip.h - Lossless clip extraction and concatenation
+ *
+ * Frames are never decoded or re-muxed one by one. The movi bytes covering a
+ * frame range are moved in one piece and the headers and idx1 of the new file
+ * are rebuilt from the source index. On Linux the payload moves with
+ * copy_file_range()/sendfile() and never enters user space. Elsewhere it goes
+ * through one reusable heap buffer supplied by the caller.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "riff.h"
+
+#define CLIP_DEFAULT_BUFFER_SIZE	(256 * 1024)
+
+typedef struct {
+	FILE    *in;
+	uint32_t first;		// First frame to copy
+	uint32_t count;		// Number of frames, UINT32_MAX for everything up to the end
+} clip_segment_t;
+
+typedef struct {
+	uint8_t *buffer;	// Bounce buffer for the portable copy path, allocated on demand when NULL
+	size_t   buffer_size;
+	uint64_t bytes_copied;	// Payload bytes moved, excluding headers and index
+	uint64_t bytes_zero_copy;	// Part of bytes_copied that was moved by the kernel
+	uint32_t frames;
+} clip_t;
+
+int clip_write(clip_t *clip, FILE *out, const clip_segment_t *segments, int count);
+int clip_extract(clip_t *clip, FILE *out, FILE *in, uint32_t first, uint32_t count);
+
+#endif /* CLIP_H */
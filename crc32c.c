@@ -0,0 +1,119 @@
+/*
+ * crc32c.c - CRC32C (Castagnoli) for frame integrity records
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(ESP_PLATFORM)
+#include "freertos/FreeRTOS.h"
+#else
+#include <pthread.h>
+#endif
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_HW_BYTE(c, b)	_mm_crc32_u8(c, b)
+#define CRC32C_HW_WORD(c, w)	((uint32_t)_mm_crc32_u64(c, w))
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__)
+#include <arm_acle.h>
+#define CRC32C_HW_BYTE(c, b)	__crc32cb(c, b)
+#define CRC32C_HW_WORD(c, w)	__crc32cd(c, w)
+#endif
+
+#define CRC32C_POLY	0x82F63B78u	// Reflected Castagnoli polynomial
+
+static uint32_t crc32c_table[8][256];
+#if defined(ESP_PLATFORM)
+static portMUX_TYPE crc32c_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool crc32c_ready;
+#else
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#endif
+
+// Builds the slice-by-8 tables, only ever run once
+static void crc32c_build(void) {
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+		crc32c_table[0][n] = c;
+	}
+	for (uint32_t n = 0; n < 256; n++) {
+		for (int t = 1; t < 8; t++) {
+			crc32c_table[t][n] = (crc32c_table[t - 1][n] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][n] & 0xFF];
+		}
+	}
+}
+
+// Builds the tables on the first call, later calls and calls racing with it return once they are complete
+void crc32c_init(void) {
+#if defined(ESP_PLATFORM)
+	portENTER_CRITICAL(&crc32c_lock);
+	if (!crc32c_ready) {
+		crc32c_build();
+		crc32c_ready = true;
+	}
+	portEXIT_CRITICAL(&crc32c_lock);
+#else
+	pthread_once(&crc32c_once, crc32c_build);
+#endif
+}
+
+static inline uint32_t crc32c_load32(const uint8_t *p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t crc32c_update_sw(uint32_t crc, const void *data, size_t len) {
+	const uint8_t *p = data;
+	uint32_t c = ~crc;
+
+	crc32c_init();
+	// Byte steps up to an 8 byte boundary, then eight bytes per step
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xFF];
+		len--;
+	}
+	while (len >= 8) {
+		uint32_t lo = c ^ crc32c_load32(p);
+		uint32_t hi = crc32c_load32(p + 4);
+		c = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+			crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+			crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+			crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xFF];
+	}
+	return ~c;
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+#if defined(CRC32C_HW_WORD)
+	const uint8_t *p = data;
+	uint32_t c = ~crc;
+
+	while (len > 0 && ((uintptr_t)p & 7)) {
+		c = CRC32C_HW_BYTE(c, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = CRC32C_HW_WORD(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		c = CRC32C_HW_BYTE(c, *p++);
+	}
+	return ~c;
+#else
+	return crc32c_update_sw(crc, data, len);
+#endif
+}
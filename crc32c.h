@@ -0,0 +1,24 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+/*
+ * crc32c.h - CRC32C (Castagnoli) for frame integrity records
+ *
+ * crc32c_update() chains like zlib's crc32(): start from 0 and feed the
+ * buffer in as many pieces as convenient. It uses the SSE4.2 or ARMv8 CRC
+ * instructions when the compiler targets them and slice-by-8 tables
+ * everywhere else, including the ESP32.
+ *
+ * The tables are built once, by whichever thread checksums first. Calling
+ * crc32c_init() at startup builds them up front instead, so no recording
+ * pays for it on its first frame.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+void crc32c_init(void);
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len);
+uint32_t crc32c_update_sw(uint32_t crc, const void *data, size_t len);
+
+#endif /* CRC32C_H */
@@ -0,0 +1,122 @@
+/*
+ * crop.c - Lossless MCU-aligned crop of baseline JPEG frames
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "crop.h"
+#include "jpeg.h"
+
+#define WR16(p, v) do { (p)[0] = (uint8_t)((v) >> 8); (p)[1] = (uint8_t)(v); } while (0)
+
+// Widens the rectangle to CROP_ALIGN and clips it to the frame, fails when nothing is left
+int crop_align(crop_rect_t *rect, uint16_t frame_width, uint16_t frame_height) {
+	uint32_t x0 = rect->x / CROP_ALIGN * CROP_ALIGN;
+	uint32_t y0 = rect->y / CROP_ALIGN * CROP_ALIGN;
+	uint32_t x1 = ((uint32_t)rect->x + rect->width + CROP_ALIGN - 1) / CROP_ALIGN * CROP_ALIGN;
+	uint32_t y1 = ((uint32_t)rect->y + rect->height + CROP_ALIGN - 1) / CROP_ALIGN * CROP_ALIGN;
+
+	if (x1 > frame_width) x1 = frame_width;
+	if (y1 > frame_height) y1 = frame_height;
+	if (x0 >= x1 || y0 >= y1) return 0;
+	rect->x = (uint16_t)x0;
+	rect->y = (uint16_t)y0;
+	rect->width = (uint16_t)(x1 - x0);
+	rect->height = (uint16_t)(y1 - y0);
+	return 1;
+}
+
+// Index of the first MCU at or after mcu that is inside the rectangle, total when there is none
+static uint32_t crop_next_mcu(const jpeg_info_t *info, uint32_t mcu, uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
+	uint32_t total = (uint32_t)info->mcus_x * info->mcus_y;
+	uint32_t row = mcu / info->mcus_x;
+	uint32_t col = mcu % info->mcus_x;
+
+	if (row < y0) return (uint32_t)y0 * info->mcus_x + x0;
+	if (col >= x1) {
+		row++;
+		col = x0;
+	} else if (col < x0) {
+		col = x0;
+	}
+	return row < y1 ? row * info->mcus_x + col : total;
+}
+
+size_t crop_jpeg(crop_t *crop, const uint8_t *data, size_t len, const crop_rect_t *rect, uint8_t *out, size_t cap) {
+	jpeg_info_t *info = &crop->jpeg;
+	jpeg_scan_t scan;
+	jpeg_writer_t w;
+	int16_t pred[JPEG_MAX_COMPONENTS] = { 0 };
+	int16_t dc[JPEG_MAX_MCU_BLOCKS];
+
+	crop->overflow = 0;
+	if (!jpeg_parse(info, data, len)) return 0;
+
+	uint16_t mcu_w = 8 * info->max_h;
+	uint16_t mcu_h = 8 * info->max_v;
+	uint32_t right = (uint32_t)rect->x + rect->width;
+	uint32_t bottom = (uint32_t)rect->y + rect->height;
+	if (rect->width == 0 || rect->height == 0 || right > info->width || bottom > info->height ||
+		rect->x % mcu_w != 0 || rect->y % mcu_h != 0 ||
+		(right % mcu_w != 0 && right != info->width) || (bottom % mcu_h != 0 && bottom != info->height)) {
+		return 0;
+	}
+	uint16_t x0 = rect->x / mcu_w;
+	uint16_t y0 = rect->y / mcu_h;
+	uint16_t x1 = (uint16_t)((right + mcu_w - 1) / mcu_w);
+	uint16_t y1 = (uint16_t)((bottom + mcu_h - 1) / mcu_h);
+
+	// Everything up to the scan is kept, only the size changes and restart markers go
+	if (cap < info->scan_pos + 2) {
+		crop->overflow = 1;
+		return 0;
+	}
+	memcpy(out, data, info->scan_pos);
+	WR16(out + info->sof_pos + 5, rect->height);
+	WR16(out + info->sof_pos + 7, rect->width);
+	if (info->dri_pos) WR16(out + info->dri_pos + 4, 0);
+
+	for (int t = 0; t < JPEG_MAX_HUFF_TABLES; t++) {
+		jpeg_build_huff_enc(&crop->dc[t], info->dc[t].bits, info->dc[t].huffval);
+		jpeg_build_huff_enc(&crop->ac[t], info->ac[t].bits, info->ac[t].huffval);
+	}
+
+	jpeg_scan_begin(&scan, info);
+	jpeg_writer_begin(&w, out + info->scan_pos, cap - info->scan_pos - 2);
+	uint32_t total = (uint32_t)info->mcus_x * info->mcus_y;
+	for (;;) {
+		uint32_t next = crop_next_mcu(info, scan.mcu, x0, y0, x1, y1);
+		if (next >= total) break;
+
+		// A restart interval that ends before the next MCU we need is never decoded
+		if (info->restart_interval) {
+			uint32_t left = scan.todo ? scan.todo : info->restart_interval;
+			if (next >= scan.mcu + left) {
+				if (!jpeg_scan_skip_interval(&scan)) return 0;
+				continue;
+			}
+		}
+
+		if (scan.mcu != next) {
+			// Only the DC predictors have to be followed through the MCUs left out
+			if (!jpeg_decode_mcu_dc(&scan, dc)) return 0;
+			continue;
+		}
+		if (!jpeg_decode_mcu(&scan, crop->coef)) return 0;
+		for (int b = 0; b < info->mcu_blocks; b++) {
+			const jpeg_component_t *comp = &info->comp[info->mcu_comp[b]];
+			if (!jpeg_encode_block(&w, crop->coef[b], &pred[info->mcu_comp[b]], &crop->dc[comp->td], &crop->ac[comp->ta])) return 0;
+		}
+	}
+
+	size_t scan_len = jpeg_writer_end(&w);
+	if (scan_len == 0) {
+		crop->overflow = w.overflow;
+		return 0;
+	}
+	out[info->scan_pos + scan_len] = 0xFF;
+	out[info->scan_pos + scan_len + 1] = JPEG_MARKER_EOI;
+	return info->scan_pos + scan_len + 2;
+}
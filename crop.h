@@ -0,0 +1,48 @@
+#ifndef CROP_H
+#define CROP_H
+
+/*
+ * crop.h - Lossless MCU-aligned crop of baseline JPEG frames
+ *
+ * Keeps the MCUs inside a rectangle and drops the rest, on the quantised
+ * coefficients (see jpeg.h): the MCUs inside are decoded and encoded again
+ * with the frame's own tables, the ones before them only have their DC
+ * tracked, and nothing after the last one is even decoded. Whole restart
+ * intervals outside the rectangle are skipped without decoding. The output
+ * has the same tables and quantisers, the SOF gives the new size and the
+ * restart interval is dropped, so the pixels inside the rectangle are
+ * exactly those of the original.
+ *
+ * The rectangle has to start on the MCU grid of the frame and end on it or
+ * at the right and bottom edge of the frame. With every side a multiple of
+ * CROP_ALIGN that holds for every common subsampling.
+ *
+ * Like jpeg.c, functions return non-zero on success and 0 on failure.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jpeg.h"
+
+#define CROP_ALIGN	16	// MCU size of 4:2:0, the largest one cameras produce
+
+typedef struct {
+	uint16_t x;
+	uint16_t y;
+	uint16_t width;
+	uint16_t height;
+} crop_rect_t;
+
+typedef struct {
+	jpeg_info_t jpeg;
+	jpeg_huff_enc_t dc[JPEG_MAX_HUFF_TABLES];
+	jpeg_huff_enc_t ac[JPEG_MAX_HUFF_TABLES];
+	int16_t coef[JPEG_MAX_MCU_BLOCKS][64];
+	int overflow;			// Set when the last crop failed only because the output buffer was too small
+} crop_t;
+
+int crop_align(crop_rect_t *rect, uint16_t frame_width, uint16_t frame_height);
+size_t crop_jpeg(crop_t *crop, const uint8_t *data, size_t len, const crop_rect_t *rect, uint8_t *out, size_t cap);
+
+#endif /* CROP_H */
@@ -0,0 +1,288 @@
+/*
+ * fmp4.c - Fragmented MP4 boxes for Motion JPEG
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fmp4.h"
+
+#define FMP4_OBJECT_TYPE_JPEG	0x6C	// ISO/IEC 14496-1 objectTypeIndication, Visual ISO/IEC 10918-1
+#define FMP4_STREAM_TYPE_VISUAL	0x04
+
+#define FMP4_TFHD_DEFAULT_BASE_IS_MOOF	0x020000
+#define FMP4_TRUN_DATA_OFFSET		0x000001
+#define FMP4_TRUN_SAMPLE_DURATION	0x000100
+#define FMP4_TRUN_SAMPLE_SIZE		0x000200
+
+typedef struct {
+	uint8_t *buf;
+	size_t cap;
+	size_t len;
+	int overflow;
+} fmp4_writer_t;
+
+static void put(fmp4_writer_t *w, const void *data, size_t len) {
+	if (w->overflow || len > w->cap - w->len) {
+		w->overflow = 1;
+		return;
+	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+}
+
+static void put8(fmp4_writer_t *w, uint8_t v) {
+	put(w, &v, 1);
+}
+
+static void put16(fmp4_writer_t *w, uint16_t v) {
+	uint8_t b[2] = { v >> 8, v };
+	put(w, b, sizeof(b));
+}
+
+static void put32(fmp4_writer_t *w, uint32_t v) {
+	uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v };
+	put(w, b, sizeof(b));
+}
+
+static void put64(fmp4_writer_t *w, uint64_t v) {
+	put32(w, (uint32_t)(v >> 32));
+	put32(w, (uint32_t)v);
+}
+
+static void zeros(fmp4_writer_t *w, size_t len) {
+	while (len-- > 0) put8(w, 0);
+}
+
+// Opens a box, its size is filled in by box_end()
+static size_t box(fmp4_writer_t *w, const char type[4]) {
+	size_t start = w->len;
+	put32(w, 0);
+	put(w, type, 4);
+	return start;
+}
+
+static size_t full_box(fmp4_writer_t *w, const char type[4], uint8_t version, uint32_t flags) {
+	size_t start = box(w, type);
+	put32(w, (uint32_t)version << 24 | (flags & 0xFFFFFF));
+	return start;
+}
+
+static void box_end(fmp4_writer_t *w, size_t start) {
+	if (w->overflow) return;
+	uint32_t size = (uint32_t)(w->len - start);
+	uint8_t b[4] = { size >> 24, size >> 16, size >> 8, size };
+	memcpy(w->buf + start, b, sizeof(b));
+}
+
+static void matrix(fmp4_writer_t *w) {
+	static const uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	for (int i = 0; i < 9; i++) put32(w, unity[i]);
+}
+
+// Sample entry: an MPEG-4 visual entry whose decoder is JPEG, as ffmpeg and GPAC expect for Motion JPEG
+static void sample_entry(fmp4_writer_t *w, const fmp4_track_t *track) {
+	size_t mp4v = box(w, "mp4v");
+	zeros(w, 6);
+	put16(w, 1);				// data_reference_index
+	zeros(w, 16);
+	put16(w, track->width);
+	put16(w, track->height);
+	put32(w, 0x00480000);			// 72 dpi
+	put32(w, 0x00480000);
+	put32(w, 0);
+	put16(w, 1);				// frame_count
+	zeros(w, 32);				// compressorname
+	put16(w, 0x0018);
+	put16(w, 0xFFFF);
+
+	size_t esds = full_box(w, "esds", 0, 0);
+	put8(w, 0x03);				// ES_Descriptor
+	put8(w, 3 + 2 + 13 + 3);
+	put16(w, 0);				// ES_ID
+	put8(w, 0);
+	put8(w, 0x04);				// DecoderConfigDescriptor
+	put8(w, 13);
+	put8(w, FMP4_OBJECT_TYPE_JPEG);
+	put8(w, FMP4_STREAM_TYPE_VISUAL << 2 | 1);
+	zeros(w, 3 + 4 + 4);			// bufferSizeDB, maxBitrate, avgBitrate
+	put8(w, 0x06);				// SLConfigDescriptor
+	put8(w, 1);
+	put8(w, 0x02);
+	box_end(w, esds);
+	box_end(w, mp4v);
+}
+
+static void sample_table(fmp4_writer_t *w, const fmp4_track_t *track) {
+	size_t stbl = box(w, "stbl");
+	size_t stsd = full_box(w, "stsd", 0, 0);
+	put32(w, 1);
+	sample_entry(w, track);
+	box_end(w, stsd);
+
+	// Every sample lives in the fragments, the tables of the init segment stay empty
+	static const char *const empty[] = { "stts", "stsc", "stco" };
+	for (int i = 0; i < 3; i++) {
+		size_t b = full_box(w, empty[i], 0, 0);
+		put32(w, 0);
+		box_end(w, b);
+	}
+	size_t stsz = full_box(w, "stsz", 0, 0);
+	put32(w, 0);
+	put32(w, 0);
+	box_end(w, stsz);
+	box_end(w, stbl);
+}
+
+size_t fmp4_init_segment(uint8_t *buf, size_t cap, const fmp4_track_t *track, size_t *mehd_pos) {
+	fmp4_writer_t w = { buf, cap, 0, 0 };
+
+	size_t ftyp = box(&w, "ftyp");
+	put(&w, "isom", 4);
+	put32(&w, 0x200);
+	put(&w, "isomiso6mp41", 12);
+	box_end(&w, ftyp);
+
+	size_t moov = box(&w, "moov");
+	size_t mvhd = full_box(&w, "mvhd", 0, 0);
+	put32(&w, 0);				// creation_time
+	put32(&w, 0);				// modification_time
+	put32(&w, FMP4_MOVIE_TIMESCALE);
+	put32(&w, 0);				// duration, mehd has it once known
+	put32(&w, 0x00010000);			// rate
+	put16(&w, 0x0100);			// volume
+	zeros(&w, 10);
+	matrix(&w);
+	zeros(&w, 24);
+	put32(&w, FMP4_TRACK_ID + 1);		// next_track_ID
+	box_end(&w, mvhd);
+
+	size_t trak = box(&w, "trak");
+	size_t tkhd = full_box(&w, "tkhd", 0, 0x000003);	// Enabled, in movie
+	put32(&w, 0);
+	put32(&w, 0);
+	put32(&w, FMP4_TRACK_ID);
+	put32(&w, 0);
+	put32(&w, 0);				// duration
+	zeros(&w, 8);
+	put16(&w, 0);				// layer
+	put16(&w, 0);				// alternate_group
+	put16(&w, 0);				// volume
+	put16(&w, 0);
+	matrix(&w);
+	put32(&w, (uint32_t)track->width << 16);
+	put32(&w, (uint32_t)track->height << 16);
+	box_end(&w, tkhd);
+
+	size_t mdia = box(&w, "mdia");
+	size_t mdhd = full_box(&w, "mdhd", 0, 0);
+	put32(&w, 0);
+	put32(&w, 0);
+	put32(&w, FMP4_TIMESCALE);
+	put32(&w, 0);
+	put16(&w, 0x55C4);			// 'und'
+	put16(&w, 0);
+	box_end(&w, mdhd);
+
+	size_t hdlr = full_box(&w, "hdlr", 0, 0);
+	put32(&w, 0);
+	put(&w, "vide", 4);
+	zeros(&w, 12);
+	put(&w, "VideoHandler", 13);
+	box_end(&w, hdlr);
+
+	size_t minf = box(&w, "minf");
+	size_t vmhd = full_box(&w, "vmhd", 0, 1);
+	zeros(&w, 8);
+	box_end(&w, vmhd);
+	size_t dinf = box(&w, "dinf");
+	size_t dref = full_box(&w, "dref", 0, 0);
+	put32(&w, 1);
+	size_t url = full_box(&w, "url ", 0, 1);	// Media in this file
+	box_end(&w, url);
+	box_end(&w, dref);
+	box_end(&w, dinf);
+	sample_table(&w, track);
+	box_end(&w, minf);
+	box_end(&w, mdia);
+	box_end(&w, trak);
+
+	size_t mvex = box(&w, "mvex");
+	size_t mehd = full_box(&w, "mehd", 0, 0);
+	if (mehd_pos) *mehd_pos = w.len;
+	put32(&w, 0);				// fragment_duration, patched when the recording is closed
+	box_end(&w, mehd);
+	size_t trex = full_box(&w, "trex", 0, 0);
+	put32(&w, FMP4_TRACK_ID);
+	put32(&w, 1);				// default_sample_description_index
+	put32(&w, track->sample_duration);
+	put32(&w, 0);
+	put32(&w, 0);				// Every JPEG frame is a sync sample
+	box_end(&w, trex);
+	box_end(&w, mvex);
+	box_end(&w, moov);
+
+	return w.overflow ? 0 : w.len;
+}
+
+static void mdat_header(fmp4_writer_t *w, uint32_t size) {
+	put32(w, size);
+	put(w, "mdat", 4);
+}
+
+// What sits on the card while a fragment is open: the reserved region as one free box, then an mdat that runs to
+// the end of the file. A reader of a recording cut short skips both
+size_t fmp4_placeholder(uint8_t *buf, size_t cap, size_t reserved) {
+	fmp4_writer_t w = { buf, cap, 0, 0 };
+
+	if (reserved < 8) return 0;
+	size_t free_box = box(&w, "free");
+	zeros(&w, reserved - 8);
+	box_end(&w, free_box);
+	mdat_header(&w, 0);
+	return w.overflow ? 0 : w.len;
+}
+
+// Replaces the placeholder: the moof, a free box for the entries not used, then the mdat header
+size_t fmp4_moof(uint8_t *buf, size_t cap, uint32_t sequence, uint64_t base_time,
+		const fmp4_sample_t *samples, uint32_t count, size_t reserved) {
+	fmp4_writer_t w = { buf, cap, 0, 0 };
+	uint32_t mdat_size = FMP4_MDAT_HEADER;
+
+	if (reserved < FMP4_MOOF_SIZE(count)) return 0;
+	size_t left = reserved - FMP4_MOOF_SIZE(count);
+	if (left > 0 && left < 8) return 0;
+
+	size_t moof = box(&w, "moof");
+	size_t mfhd = full_box(&w, "mfhd", 0, 0);
+	put32(&w, sequence);
+	box_end(&w, mfhd);
+
+	size_t traf = box(&w, "traf");
+	size_t tfhd = full_box(&w, "tfhd", 0, FMP4_TFHD_DEFAULT_BASE_IS_MOOF);
+	put32(&w, FMP4_TRACK_ID);
+	box_end(&w, tfhd);
+	size_t tfdt = full_box(&w, "tfdt", 1, 0);
+	put64(&w, base_time);
+	box_end(&w, tfdt);
+	size_t trun = full_box(&w, "trun", 0, FMP4_TRUN_DATA_OFFSET | FMP4_TRUN_SAMPLE_DURATION | FMP4_TRUN_SAMPLE_SIZE);
+	put32(&w, count);
+	put32(&w, (uint32_t)(reserved + FMP4_MDAT_HEADER));	// data_offset, from the start of the moof
+	for (uint32_t i = 0; i < count; i++) {
+		put32(&w, samples[i].duration);
+		put32(&w, samples[i].size);
+		mdat_size += samples[i].size;
+	}
+	box_end(&w, trun);
+	box_end(&w, traf);
+	box_end(&w, moof);
+
+	if (left > 0) {
+		size_t free_box = box(&w, "free");
+		zeros(&w, left - 8);
+		box_end(&w, free_box);
+	}
+	mdat_header(&w, mdat_size);
+	return w.overflow ? 0 : w.len;
+}
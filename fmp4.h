@@ -0,0 +1,52 @@
+#ifndef FMP4_H
+#define FMP4_H
+
+/*
+ * fmp4.h - Fragmented MP4 boxes for Motion JPEG
+ *
+ * Builds the boxes of a fragmented ISO BMFF file holding one Motion JPEG
+ * track ('mp4v' with the JPEG object type): the init segment (ftyp, moov
+ * with empty sample tables and mvex) and one moof per fragment. Nothing
+ * here does I/O; like riff.c it only lays out bytes, all big endian.
+ *
+ * Every fragment is written as a fixed size region reserved for its moof,
+ * followed by its mdat. Frames go into the mdat as they arrive and the moof
+ * is written into the region once the fragment is complete, with a 'free'
+ * box taking up whatever the actual sample count leaves over. Until then the
+ * region holds fmp4_placeholder(), a 'free' box and an mdat running to the
+ * end of the file, so a recording cut short is still a valid file that loses
+ * only the fragment in progress.
+ *
+ * Functions return the number of bytes laid out, 0 when the buffer is too
+ * small.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FMP4_TIMESCALE		1000000		// Media time in microseconds
+#define FMP4_MOVIE_TIMESCALE	1000		// mvhd/mehd in milliseconds, 32 bits last 49 days
+#define FMP4_TRACK_ID		1
+#define FMP4_MDAT_HEADER	8
+
+// Bytes of a moof holding the given number of samples. The placeholder and the
+// moof that replaces it both take the reserved size plus FMP4_MDAT_HEADER
+#define FMP4_MOOF_SIZE(samples)	(88 + 8 * (size_t)(samples))
+
+typedef struct {
+	uint16_t width;
+	uint16_t height;
+	uint32_t sample_duration;	// Nominal frame period, in FMP4_TIMESCALE units
+} fmp4_track_t;
+
+typedef struct {
+	uint32_t duration;
+	uint32_t size;
+} fmp4_sample_t;
+
+size_t fmp4_init_segment(uint8_t *buf, size_t cap, const fmp4_track_t *track, size_t *mehd_pos);
+size_t fmp4_placeholder(uint8_t *buf, size_t cap, size_t reserved);
+size_t fmp4_moof(uint8_t *buf, size_t cap, uint32_t sequence, uint64_t base_time,
+	const fmp4_sample_t *samples, uint32_t count, size_t reserved);
+
+#endif /* FMP4_H */
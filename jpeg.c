@@ -0,0 +1,579 @@
+/*
+ * jpeg.c - Baseline JPEG entropy helpers
+ *
+ * Marker parsing follows ITU T.81 Annex B, Huffman decoding follows Annex F.2
+ * with a lookahead table for the common short codes, encoding follows Annex
+ * F.1.2 with the code tables of Annex C.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "jpeg.h"
+
+/* Annex K.3 tables, used when a frame carries no DHT (AVI1 style MJPEG) */
+const uint8_t jpeg_std_dc_luma_bits[17] = { 0, 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+const uint8_t jpeg_std_dc_luma_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+const uint8_t jpeg_std_dc_chroma_bits[17] = { 0, 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+const uint8_t jpeg_std_dc_chroma_vals[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+const uint8_t jpeg_std_ac_luma_bits[17] = { 0, 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+const uint8_t jpeg_std_ac_luma_vals[162] = {
+	0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+	0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+	0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+	0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+	0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+	0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+	0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+	0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+const uint8_t jpeg_std_ac_chroma_bits[17] = { 0, 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+const uint8_t jpeg_std_ac_chroma_vals[162] = {
+	0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+	0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+	0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+	0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+	0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+	0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+	0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+	0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+	0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+	0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+	0xf9, 0xfa
+};
+
+#define RD16(p) (((uint16_t)(p)[0] << 8) | (p)[1])
+
+int jpeg_build_huff(jpeg_huff_t *huff, const uint8_t bits[17], const uint8_t *vals) {
+	int32_t code = 0;
+	int k = 0;
+
+	memcpy(huff->bits, bits, sizeof(huff->bits));
+	memset(huff->look, 0, sizeof(huff->look));
+	for (int len = 1; len <= 16; len++) {
+		k += bits[len];
+	}
+	if (k > 256) return 0;
+	memcpy(huff->huffval, vals, k);
+
+	k = 0;
+	for (int len = 1; len <= 16; len++) {
+		huff->valoffset[len] = k - code;
+		for (int i = 0; i < bits[len]; i++, k++, code++) {
+			if (len <= JPEG_HUFF_LOOKAHEAD) {
+				// Every lookahead pattern starting with this code decodes to it
+				int shift = JPEG_HUFF_LOOKAHEAD - len;
+				for (int fill = 0; fill < (1 << shift); fill++) {
+					huff->look[(code << shift) | fill] = (uint16_t)((len << 8) | huff->huffval[k]);
+				}
+			}
+		}
+		huff->maxcode[len] = bits[len] ? code - 1 : -1;
+		if (code > (1 << len)) return 0;
+		code <<= 1;
+	}
+	huff->maxcode[17] = 0x7fffffff;
+	return 1;
+}
+
+static int jpeg_parse_dht(jpeg_info_t *info, const uint8_t *seg, size_t len) {
+	while (len > 17) {
+		uint8_t tc = seg[0] >> 4;
+		uint8_t th = seg[0] & 0x0f;
+		uint8_t bits[17] = { 0 };
+		size_t count = 0;
+		for (int i = 1; i <= 16; i++) {
+			bits[i] = seg[i];
+			count += bits[i];
+		}
+		if (tc > 1 || th >= JPEG_MAX_HUFF_TABLES || count > 256 || len < 17 + count) return 0;
+		if (!jpeg_build_huff(tc ? &info->ac[th] : &info->dc[th], bits, seg + 17)) return 0;
+		seg += 17 + count;
+		len -= 17 + count;
+	}
+	info->has_dht = 1;
+	return len == 0;
+}
+
+static int jpeg_parse_dqt(jpeg_info_t *info, const uint8_t *seg, size_t len) {
+	while (len > 0) {
+		uint8_t pq = seg[0] >> 4;
+		uint8_t tq = seg[0] & 0x0f;
+		size_t size = 1 + (pq ? 128 : 64);
+		if (tq > 3 || len < size) return 0;
+		info->dc_quant[tq] = pq ? RD16(seg + 1) : seg[1];
+		seg += size;
+		len -= size;
+	}
+	return 1;
+}
+
+static int jpeg_parse_sof(jpeg_info_t *info, const uint8_t *seg, size_t len) {
+	if (len < 6 || seg[0] != 8) return 0;
+	info->height = RD16(seg + 1);
+	info->width = RD16(seg + 3);
+	info->num_components = seg[5];
+	if (info->num_components != 1 && info->num_components != JPEG_MAX_COMPONENTS) return 0;
+	if (len < 6 + 3u * info->num_components || info->width == 0 || info->height == 0) return 0;
+
+	info->max_h = 1;
+	info->max_v = 1;
+	for (int c = 0; c < info->num_components; c++) {
+		jpeg_component_t *comp = &info->comp[c];
+		comp->id = seg[6 + 3 * c];
+		comp->h = seg[7 + 3 * c] >> 4;
+		comp->v = seg[7 + 3 * c] & 0x0f;
+		comp->tq = seg[8 + 3 * c];
+		if (comp->h < 1 || comp->h > 4 || comp->v < 1 || comp->v > 4 || comp->tq > 3) return 0;
+		if (comp->h > info->max_h) info->max_h = comp->h;
+		if (comp->v > info->max_v) info->max_v = comp->v;
+	}
+	// A single component scan is never interleaved, so each MCU is exactly one block
+	if (info->num_components == 1) {
+		info->comp[0].h = 1;
+		info->comp[0].v = 1;
+		info->max_h = 1;
+		info->max_v = 1;
+	}
+
+	info->mcus_x = (info->width + 8 * info->max_h - 1) / (8 * info->max_h);
+	info->mcus_y = (info->height + 8 * info->max_v - 1) / (8 * info->max_v);
+	info->mcu_blocks = 0;
+	for (int c = 0; c < info->num_components; c++) {
+		jpeg_component_t *comp = &info->comp[c];
+		comp->blocks_w = info->mcus_x * comp->h;
+		comp->blocks_h = info->mcus_y * comp->v;
+		for (int by = 0; by < comp->v; by++) {
+			for (int bx = 0; bx < comp->h; bx++) {
+				if (info->mcu_blocks >= JPEG_MAX_MCU_BLOCKS) return 0;
+				info->mcu_comp[info->mcu_blocks] = c;
+				info->mcu_bx[info->mcu_blocks] = bx;
+				info->mcu_by[info->mcu_blocks] = by;
+				info->mcu_blocks++;
+			}
+		}
+	}
+	return 1;
+}
+
+static int jpeg_parse_sos(jpeg_info_t *info, const uint8_t *seg, size_t len) {
+	if (len < 1 || seg[0] != info->num_components || len < 4 + 2u * seg[0]) return 0;
+	for (int i = 0; i < seg[0]; i++) {
+		jpeg_component_t *comp = &info->comp[i];
+		if (seg[1 + 2 * i] != comp->id) return 0;
+		comp->td = seg[2 + 2 * i] >> 4;
+		comp->ta = seg[2 + 2 * i] & 0x0f;
+		if (comp->td >= JPEG_MAX_HUFF_TABLES || comp->ta >= JPEG_MAX_HUFF_TABLES) return 0;
+	}
+	// Baseline sequential: full spectral range, no successive approximation
+	seg += 1 + 2 * seg[0];
+	return seg[0] == 0 && seg[1] == 63 && seg[2] == 0;
+}
+
+int jpeg_parse(jpeg_info_t *info, const uint8_t *data, size_t len) {
+	size_t pos = 2;
+	int have_sof = 0;
+
+	if (!info || !data || len < 4 || data[0] != 0xFF || data[1] != JPEG_MARKER_SOI) return 0;
+	info->data = data;
+	info->len = len;
+	info->restart_interval = 0;
+	info->dri_pos = 0;
+	info->has_dht = 0;
+
+	while (pos + 4 <= len) {
+		uint8_t marker;
+		size_t seg_len;
+
+		if (data[pos] != 0xFF) return 0;
+		// Any number of 0xFF fill bytes may precede a marker
+		while (pos < len && data[pos] == 0xFF) pos++;
+		if (pos + 3 > len) return 0;
+		marker = data[pos++];
+		seg_len = RD16(data + pos);
+		if (seg_len < 2 || pos + seg_len > len) return 0;
+
+		const uint8_t *seg = data + pos + 2;
+		switch (marker) {
+		case JPEG_MARKER_SOF0:
+		case JPEG_MARKER_SOF1:
+			info->sof_pos = pos - 2;
+			if (!jpeg_parse_sof(info, seg, seg_len - 2)) return 0;
+			have_sof = 1;
+			break;
+		case JPEG_MARKER_DHT:
+			if (!jpeg_parse_dht(info, seg, seg_len - 2)) return 0;
+			break;
+		case JPEG_MARKER_DQT:
+			if (!jpeg_parse_dqt(info, seg, seg_len - 2)) return 0;
+			break;
+		case JPEG_MARKER_DRI:
+			if (seg_len != 4) return 0;
+			info->dri_pos = pos - 2;
+			info->restart_interval = RD16(seg);
+			break;
+		case JPEG_MARKER_SOS:
+			if (!have_sof) return 0;
+			info->sos_pos = pos - 2;
+			if (!jpeg_parse_sos(info, seg, seg_len - 2)) return 0;
+			info->scan_pos = pos + seg_len;
+			if (!info->has_dht) {
+				jpeg_build_huff(&info->dc[0], jpeg_std_dc_luma_bits, jpeg_std_dc_luma_vals);
+				jpeg_build_huff(&info->dc[1], jpeg_std_dc_chroma_bits, jpeg_std_dc_chroma_vals);
+				jpeg_build_huff(&info->ac[0], jpeg_std_ac_luma_bits, jpeg_std_ac_luma_vals);
+				jpeg_build_huff(&info->ac[1], jpeg_std_ac_chroma_bits, jpeg_std_ac_chroma_vals);
+			}
+			return 1;
+		default:
+			// Progressive, arithmetic and lossless frames are not handled
+			if (marker >= JPEG_MARKER_SOF2 && marker <= 0xCF && marker != JPEG_MARKER_DHT && marker != 0xC8 && marker != 0xCC) return 0;
+			break;
+		}
+		pos += seg_len;
+	}
+	return 0;
+}
+
+static inline void jpeg_bits_fill(jpeg_bits_t *br) {
+	while (br->bits <= 24) {
+		uint32_t byte = 0;
+		if (br->p < br->end && br->p[0] != 0xFF) {
+			byte = *br->p++;
+		} else if (br->p + 1 < br->end && br->p[1] == 0x00) {
+			// Stuffed zero after a 0xFF data byte
+			byte = 0xFF;
+			br->p += 2;
+		} else {
+			// A marker or the end of data: feed zeros and leave the pointer on the marker
+			br->pad++;
+		}
+		br->acc = (br->acc << 8) | byte;
+		br->bits += 8;
+	}
+}
+
+static inline uint32_t jpeg_bits_get(jpeg_bits_t *br, int n) {
+	if (n == 0) return 0;
+	if (br->bits < n) jpeg_bits_fill(br);
+	br->bits -= n;
+	return (br->acc >> br->bits) & ((1u << n) - 1);
+}
+
+static inline int jpeg_huff_decode(jpeg_bits_t *br, const jpeg_huff_t *huff) {
+	if (br->bits < 16) jpeg_bits_fill(br);
+	uint32_t peek = (br->acc >> (br->bits - JPEG_HUFF_LOOKAHEAD)) & ((1u << JPEG_HUFF_LOOKAHEAD) - 1);
+	uint16_t look = huff->look[peek];
+	if (look) {
+		br->bits -= look >> 8;
+		return look & 0xff;
+	}
+	for (int len = JPEG_HUFF_LOOKAHEAD + 1; len <= 16; len++) {
+		int32_t code = (br->acc >> (br->bits - len)) & ((1u << len) - 1);
+		if (code <= huff->maxcode[len]) {
+			br->bits -= len;
+			return huff->huffval[(code + huff->valoffset[len]) & 0xff];
+		}
+	}
+	return -1;
+}
+
+static inline int16_t jpeg_extend(uint32_t v, int s) {
+	return (int16_t)(v < (1u << (s - 1)) ? (int32_t)v - (1 << s) + 1 : (int32_t)v);
+}
+
+void jpeg_scan_begin(jpeg_scan_t *scan, const jpeg_info_t *info) {
+	memset(scan, 0, sizeof(*scan));
+	scan->info = info;
+	scan->bits.p = info->data + info->scan_pos;
+	scan->bits.end = info->data + info->len;
+	scan->todo = info->restart_interval;
+}
+
+static int jpeg_scan_restart(jpeg_scan_t *scan) {
+	jpeg_bits_t *br = &scan->bits;
+
+	// Whatever is left in the accumulator is byte padding before the RSTn marker
+	br->acc = 0;
+	br->bits = 0;
+	br->pad = 0;
+	while (br->p + 1 < br->end && !(br->p[0] == 0xFF && br->p[1] >= JPEG_MARKER_RST0 && br->p[1] <= JPEG_MARKER_RST7)) {
+		br->p++;
+	}
+	if (br->p + 1 >= br->end) return 0;
+	br->p += 2;
+	memset(scan->pred, 0, sizeof(scan->pred));
+	scan->todo = scan->info->restart_interval;
+	return 1;
+}
+
+static inline int jpeg_scan_mcu_begin(jpeg_scan_t *scan) {
+	const jpeg_info_t *info = scan->info;
+
+	if (scan->mcu >= (uint32_t)info->mcus_x * info->mcus_y) return 0;
+	if (info->restart_interval) {
+		if (scan->todo == 0 && !jpeg_scan_restart(scan)) return 0;
+		scan->todo--;
+	}
+	return 1;
+}
+
+int jpeg_decode_mcu(jpeg_scan_t *scan, int16_t (*coef)[64]) {
+	const jpeg_info_t *info = scan->info;
+	jpeg_bits_t *br = &scan->bits;
+
+	if (!jpeg_scan_mcu_begin(scan)) return 0;
+	for (int b = 0; b < info->mcu_blocks; b++) {
+		int c = info->mcu_comp[b];
+		const jpeg_huff_t *ac = &info->ac[info->comp[c].ta];
+		int16_t *blk = coef[b];
+		int s = jpeg_huff_decode(br, &info->dc[info->comp[c].td]);
+		if (s < 0 || s > 11) return 0;
+
+		memset(blk, 0, 64 * sizeof(int16_t));
+		if (s) scan->pred[c] += jpeg_extend(jpeg_bits_get(br, s), s);
+		blk[0] = scan->pred[c];
+
+		for (int k = 1; k < 64; k++) {
+			int rs = jpeg_huff_decode(br, ac);
+			if (rs < 0) return 0;
+			s = rs & 15;
+			if (s == 0) {
+				if (rs != 0xF0) break;	// End of block
+				k += 15;
+				continue;
+			}
+			k += rs >> 4;
+			if (k > 63) return 0;
+			blk[k] = jpeg_extend(jpeg_bits_get(br, s), s);
+		}
+	}
+	scan->mcu++;
+	return br->pad <= 4;
+}
+
+int jpeg_decode_mcu_dc(jpeg_scan_t *scan, int16_t *dc) {
+	const jpeg_info_t *info = scan->info;
+	jpeg_bits_t *br = &scan->bits;
+
+	if (!jpeg_scan_mcu_begin(scan)) return 0;
+	for (int b = 0; b < info->mcu_blocks; b++) {
+		int c = info->mcu_comp[b];
+		const jpeg_huff_t *ac = &info->ac[info->comp[c].ta];
+		int s = jpeg_huff_decode(br, &info->dc[info->comp[c].td]);
+		if (s < 0 || s > 11) return 0;
+		if (s) scan->pred[c] += jpeg_extend(jpeg_bits_get(br, s), s);
+		dc[b] = scan->pred[c];
+
+		// The AC codes still have to be walked, but their values are never sign extended or stored
+		for (int k = 1; k < 64; k++) {
+			int rs = jpeg_huff_decode(br, ac);
+			if (rs < 0) return 0;
+			s = rs & 15;
+			if (s == 0) {
+				if (rs != 0xF0) break;
+				k += 15;
+				continue;
+			}
+			k += rs >> 4;
+			if (k > 63) return 0;
+			if (br->bits < s) jpeg_bits_fill(br);
+			br->bits -= s;
+		}
+	}
+	scan->mcu++;
+	return br->pad <= 4;
+}
+
+// Jumps over the rest of the current restart interval without decoding it. Fails without restart markers
+int jpeg_scan_skip_interval(jpeg_scan_t *scan) {
+	const jpeg_info_t *info = scan->info;
+
+	if (!info->restart_interval) return 0;
+	if (scan->todo == 0 && !jpeg_scan_restart(scan)) return 0;
+	scan->mcu += scan->todo;
+	scan->todo = 0;
+	// The next MCU starts by looking for the RSTn marker that ends the skipped interval
+	return 1;
+}
+
+void jpeg_build_huff_enc(jpeg_huff_enc_t *enc, const uint8_t bits[17], const uint8_t *vals) {
+	uint16_t code = 0;
+	int k = 0;
+
+	memset(enc->size, 0, sizeof(enc->size));
+	for (int len = 1; len <= 16; len++) {
+		for (int i = 0; i < bits[len]; i++, k++, code++) {
+			enc->code[vals[k]] = code;
+			enc->size[vals[k]] = (uint8_t)len;
+		}
+		code <<= 1;
+	}
+}
+
+void jpeg_writer_begin(jpeg_writer_t *w, uint8_t *buf, size_t cap) {
+	w->start = buf;
+	w->p = buf;
+	w->end = buf + cap;
+	w->acc = 0;
+	w->bits = 0;
+	w->overflow = 0;
+}
+
+static inline void jpeg_put_bits(jpeg_writer_t *w, uint32_t value, int n) {
+	w->acc = (w->acc << n) | (value & ((1u << n) - 1));
+	w->bits += n;
+	while (w->bits >= 8) {
+		uint8_t byte = (uint8_t)(w->acc >> (w->bits - 8));
+		w->bits -= 8;
+		if (w->end - w->p < 2) {
+			w->overflow = 1;
+			continue;
+		}
+		*w->p++ = byte;
+		if (byte == 0xFF) *w->p++ = 0x00;
+	}
+}
+
+static inline int jpeg_put_symbol(jpeg_writer_t *w, const jpeg_huff_enc_t *enc, uint8_t symbol) {
+	if (enc->size[symbol] == 0) return 0;
+	jpeg_put_bits(w, enc->code[symbol], enc->size[symbol]);
+	return 1;
+}
+
+// Magnitude category and the bits sent for it, F.1.2.1
+static inline int jpeg_category(int32_t v, uint32_t *bits) {
+	uint32_t m = v < 0 ? (uint32_t)-v : (uint32_t)v;
+	int s = 0;
+	while (m >> s) s++;
+	*bits = v < 0 ? (uint32_t)(v - 1) : (uint32_t)v;
+	return s;
+}
+
+// Fails when a table has no code for a symbol the block needs
+int jpeg_encode_block(jpeg_writer_t *w, const int16_t *blk, int16_t *pred, const jpeg_huff_enc_t *dc, const jpeg_huff_enc_t *ac) {
+	uint32_t bits;
+	int s = jpeg_category((int32_t)blk[0] - *pred, &bits);
+	int run = 0;
+
+	if (s > 11 || !jpeg_put_symbol(w, dc, (uint8_t)s)) return 0;
+	if (s) jpeg_put_bits(w, bits, s);
+	*pred = blk[0];
+
+	for (int k = 1; k < 64; k++) {
+		if (blk[k] == 0) {
+			run++;
+			continue;
+		}
+		for (; run > 15; run -= 16) {
+			if (!jpeg_put_symbol(w, ac, 0xF0)) return 0;
+		}
+		s = jpeg_category(blk[k], &bits);
+		if (s > 10 || !jpeg_put_symbol(w, ac, (uint8_t)(run << 4 | s))) return 0;
+		jpeg_put_bits(w, bits, s);
+		run = 0;
+	}
+	if (run > 0 && !jpeg_put_symbol(w, ac, 0x00)) return 0;
+	return 1;
+}
+
+// Pads the last byte with ones, returns the bytes written or 0 when they did not fit
+size_t jpeg_writer_end(jpeg_writer_t *w) {
+	if (w->bits > 0) jpeg_put_bits(w, 0x7F, 8 - w->bits);
+	return w->overflow ? 0 : (size_t)(w->p - w->start);
+}
+
+// Counts the symbols jpeg_encode_block() would send for the block
+void jpeg_count_block(const int16_t *blk, int16_t *pred, jpeg_huff_stats_t *dc, jpeg_huff_stats_t *ac) {
+	uint32_t bits;
+	int run = 0;
+
+	dc->freq[jpeg_category((int32_t)blk[0] - *pred, &bits)]++;
+	*pred = blk[0];
+	for (int k = 1; k < 64; k++) {
+		if (blk[k] == 0) {
+			run++;
+			continue;
+		}
+		for (; run > 15; run -= 16) ac->freq[0xF0]++;
+		ac->freq[(run << 4 | jpeg_category(blk[k], &bits)) & 0xFF]++;
+		run = 0;
+	}
+	if (run > 0) ac->freq[0x00]++;
+}
+
+// Code lengths for the counted symbols, limited to 16 bits with no code of all ones (Annex K.2). The counts are used up
+int jpeg_build_optimal(jpeg_huff_stats_t *stats, uint8_t bits[17], uint8_t vals[256]) {
+	uint32_t *freq = stats->freq;
+	uint8_t *codesize = stats->codesize;
+	int16_t *others = stats->others;
+	uint8_t count[33] = { 0 };
+	int p = 0;
+
+	memset(codesize, 0, sizeof(stats->codesize));
+	for (int i = 0; i < 257; i++) others[i] = -1;
+	freq[256] = 1;		// Reserves the all ones code point
+
+	for (;;) {
+		// The two least frequent trees, the higher symbol wins a tie
+		int c1 = -1;
+		int c2 = -1;
+		for (int i = 0; i < 257; i++) {
+			if (freq[i] == 0) continue;
+			if (c1 < 0 || freq[i] <= freq[c1]) {
+				c2 = c1;
+				c1 = i;
+			} else if (c2 < 0 || freq[i] <= freq[c2]) {
+				c2 = i;
+			}
+		}
+		if (c2 < 0) break;
+
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		codesize[c1]++;
+		while (others[c1] >= 0) {
+			c1 = others[c1];
+			codesize[c1]++;
+		}
+		others[c1] = (int16_t)c2;
+		codesize[c2]++;
+		while (others[c2] >= 0) {
+			c2 = others[c2];
+			codesize[c2]++;
+		}
+	}
+
+	for (int i = 0; i < 257; i++) {
+		if (codesize[i] == 0) continue;
+		if (codesize[i] > 32) return 0;
+		count[codesize[i]]++;
+	}
+	for (int i = 32; i > 16; i--) {
+		while (count[i] > 0) {
+			int j = i - 2;
+			while (count[j] == 0) j--;
+			count[i] -= 2;
+			count[i - 1]++;
+			count[j + 1] += 2;
+			count[j]--;
+		}
+	}
+	int longest = 16;
+	while (longest > 0 && count[longest] == 0) longest--;
+	if (longest > 0) count[longest]--;	// Drops the reserved symbol, it has the longest code
+
+	memset(bits, 0, 17);
+	memcpy(bits + 1, count + 1, 16);
+	for (int len = 1; len <= 32; len++) {
+		for (int i = 0; i < 256; i++) {
+			if (codesize[i] == len) vals[p++] = (uint8_t)i;
+		}
+	}
+	return 1;
+}
@@ -0,0 +1,143 @@
+#ifndef JPEG_H
+#define JPEG_H
+
+/*
+ * jpeg.h - Baseline JPEG entropy helpers
+ *
+ * Just enough of a JPEG decoder to walk the Huffman coded scan of a baseline
+ * frame without dequantising or running an IDCT. Coefficients are kept
+ * quantised and in zigzag order. Nothing here allocates or keeps global state,
+ * so the caller decides where the (fairly large) jpeg_info_t lives.
+ *
+ * The encoding half (Annex F.1.2) turns such coefficients back into a scan,
+ * so a frame can be rewritten losslessly: cropped, or with tables built for
+ * its own symbol statistics (Annex K.2).
+ *
+ * Like riff.c, functions return non-zero on success and 0 on failure.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JPEG_MARKER_SOF0	0xC0
+#define JPEG_MARKER_SOF1	0xC1
+#define JPEG_MARKER_SOF2	0xC2
+#define JPEG_MARKER_DHT		0xC4
+#define JPEG_MARKER_RST0	0xD0
+#define JPEG_MARKER_RST7	0xD7
+#define JPEG_MARKER_SOI		0xD8
+#define JPEG_MARKER_EOI		0xD9
+#define JPEG_MARKER_SOS		0xDA
+#define JPEG_MARKER_DQT		0xDB
+#define JPEG_MARKER_DRI		0xDD
+
+#define JPEG_MAX_COMPONENTS	3
+#define JPEG_MAX_HUFF_TABLES	2	/* Baseline only allows table ids 0 and 1 */
+#define JPEG_MAX_MCU_BLOCKS	10
+#define JPEG_HUFF_LOOKAHEAD	9
+
+typedef struct {
+	uint8_t  bits[17];		/* bits[n] = number of codes of length n */
+	uint8_t  huffval[256];
+	int32_t  maxcode[18];
+	int32_t  valoffset[17];
+	uint16_t look[1 << JPEG_HUFF_LOOKAHEAD];	/* (length << 8) | symbol, 0 when the code is longer */
+} jpeg_huff_t;
+
+typedef struct {
+	uint8_t  id;
+	uint8_t  h;
+	uint8_t  v;
+	uint8_t  tq;
+	uint8_t  td;
+	uint8_t  ta;
+	uint16_t blocks_w;		/* Blocks per row in the scan, padded to whole MCUs */
+	uint16_t blocks_h;
+} jpeg_component_t;
+
+typedef struct {
+	const uint8_t *data;
+	size_t   len;
+	uint16_t width;
+	uint16_t height;
+	uint8_t  num_components;
+	uint8_t  max_h;
+	uint8_t  max_v;
+	uint16_t mcus_x;
+	uint16_t mcus_y;
+	uint16_t restart_interval;
+	size_t   sof_pos;		/* Offset of the FF C0 marker */
+	size_t   sos_pos;		/* Offset of the FF DA marker */
+	size_t   scan_pos;		/* First byte of entropy coded data */
+	size_t   dri_pos;		/* Offset of the FF DD marker, 0 without one */
+	uint8_t  mcu_blocks;
+	uint8_t  mcu_comp[JPEG_MAX_MCU_BLOCKS];	/* Component of each block in an MCU */
+	uint8_t  mcu_bx[JPEG_MAX_MCU_BLOCKS];	/* Block position inside the MCU, in component blocks */
+	uint8_t  mcu_by[JPEG_MAX_MCU_BLOCKS];
+	uint8_t  has_dht;		/* 0 when the frame relies on the Annex K tables (AVI1 style MJPEG) */
+	uint16_t dc_quant[4];		/* DC quantiser of each DQT table */
+	jpeg_component_t comp[JPEG_MAX_COMPONENTS];
+	jpeg_huff_t dc[JPEG_MAX_HUFF_TABLES];
+	jpeg_huff_t ac[JPEG_MAX_HUFF_TABLES];
+} jpeg_info_t;
+
+typedef struct {
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t acc;
+	int      bits;
+	int      pad;			/* Zero bytes fed after a marker or the end of data */
+} jpeg_bits_t;
+
+typedef struct {
+	const jpeg_info_t *info;
+	jpeg_bits_t bits;
+	int16_t  pred[JPEG_MAX_COMPONENTS];
+	uint32_t mcu;			/* Index of the next MCU to decode */
+	uint16_t todo;			/* MCUs left in the current restart interval */
+} jpeg_scan_t;
+
+typedef struct {
+	uint16_t code[256];
+	uint8_t  size[256];		/* 0 for symbols the table has no code for */
+} jpeg_huff_enc_t;
+
+typedef struct {
+	uint8_t *start;
+	uint8_t *p;
+	uint8_t *end;
+	uint32_t acc;
+	int      bits;
+	int      overflow;		/* Set once a byte did not fit, the rest is dropped */
+} jpeg_writer_t;
+
+typedef struct {
+	uint32_t freq[257];		/* Symbol counts, 256 is reserved by jpeg_build_optimal() */
+	uint8_t  codesize[257];		/* Scratch for jpeg_build_optimal() */
+	int16_t  others[257];
+} jpeg_huff_stats_t;
+
+extern const uint8_t jpeg_std_dc_luma_bits[17];
+extern const uint8_t jpeg_std_dc_luma_vals[12];
+extern const uint8_t jpeg_std_dc_chroma_bits[17];
+extern const uint8_t jpeg_std_dc_chroma_vals[12];
+extern const uint8_t jpeg_std_ac_luma_bits[17];
+extern const uint8_t jpeg_std_ac_luma_vals[162];
+extern const uint8_t jpeg_std_ac_chroma_bits[17];
+extern const uint8_t jpeg_std_ac_chroma_vals[162];
+
+int jpeg_parse(jpeg_info_t *info, const uint8_t *data, size_t len);
+int jpeg_build_huff(jpeg_huff_t *huff, const uint8_t bits[17], const uint8_t *vals);
+void jpeg_scan_begin(jpeg_scan_t *scan, const jpeg_info_t *info);
+int jpeg_decode_mcu(jpeg_scan_t *scan, int16_t (*coef)[64]);
+int jpeg_decode_mcu_dc(jpeg_scan_t *scan, int16_t *dc);
+int jpeg_scan_skip_interval(jpeg_scan_t *scan);
+
+void jpeg_build_huff_enc(jpeg_huff_enc_t *enc, const uint8_t bits[17], const uint8_t *vals);
+void jpeg_writer_begin(jpeg_writer_t *w, uint8_t *buf, size_t cap);
+int jpeg_encode_block(jpeg_writer_t *w, const int16_t *blk, int16_t *pred, const jpeg_huff_enc_t *dc, const jpeg_huff_enc_t *ac);
+size_t jpeg_writer_end(jpeg_writer_t *w);
+void jpeg_count_block(const int16_t *blk, int16_t *pred, jpeg_huff_stats_t *dc, jpeg_huff_stats_t *ac);
+int jpeg_build_optimal(jpeg_huff_stats_t *stats, uint8_t bits[17], uint8_t vals[256]);
+
+#endif /* JPEG_H */
@@ -23,6 +23,7 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,40 +32,999 @@
 #include "riff.h"
 #include "mjpeg.h"
 
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include "crc32c.h"
+
 #include "task_types.h"
 
 #include "fabric_log.h"
 
-esp_err_t write_riff_header(mjpeg_handle_t ctx) {
+// Layout of one entry of the temporary index file
+typedef struct {
+	IDX1 idx1;
+#if CONFIG_MJPEG_FRAME_CRC
+	uint32_t crc;		// CRC32C of the frame the entry points at, appended once the frame is written
+#endif
+} __attribute__((packed)) mjpeg_idx_record_t;
+
+#if CONFIG_MJPEG_CROP
+struct mjpeg_crop {
+	crop_t crop;
+	crop_rect_t rect;
+	uint8_t *buffer;		// Cropped frame, grown to the largest frame seen
+	size_t cap;
+	size_t stored;			// Length of the last stored frame in buffer, 0 when it was stored whole
+	size_t frames;
+	size_t failed;			// Frames stored uncropped
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t crop_us;
+	uint32_t crop_us_max;
+	// The headers as the application set them up for the whole frame, put back when the recording ends
+	AVIH avih;
+	STRH strh;
+	BMPH bmph;
+	VPRP vprp;
+};
+
+static uint32_t mjpeg_gcd(uint32_t a, uint32_t b) {
+	while (b) {
+		uint32_t t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+// Scales a buffer size given for the whole frame down to the rectangle, 0 stays unset
+static uint32_t mjpeg_crop_scale(uint32_t size, const crop_rect_t *rect, uint16_t width, uint16_t height) {
+	return (uint32_t)((uint64_t)size * rect->width * rect->height / ((uint32_t)width * height));
+}
+
+// Moves every size the header carries over to the rectangle, before anything is written. ctx->width and ctx->height
+// stay those of the camera's frame, the recording's size is that of crop->rect
+static esp_err_t mjpeg_crop_init(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "mjpeg-crop-init";
+	crop_rect_t rect = {
+		.x	= CONFIG_MJPEG_CROP_X,
+		.y	= CONFIG_MJPEG_CROP_Y,
+		.width	= CONFIG_MJPEG_CROP_WIDTH,
+		.height	= CONFIG_MJPEG_CROP_HEIGHT,
+	};
+
+	if (!crop_align(&rect, ctx->width, ctx->height)) {
+		FABRIC_LOG_WARN(F_TAG, "Crop rectangle is outside the %ux%u frame, recording it whole", ctx->width, ctx->height);
+		return ESP_OK;
+	}
+	ctx->crop = heap_caps_calloc(1, sizeof(struct mjpeg_crop), MJPEG_SVC_TASK_MALLOC);
+	if (ctx->crop == NULL) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to allocate crop state");
+		return ESP_ERR_NO_MEM;
+	}
+	ctx->crop->rect = rect;
+	ctx->crop->avih = ctx->avih;
+	ctx->crop->strh = ctx->strh;
+	ctx->crop->bmph = ctx->bmph;
+	ctx->crop->vprp = ctx->vprp;
+
+	uint32_t gcd = mjpeg_gcd(rect.width, rect.height);
+	ctx->avih.width				= rect.width;
+	ctx->avih.height			= rect.height;
+	ctx->avih.suggestedBufferSize		= mjpeg_crop_scale(ctx->avih.suggestedBufferSize, &rect, ctx->width, ctx->height);
+	ctx->strh.suggestedBufferSize		= mjpeg_crop_scale(ctx->strh.suggestedBufferSize, &rect, ctx->width, ctx->height);
+	ctx->bmph.width				= rect.width;
+	ctx->bmph.height			= rect.height;
+	ctx->bmph.imgSize			= mjpeg_crop_scale(ctx->bmph.imgSize, &rect, ctx->width, ctx->height);
+	ctx->vprp.hTotalInT			= rect.width;
+	ctx->vprp.vTotalInLines			= rect.height;
+	ctx->vprp.frameAspectRatio		= (rect.width / gcd) << 16 | (rect.height / gcd);
+	ctx->vprp.frameWidthInPixels		= rect.width;
+	ctx->vprp.frameHeightInLines		= rect.height;
+	ctx->vprp.field.compressedBMWidth	= rect.width;
+	ctx->vprp.field.compressedBMHeight	= rect.height;
+	ctx->vprp.field.validBMWidth		= rect.width;
+	ctx->vprp.field.validBMHeight		= rect.height;
+	if (ctx->strh.frame.right || ctx->strh.frame.bottom) {
+		ctx->strh.frame.right		= rect.width;
+		ctx->strh.frame.bottom		= rect.height;
+	}
+	FABRIC_LOG_INFO(F_TAG, "Recording the %ux%u region at %u,%u", rect.width, rect.height, rect.x, rect.y);
+	return ESP_OK;
+}
+
+// Returns the cropped frame, or the frame as it came when it cannot be cropped
+static frame_buffer_t mjpeg_crop_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	const char F_TAG[] = "mjpeg-crop-frame";
+	struct mjpeg_crop *crop = ctx->crop;
+	int64_t start = esp_timer_get_time();
+	size_t len = 0;
+
+	// The headers stay the same size and the scan shrinks, so the frame size is almost always enough. When it is not,
+	// the second try has room for every byte of the scan to need stuffing
+	for (int attempt = 0; attempt < 2 && len == 0; attempt++) {
+		size_t need = attempt == 0 ? frame_buffer.buffer_len + 1024 : 2 * frame_buffer.buffer_len + 1024;
+		if (attempt > 0 && !crop->crop.overflow) break;
+		if (crop->cap < need) {
+			uint8_t *buffer = heap_caps_realloc(crop->buffer, need, MJPEG_SVC_TASK_MALLOC);
+			if (buffer == NULL) break;
+			crop->buffer = buffer;
+			crop->cap = need;
+		}
+		len = crop_jpeg(&crop->crop, frame_buffer.buffer, frame_buffer.buffer_len, &crop->rect, crop->buffer, crop->cap);
+	}
+	uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+
+	crop->crop_us += elapsed;
+	if (elapsed > crop->crop_us_max) {
+		crop->crop_us_max = elapsed;
+	}
+	crop->frames++;
+	crop->bytes_in += frame_buffer.buffer_len;
+	if (len == 0) {
+		// Players follow the size in each frame's SOF, a whole frame now and then still plays
+		if (crop->failed++ == 0) {
+			FABRIC_LOG_WARN(F_TAG, "Frame %zu cannot be cropped, storing it whole", ctx->total_frames);
+		}
+		crop->bytes_out += frame_buffer.buffer_len;
+		crop->stored = 0;
+		return frame_buffer;
+	}
+	crop->bytes_out += len;
+	crop->stored = len;
+	frame_buffer.buffer = crop->buffer;
+	frame_buffer.buffer_len = len;
+	return frame_buffer;
+}
+#endif
+
+#if CONFIG_MJPEG_SCENE_FILTER
+struct mjpeg_scene {
+	scene_t scene;
+	jpeg_info_t jpeg;
+};
+
+// Decides whether the frame shows the same scene as the last stored one
+static bool mjpeg_scene_filter(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	const char F_TAG[] = "mjpeg-scene-filter";
+
+	if (ctx->scene == NULL) {
+		scene_config_t config = {
+			.size_delta_permille	= CONFIG_MJPEG_SCENE_SIZE_DELTA,
+			.dc_delta		= CONFIG_MJPEG_SCENE_DC_DELTA,
+			.max_skip		= CONFIG_MJPEG_SCENE_MAX_SKIP,
+		};
+#if CONFIG_MJPEG_CROP
+		// Frames are compared on the region that is stored, motion elsewhere does not count
+		if (ctx->crop != NULL) {
+			config.region_x		= ctx->crop->rect.x;
+			config.region_y		= ctx->crop->rect.y;
+			config.region_width	= ctx->crop->rect.width;
+			config.region_height	= ctx->crop->rect.height;
+		}
+#endif
+		ctx->scene = heap_caps_calloc(1, sizeof(struct mjpeg_scene), MJPEG_SVC_TASK_MALLOC);
+		if (ctx->scene == NULL) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to allocate scene filter, storing every frame");
+			return false;
+		}
+		scene_init(&ctx->scene->scene, &config, &ctx->scene->jpeg);
+	}
+
+	int64_t start = esp_timer_get_time();
+	bool skip = scene_is_static(&ctx->scene->scene, frame_buffer.buffer, frame_buffer.buffer_len);
+	uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+
+	ctx->scene_stats.filter_us += elapsed;
+	if (elapsed > ctx->scene_stats.filter_us_max) {
+		ctx->scene_stats.filter_us_max = elapsed;
+	}
+	FABRIC_LOG_VERBOSE(F_TAG, "Frame %s: size delta %lu, dc delta %lu, %lu us", skip ? "skipped" : "stored",
+		(unsigned long)ctx->scene->scene.last_size_delta, (unsigned long)ctx->scene->scene.last_dc_delta, (unsigned long)elapsed);
+	return skip;
+}
+#endif
+
+#if CONFIG_MJPEG_REHUFF
+struct mjpeg_rehuff {
+	rehuff_t rehuff;
+	uint8_t *buffer;		// Re-encoded frame, grown to the largest frame seen
+	size_t cap;
+	int64_t credit_us;		// CPU time the re-encoder may still spend, refilled every frame
+	size_t frames;
+	size_t skipped;			// Frames stored as they came because the budget was used up
+	size_t kept;			// Frames stored as they came because re-encoding did not make them smaller
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t rehuff_us;
+	uint32_t rehuff_us_max;
+};
+
+// Returns the frame re-encoded with optimal Huffman tables, or as it came when that does not fit the budget or does not
+// help. The budget is a share of the frame period, so a slow frame is paid for by the next ones being stored as they are
+static frame_buffer_t mjpeg_rehuff_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	const char F_TAG[] = "mjpeg-rehuff-frame";
+
+	if (ctx->rehuff == NULL) {
+		ctx->rehuff = heap_caps_calloc(1, sizeof(struct mjpeg_rehuff), MJPEG_SVC_TASK_MALLOC);
+		if (ctx->rehuff == NULL) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to allocate the re-encoder, storing frames as they come");
+			return frame_buffer;
+		}
+		rehuff_init(&ctx->rehuff->rehuff, CONFIG_MJPEG_REHUFF_WINDOW);
+	}
+	struct mjpeg_rehuff *r = ctx->rehuff;
+	uint8_t fps = ctx->fps ? ctx->fps : CONFIG_MJPEG_RECORD_FPS;
+	int64_t period = ctx->avih.microSecPerFrame ? ctx->avih.microSecPerFrame : 1000000 / fps;
+	int64_t share = period * CONFIG_MJPEG_REHUFF_BUDGET_PERCENT / 100;
+
+	r->frames++;
+	r->bytes_in += frame_buffer.buffer_len;
+	r->credit_us += share;
+	if (r->credit_us > share) {
+		r->credit_us = share;
+	}
+	if (r->credit_us < 0) {
+		r->skipped++;
+		r->bytes_out += frame_buffer.buffer_len;
+		return frame_buffer;
+	}
+
+	int64_t start = esp_timer_get_time();
+	size_t len = 0;
+	// The new tables are rarely larger than the ones they replace and the scan shrinks, see mjpeg_crop_frame()
+	for (int attempt = 0; attempt < 2 && len == 0; attempt++) {
+		size_t need = attempt == 0 ? frame_buffer.buffer_len + 1024 : 2 * frame_buffer.buffer_len + 1024;
+		if (attempt > 0 && !r->rehuff.overflow) break;
+		if (r->cap < need) {
+			uint8_t *buffer = heap_caps_realloc(r->buffer, need, MJPEG_SVC_TASK_MALLOC);
+			if (buffer == NULL) break;
+			r->buffer = buffer;
+			r->cap = need;
+		}
+		len = rehuff_jpeg(&r->rehuff, frame_buffer.buffer, frame_buffer.buffer_len, r->buffer, r->cap);
+	}
+	uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+
+	r->credit_us -= elapsed;
+	r->rehuff_us += elapsed;
+	if (elapsed > r->rehuff_us_max) {
+		r->rehuff_us_max = elapsed;
+	}
+	if (len == 0 || len >= frame_buffer.buffer_len) {
+		r->kept++;
+		r->bytes_out += frame_buffer.buffer_len;
+		return frame_buffer;
+	}
+	FABRIC_LOG_VERBOSE(F_TAG, "Frame %zu: %zu -> %zu bytes, %lu us", ctx->total_frames, frame_buffer.buffer_len, len,
+		(unsigned long)elapsed);
+	r->bytes_out += len;
+	frame_buffer.buffer = r->buffer;
+	frame_buffer.buffer_len = len;
+	return frame_buffer;
+}
+#endif
+
+// Stages that rewrite a frame on its way to the card. Run once the frame is known to be stored, never for a repeat
+static frame_buffer_t mjpeg_encode_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+#if CONFIG_MJPEG_CROP
+	if (ctx->crop != NULL) {
+		frame_buffer = mjpeg_crop_frame(ctx, frame_buffer);
+	}
+#endif
+#if CONFIG_MJPEG_REHUFF
+	// After the crop, which leaves fewer blocks to re-encode
+	frame_buffer = mjpeg_rehuff_frame(ctx, frame_buffer);
+#endif
+#if !CONFIG_MJPEG_CROP && !CONFIG_MJPEG_REHUFF
+	(void)ctx;
+#endif
+	return frame_buffer;
+}
+
+#if CONFIG_MJPEG_SERVE
+#define MJPEG_LIVE_TRIES	8	// Snapshots that overlap a publish before the server is told nothing is recorded
+
+// The muxer's side of the sequence counter: odd while what mjpeg_live_snapshot() reads is being changed
+static void mjpeg_live_begin(mjpeg_handle_t ctx) {
+	__atomic_store_n(&ctx->live_seq, ctx->live_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void mjpeg_live_end(mjpeg_handle_t ctx) {
+	__atomic_store_n(&ctx->live_seq, ctx->live_seq + 1, __ATOMIC_RELEASE);
+}
+
+// Publishes movi_size and idx_entries as they stand between two frames, when they describe the same frames
+static void mjpeg_live_publish(mjpeg_handle_t ctx) {
+	mjpeg_live_begin(ctx);
+	ctx->live_movi_size = ctx->movi_size;
+	ctx->live_entries = ctx->idx_entries;	// An open 'rec ' list is counted in movi_size but has no entries yet
+	mjpeg_live_end(ctx);
+}
+
+// serve_live_fn_t for the recording of the context passed as arg. It runs in the server's task and only reads what
+// the muxer published, again whenever a publish ran while it read. The header fields that still change are the
+// ones serve.c fills in, and it clamps the counters to what the card returns
+int mjpeg_live_snapshot(void *arg, serve_live_t *live) {
+	mjpeg_handle_t ctx = arg;
+
+	if (ctx == NULL) {
+		return 0;
+	}
+	for (int tries = 0; tries < MJPEG_LIVE_TRIES; tries++) {
+		uint32_t seq = __atomic_load_n(&ctx->live_seq, __ATOMIC_ACQUIRE);
+		if (seq % 2 != 0) {
+			vTaskDelay(1);
+			continue;
+		}
+		if (!ctx->live) {
+			return 0;
+		}
+		size_t header_len = ctx->movi_size_pos + sizeof(uint32_t) + sizeof(FOURCC);
+		if (header_len > ctx->journal.shadow_len || header_len > sizeof(live->header)) {
+			return 0;
+		}
+		memcpy(live->header, ctx->journal.shadow, header_len);
+		live->header_len	= header_len;
+		live->riff_size_pos	= ctx->riff_size_pos;
+		live->movi_size_pos	= ctx->movi_size_pos;
+		live->total_frames_pos	= ctx->avih_total_frames_pos;
+		live->length_pos	= ctx->strh_length_pos;
+		live->movi_size		= ctx->live_movi_size;
+		live->entries		= ctx->live_entries;
+		live->record_size	= sizeof(mjpeg_idx_record_t);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ctx->live_seq, __ATOMIC_RELAXED) == seq) {
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+#if CONFIG_MJPEG_RAW_RECORDING
+static esp_err_t mjpeg_raw_err(int err) {
+	switch (err) {
+	case RAWREC_OK:		return ESP_OK;
+	case RAWREC_ERR_FULL:	return ESP_ERR_NO_MEM;
+	case RAWREC_ERR_STATE:	return ESP_ERR_INVALID_STATE;
+	case RAWREC_ERR_ARG:	return ESP_ERR_INVALID_ARG;
+	default:		return ESP_FAIL;
+	}
+}
+
+esp_err_t mjpeg_use_raw_device(mjpeg_handle_t ctx, rawrec_t *raw) {
+	esp_err_t err = mjpeg_raw_err(rawrec_begin(raw));
+	if (err == ESP_OK) {
+		ctx->raw = raw;
+	}
+	return err;
+}
+#endif
+
+static inline bool mjpeg_is_raw(mjpeg_handle_t ctx) {
+#if CONFIG_MJPEG_RAW_RECORDING
+	return ctx->raw != NULL;
+#else
+	(void)ctx;
+	return false;
+#endif
+}
+
+#if CONFIG_MJPEG_STORAGE_SIM
+void mjpeg_use_storage_sim(mjpeg_handle_t ctx, simstore_t *sim) {
+	ctx->sim = sim;
+}
+#endif
+
+static inline bool mjpeg_is_sim(mjpeg_handle_t ctx) {
+#if CONFIG_MJPEG_STORAGE_SIM
+	return ctx->sim != NULL;
+#else
+	(void)ctx;
+	return false;
+#endif
+}
+
+// Everything that goes into the recording passes through here: the file, the raw region or the simulated card
+static esp_err_t mjpeg_out_write(mjpeg_handle_t ctx, const void *data, size_t len) {
+#if CONFIG_MJPEG_RAW_RECORDING
+	if (ctx->raw != NULL) {
+		return mjpeg_raw_err(rawrec_write(ctx->raw, data, len));
+	}
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+	if (ctx->sim != NULL) {
+		simstore_write(ctx->sim, len);
+		return ESP_OK;
+	}
+#endif
+	ctx->out_file_handle->payload.current_data_len	= len;
+	ctx->out_file_handle->payload.data		= (char *)data;
+	return write_file(ctx->out_file_handle);
+}
+
+static long mjpeg_out_pos(mjpeg_handle_t ctx) {
+#if CONFIG_MJPEG_RAW_RECORDING
+	if (ctx->raw != NULL) {
+		return ctx->raw->pos;
+	}
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+	if (ctx->sim != NULL) {
+		return ctx->sim->pos;
+	}
+#endif
+	return ctx->out_file_handle->pos;
+}
+
+// Appends to the temporary index file
+static esp_err_t mjpeg_idx_write(mjpeg_handle_t ctx, const void *data, size_t len) {
+#if CONFIG_MJPEG_STORAGE_SIM
+	if (ctx->sim != NULL) {
+		simstore_pwrite(ctx->sim, len);
+		return ESP_OK;
+	}
+#endif
+	ctx->idx_file_handle->payload.current_data_len	= len;
+	ctx->idx_file_handle->payload.data		= (char *)data;
+	return write_file(ctx->idx_file_handle);
+}
+
+#if CONFIG_MJPEG_REC_GROUP
+#define MJPEG_GROUP_HEADER	(sizeof(CHNK) + sizeof(FOURCC))	// LIST, its size and 'rec '
+
+// Frames of the open 'rec ' list wait here with their index entries until the list is written in one go
+struct mjpeg_group {
+	uint8_t *buffer;		// The LIST header, then the chunks of the open group
+	size_t cap;
+	size_t len;			// 0 when no group is open
+	mjpeg_idx_record_t *records;	// The group's 'rec ' entry, then one entry per frame received
+	size_t count;
+	size_t frames;			// Chunks stored in the group, frames the scene filter skipped have an entry only
+	int64_t start_us;
+	size_t groups;			// Groups written, over the whole recording
+	uint64_t bytes;
+	uint64_t write_us;
+	uint32_t write_us_max;
+};
+
+static esp_err_t mjpeg_group_init(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "mjpeg-group-init";
+	struct mjpeg_group *g = heap_caps_calloc(1, sizeof(struct mjpeg_group), MJPEG_SVC_TASK_MALLOC);
+	if (g == NULL) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to allocate group state");
+		return ESP_ERR_NO_MEM;
+	}
+	g->cap = (size_t)CONFIG_MJPEG_REC_GROUP_KB * 1024;
+	g->buffer = heap_caps_malloc(g->cap, MJPEG_SVC_TASK_MALLOC);
+	g->records = heap_caps_malloc((CONFIG_MJPEG_REC_GROUP_FRAMES + 1) * sizeof(mjpeg_idx_record_t), MJPEG_SVC_TASK_MALLOC);
+	if (g->buffer == NULL || g->records == NULL) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to allocate a %zu byte group buffer", g->cap);
+		free(g->buffer);
+		free(g->records);
+		free(g);
+		return ESP_ERR_NO_MEM;
+	}
+	ctx->group = g;
+	return ESP_OK;
+}
+
+// Writes the open group to movi and its entries to the index file, the 'rec ' entry ahead of its frames
+static esp_err_t mjpeg_group_flush(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "mjpeg-group-flush";
+	struct mjpeg_group *g = ctx->group;
+	size_t first = 0;
+	esp_err_t err;
+
+	if (g == NULL || g->count == 0) {
+		return ESP_OK;
+	}
+	if (g->frames == 0) {
+		// Only frames the scene filter skipped, whose entries point back at earlier groups. No list is needed
+		ctx->movi_size -= g->len;
+		g->len = 0;
+		first = 1;
+	} else if (g->len > 0) {
+		uint32_t header[3] = { FOURCC_LIST, g->len - sizeof(CHNK), FOURCC_REC };
+		memcpy(g->buffer, header, sizeof(header));
+		memset(&g->records[0], 0, sizeof(g->records[0]));
+		g->records[0].idx1.id		= FOURCC_REC;
+		g->records[0].idx1.flags	= AVIIF_LIST;
+		g->records[0].idx1.offset	= ctx->movi_size - g->len;
+		g->records[0].idx1.size		= g->len - sizeof(CHNK);
+
+		int64_t start = esp_timer_get_time();
+		err = mjpeg_out_write(ctx, g->buffer, g->len);
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to write a %zu byte group: %s", g->len, esp_err_to_name(err));
+			return err;
+		}
+		uint32_t elapsed = (uint32_t)(esp_timer_get_time() - start);
+		g->groups++;
+		g->bytes += g->len;
+		g->write_us += elapsed;
+		if (elapsed > g->write_us_max) {
+			g->write_us_max = elapsed;
+		}
+
+#if CONFIG_MJPEG_RATE_CONTROL
+		// The controller works per frame, so every frame of the group is charged its share of the write
+		if (ctx->rate.callback != NULL) {
+			int changed = 0;
+			for (size_t i = 0; i < g->frames; i++) {
+				changed |= rate_update(&ctx->rate, (uint32_t)(g->len / g->frames), elapsed / g->frames);
+			}
+			if (changed) {
+				FABRIC_LOG_INFO(F_TAG, "Storage at %lu KB/s, %lu%% of the frame period spent writing, asking for %lu bytes per frame",
+					(unsigned long)(ctx->rate.throughput / 1024), (unsigned long)(ctx->rate.utilisation / 10), (unsigned long)ctx->rate.target);
+			}
+		}
+#endif
+		// The list is on the card. Should the index write below fail, a retry only writes the index
+		g->len = 0;
+	}
+
+	err = mjpeg_idx_write(ctx, &g->records[first], (g->count - first) * sizeof(mjpeg_idx_record_t));
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write the group's index entries: %s", esp_err_to_name(err));
+		return err;
+	}
+	ctx->idx_entries += g->count - first;
+	g->len = 0;
+	g->count = 0;
+	g->frames = 0;
+	return ESP_OK;
+}
+
+// Makes room for the next frame, closing the open group when it is full or old enough and opening a new one
+static esp_err_t mjpeg_group_open(mjpeg_handle_t ctx, size_t frame_len) {
+	struct mjpeg_group *g = ctx->group;
+	size_t need = sizeof(CHNK) + frame_len + (frame_len % 2);
+	esp_err_t err;
+
+	// A group whose index write failed is flushed again before anything else
+	if (g->count > 0 && (g->len == 0 || g->count > CONFIG_MJPEG_REC_GROUP_FRAMES || g->len + need > g->cap ||
+		(CONFIG_MJPEG_REC_GROUP_MS > 0 && esp_timer_get_time() - g->start_us >= CONFIG_MJPEG_REC_GROUP_MS * 1000LL))) {
+		err = mjpeg_group_flush(ctx);
+		if (err != ESP_OK) {
+			return err;
+		}
+	}
+	if (g->len > 0) {
+		return ESP_OK;
+	}
+
+	// A frame larger than the buffer gets a group of its own
+	if (MJPEG_GROUP_HEADER + need > g->cap) {
+		uint8_t *buffer = heap_caps_realloc(g->buffer, MJPEG_GROUP_HEADER + need, MJPEG_SVC_TASK_MALLOC);
+		if (buffer == NULL) {
+			return ESP_ERR_NO_MEM;
+		}
+		g->buffer = buffer;
+		g->cap = MJPEG_GROUP_HEADER + need;
+	}
+	g->len = MJPEG_GROUP_HEADER;
+	g->count = 1;
+	g->start_us = esp_timer_get_time();
+	ctx->movi_size += MJPEG_GROUP_HEADER;
+	return ESP_OK;
+}
+
+// Frames received but not on the card yet, they wait in the open group. The oldest frames are written first
+size_t mjpeg_group_pending(mjpeg_handle_t ctx) {
+	struct mjpeg_group *g = ctx->group;
+	return g != NULL && g->count > 0 ? g->count - 1 : 0;
+}
+#endif
+
+static inline bool mjpeg_is_grouped(mjpeg_handle_t ctx) {
+#if CONFIG_MJPEG_REC_GROUP
+	return ctx->group != NULL;
+#else
+	(void)ctx;
+	return false;
+#endif
+}
+
+// Appends to movi, or to the open group when frames are grouped
+static esp_err_t mjpeg_movi_write(mjpeg_handle_t ctx, const void *data, size_t len) {
+#if CONFIG_MJPEG_REC_GROUP
+	struct mjpeg_group *g = ctx->group;
+	if (g != NULL && g->len > 0) {
+		memcpy(g->buffer + g->len, data, len);
+		g->len += len;
+		return ESP_OK;
+	}
+#endif
+	return mjpeg_out_write(ctx, data, len);
+}
+
+#if CONFIG_MJPEG_FRAME_CRC
+#define MJPEG_CRC_SLICE		(16 * 1024)	// Checksummed right before it is written, while it is still in cache
+
+// Writes the frame in slices and checksums each one on its way out, so the frame is only walked once
+static esp_err_t mjpeg_write_checksummed(mjpeg_handle_t ctx, const uint8_t *data, size_t len, uint32_t *crc) {
+	esp_err_t err = ESP_OK;
+	uint32_t c = 0;
+
+	while (len > 0 && err == ESP_OK) {
+		size_t slice = len < MJPEG_CRC_SLICE ? len : MJPEG_CRC_SLICE;
+		int64_t start = esp_timer_get_time();
+		c = crc32c_update(c, data, slice);
+		ctx->crc_us += esp_timer_get_time() - start;
+
+		err = mjpeg_movi_write(ctx, data, slice);
+		data += slice;
+		len -= slice;
+	}
+	*crc = c;
+	return err;
+}
+
+static esp_err_t mjpeg_write_crc_record(mjpeg_handle_t ctx, uint32_t crc) {
+#if CONFIG_MJPEG_REC_GROUP
+	// The entry is still in the open group
+	if (ctx->group != NULL && ctx->group->len > 0) {
+		ctx->group->records[ctx->group->count - 1].crc = crc;
+		return ESP_OK;
+	}
+#endif
+	return mjpeg_idx_write(ctx, &crc, sizeof(crc));
+}
+
+#define MJPEG_CRC_BATCH		32
+
+// Second pass over the temporary index, emitting the 'crcs' chunk right after idx1
+static esp_err_t mjpeg_write_crcs(mjpeg_handle_t ctx) {
+	uint32_t batch[MJPEG_CRC_BATCH];
+	size_t batched = 0;
+	esp_err_t err;
+
+	ctx->idx_file_handle->payload.pos		= 0;
+	err = seek_file(ctx->idx_file_handle);
+	if (err != ESP_OK) {
+		return err;
+	}
+
+	batch[0] = FOURCC_CRCS;
+	batch[1] = ctx->idx_entries * sizeof(uint32_t);
+	ctx->out_file_handle->payload.current_data_len	= 2 * sizeof(uint32_t);
+	ctx->out_file_handle->payload.data		= (char *)batch;
+	err = write_file(ctx->out_file_handle);
+	if (err != ESP_OK) {
+		return err;
+	}
+	ctx->riff_size += 2 * sizeof(uint32_t);
+
+	for (size_t i = 0; i < ctx->idx_entries; i++) {
+		mjpeg_idx_record_t record;
+		ctx->idx_file_handle->payload.max_data_len	= sizeof(record);
+		ctx->idx_file_handle->payload.data		= (char *)&record;
+		err = read_file(ctx->idx_file_handle);
+		if (err == ESP_OK && ctx->idx_file_handle->payload.current_data_len != sizeof(record)) {
+			err = ESP_ERR_INVALID_SIZE;
+		}
+		if (err != ESP_OK) {
+			return err;
+		}
+
+		batch[batched++] = record.crc;
+		if (batched == MJPEG_CRC_BATCH || i + 1 == ctx->idx_entries) {
+			ctx->out_file_handle->payload.current_data_len	= batched * sizeof(uint32_t);
+			ctx->out_file_handle->payload.data		= (char *)batch;
+			err = write_file(ctx->out_file_handle);
+			if (err != ESP_OK) {
+				return err;
+			}
+			ctx->riff_size += batched * sizeof(uint32_t);
+			batched = 0;
+		}
+	}
+	return ESP_OK;
+}
+#endif
+
+// Header bytes are mirrored in the patch journal so later patches never have to read the file back
+static esp_err_t mjpeg_write_header(mjpeg_handle_t ctx, const void *data, size_t len) {
+	long pos = mjpeg_out_pos(ctx);
+	esp_err_t err = mjpeg_out_write(ctx, data, len);
+	if (err == ESP_OK) {
+		patch_shadow(&ctx->journal, pos, data, len);
+	}
+	return err;
+}
+
+static int mjpeg_patch_write(void *io, long offset, const void *data, size_t len) {
+	mjpeg_handle_t ctx = io;
+	sd_handle_t handle = ctx->out_file_handle;
+#if CONFIG_MJPEG_RAW_RECORDING
+	if (ctx->raw != NULL) {
+		return mjpeg_raw_err(rawrec_pwrite(ctx->raw, (uint32_t)offset, data, len));
+	}
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+	if (ctx->sim != NULL) {
+		simstore_pwrite(ctx->sim, len);
+		return ESP_OK;
+	}
+#endif
+	handle->payload.current_data_len	= len;
+	handle->payload.data			= (char *)data;
+	handle->payload.pos			= offset;
+	return update_file(handle);
+}
+
+static esp_err_t mjpeg_apply_patches(mjpeg_handle_t ctx) {
+	return patch_apply(&ctx->journal, mjpeg_patch_write, ctx);
+}
+
+// Queues every field that depends on how much has been recorded
+static esp_err_t mjpeg_queue_size_patches(mjpeg_handle_t ctx, size_t riff_size) {
+	if (!patch_add(&ctx->journal, ctx->movi_size_pos, ctx->movi_size) ||
+		!patch_add(&ctx->journal, ctx->riff_size_pos, riff_size) ||
+		!patch_add(&ctx->journal, ctx->avih_total_frames_pos, ctx->total_frames) ||
+		!patch_add(&ctx->journal, ctx->strh_length_pos, ctx->total_frames)) {
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+#if CONFIG_MJPEG_RATE_CONTROL
+void mjpeg_set_rate_callback(mjpeg_handle_t ctx, rate_callback_t callback, void *arg) {
+	uint8_t fps = ctx->fps ? ctx->fps : CONFIG_MJPEG_RECORD_FPS;
+	const rate_config_t config = {
+		.frame_us	= 1000000 / fps,
+		.min_bytes	= CONFIG_MJPEG_RATE_MIN_BYTES,
+		.max_bytes	= CONFIG_MJPEG_RATE_MAX_BYTES,
+		.high_permille	= CONFIG_MJPEG_RATE_HIGH_LOAD * 10,
+		.low_permille	= CONFIG_MJPEG_RATE_LOW_LOAD * 10,
+		.down_frames	= 3,
+		.up_frames	= 3 * fps,	// A card has to keep up for a few seconds before quality goes back up
+		.hold_frames	= fps,
+	};
+	rate_init(&ctx->rate, &config, callback, arg);
+}
+#endif
+
+#if CONFIG_MJPEG_FMP4
+#define MJPEG_FMP4_INIT_CAP	1024	// The init segment is under 700 bytes
+
+struct mjpeg_fmp4 {
+	fmp4_sample_t *samples;		// Samples of the open fragment
+	uint32_t count;
+	uint32_t max;			// Samples a fragment can hold, sets the size of the reserved moof region
+	uint32_t period;		// Nominal frame duration, in FMP4_TIMESCALE units
+	uint32_t sequence;
+	uint64_t base_time;		// Media time at the start of the open fragment
+	uint32_t duration;		// Media time the open fragment covers so far
+	long fragment_pos;		// Start of the reserved region of the open fragment, -1 when none is open
+	size_t reserved;
+	uint8_t *region;		// reserved + FMP4_MDAT_HEADER bytes, laid out before every write of the region
+	size_t mehd_pos;
+	uint64_t close_us;		// Time spent closing fragments, over the whole recording
+};
+
+static esp_err_t mjpeg_fmp4_header(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "write-fmp4-header";
+	uint8_t fps = ctx->fps ? ctx->fps : CONFIG_MJPEG_RECORD_FPS;
+	esp_err_t err = ESP_OK;
+
+	patch_init(&ctx->journal);
+
+	struct mjpeg_fmp4 *f = heap_caps_calloc(1, sizeof(struct mjpeg_fmp4), MJPEG_SVC_TASK_MALLOC);
+	if (f == NULL) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to allocate fMP4 state");
+		return ESP_ERR_NO_MEM;
+	}
+	f->period = ctx->avih.microSecPerFrame ? ctx->avih.microSecPerFrame : 1000000 / fps;
+	f->max = ((uint32_t)CONFIG_MJPEG_FMP4_FRAGMENT_MS * 1000 + f->period - 1) / f->period;
+	if (f->max == 0) f->max = 1;
+	f->reserved = FMP4_MOOF_SIZE(f->max);
+	f->fragment_pos = -1;
+	f->samples = heap_caps_malloc(f->max * sizeof(fmp4_sample_t), MJPEG_SVC_TASK_MALLOC);
+	f->region = heap_caps_malloc(f->reserved + FMP4_MDAT_HEADER, MJPEG_SVC_TASK_MALLOC);
+	uint8_t *init = heap_caps_malloc(MJPEG_FMP4_INIT_CAP, MJPEG_SVC_TASK_MALLOC);
+	if (f->samples == NULL || f->region == NULL || init == NULL) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to allocate fMP4 buffers for %lu samples per fragment", (unsigned long)f->max);
+		free(init);
+		free(f->samples);
+		free(f->region);
+		free(f);
+		return ESP_ERR_NO_MEM;
+	}
+	ctx->fmp4 = f;
+
+	fmp4_track_t track = {
+		.width			= ctx->width,
+		.height			= ctx->height,
+		.sample_duration	= f->period,
+	};
+#if CONFIG_MJPEG_CROP
+	if (ctx->crop != NULL) {
+		track.width		= ctx->crop->rect.width;
+		track.height		= ctx->crop->rect.height;
+	}
+#endif
+	size_t len = fmp4_init_segment(init, MJPEG_FMP4_INIT_CAP, &track, &f->mehd_pos);
+	if (len == 0) {
+		err = ESP_ERR_INVALID_SIZE;
+	} else {
+		err = mjpeg_write_header(ctx, init, len);
+	}
+	free(init);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write the init segment: %s", esp_err_to_name(err));
+	}
+	return err;
+}
+
+// Writes the moof over the reserved region, the fragment is playable from here on
+static esp_err_t mjpeg_fmp4_close_fragment(mjpeg_handle_t ctx) {
+	struct mjpeg_fmp4 *f = ctx->fmp4;
+	int64_t start = esp_timer_get_time();
+
+	if (f->fragment_pos < 0) return ESP_OK;
+	size_t len = fmp4_moof(f->region, f->reserved + FMP4_MDAT_HEADER, f->sequence + 1, f->base_time, f->samples, f->count, f->reserved);
+	if (len == 0) return ESP_ERR_INVALID_SIZE;
+	esp_err_t err = mjpeg_patch_write(ctx, f->fragment_pos, f->region, len);
+	if (err != ESP_OK) return err;
+
+	f->sequence++;
+	f->base_time += f->duration;
+	f->duration = 0;
+	f->count = 0;
+	f->fragment_pos = -1;
+	f->close_us += esp_timer_get_time() - start;
+	return ESP_OK;
+}
+
+static esp_err_t mjpeg_fmp4_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	const char F_TAG[] = "write-fmp4-frame";
+	struct mjpeg_fmp4 *f = ctx->fmp4;
+	esp_err_t err = ESP_OK;
+
+	ctx->total_frames++;
+	FABRIC_LOG_VERBOSE(F_TAG, "Received frame buffer: %zu", ctx->total_frames);
+
+#if CONFIG_MJPEG_SCENE_FILTER
+	// A skipped frame lengthens the one before it. The first frame of a fragment is always stored
+	if (mjpeg_scene_filter(ctx, frame_buffer) && f->count > 0) {
+		f->samples[f->count - 1].duration += f->period;
+		f->duration += f->period;
+		ctx->scene_stats.frames_skipped++;
+		ctx->scene_stats.bytes_skipped += f->samples[f->count - 1].size;	// What the sample it repeats took
+		if (f->duration >= (uint32_t)CONFIG_MJPEG_FMP4_FRAGMENT_MS * 1000) {
+			err = mjpeg_fmp4_close_fragment(ctx);
+			if (err != ESP_OK) {
+				FABRIC_LOG_ERROR(F_TAG, "Failed to close fragment %lu: %s", (unsigned long)f->sequence + 1, esp_err_to_name(err));
+			}
+		}
+		return err;
+	}
+#endif
+	frame_buffer = mjpeg_encode_frame(ctx, frame_buffer);
+
+#if CONFIG_MJPEG_RATE_CONTROL
+	int64_t write_start = esp_timer_get_time();
+#endif
+
+	if (f->fragment_pos < 0) {
+		f->fragment_pos = mjpeg_out_pos(ctx);
+		fmp4_placeholder(f->region, f->reserved + FMP4_MDAT_HEADER, f->reserved);
+		err = mjpeg_out_write(ctx, f->region, f->reserved + FMP4_MDAT_HEADER);
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to reserve the moof of fragment %lu: %s", (unsigned long)f->sequence + 1, esp_err_to_name(err));
+			return err;
+		}
+	}
+
+	// Samples need no chunk header or padding, the moof describes them
+	err = mjpeg_out_write(ctx, frame_buffer.buffer, frame_buffer.buffer_len);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write frame to file: %s", esp_err_to_name(err));
+		return err;
+	}
+	ctx->movi_size += frame_buffer.buffer_len;
+	f->samples[f->count].duration = f->period;
+	f->samples[f->count].size = frame_buffer.buffer_len;
+	f->count++;
+	f->duration += f->period;
+
+	if (f->duration >= (uint32_t)CONFIG_MJPEG_FMP4_FRAGMENT_MS * 1000 || f->count == f->max) {
+		err = mjpeg_fmp4_close_fragment(ctx);
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to close fragment %lu: %s", (unsigned long)f->sequence + 1, esp_err_to_name(err));
+			return err;
+		}
+	}
+
+#if CONFIG_MJPEG_RATE_CONTROL
+	if (ctx->rate.callback != NULL) {
+		uint32_t elapsed = (uint32_t)(esp_timer_get_time() - write_start);
+		if (rate_update(&ctx->rate, frame_buffer.buffer_len, elapsed)) {
+			FABRIC_LOG_INFO(F_TAG, "Storage at %lu KB/s, %lu%% of the frame period spent writing, asking for %lu bytes per frame",
+				(unsigned long)(ctx->rate.throughput / 1024), (unsigned long)(ctx->rate.utilisation / 10), (unsigned long)ctx->rate.target);
+		}
+	}
+#endif
+	return err;
+}
+
+// Nothing is copied at the end, closing costs one fragment and the duration in mehd
+static esp_err_t mjpeg_fmp4_finalize(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "write-fmp4-final";
+	struct mjpeg_fmp4 *f = ctx->fmp4;
+	int64_t start = esp_timer_get_time();
+
+	esp_err_t err = mjpeg_fmp4_close_fragment(ctx);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to close the last fragment: %s", esp_err_to_name(err));
+		return err;
+	}
+	// Patches go out in native byte order, mehd wants big endian
+	if (!patch_add(&ctx->journal, f->mehd_pos, __builtin_bswap32((uint32_t)(f->base_time * FMP4_MOVIE_TIMESCALE / FMP4_TIMESCALE)))) {
+		err = ESP_ERR_NO_MEM;
+	}
+	if (err == ESP_OK) {
+		err = mjpeg_apply_patches(ctx);
+	}
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write the movie duration: %s", esp_err_to_name(err));
+		return err;
+	}
+	FABRIC_LOG_INFO(F_TAG, "fMP4 recording of %zu frames in %lu fragments, %llu us per fragment close, %lld us to finalize",
+		ctx->total_frames, (unsigned long)f->sequence, (unsigned long long)(f->sequence ? f->close_us / f->sequence : 0),
+		(long long)(esp_timer_get_time() - start));
+	return err;
+}
+#endif
+
+static esp_err_t mjpeg_riff_header(mjpeg_handle_t ctx) {
 	const char F_TAG[] = "write-riff-header";
 	esp_err_t err = ESP_OK;
 
 	uint32_t buffer[16] = {0x00};
 
+#if CONFIG_MJPEG_CROP
+	err = mjpeg_crop_init(ctx);
+	if (err != ESP_OK) {
+		return err;
+	}
+#endif
+
 	// We do not know what the size of the riff will end up being until after we are done writing everything.
 	// Thus, we should save ourselves space for us to update the riff size later
 
 	// The RIFF keyword and the size of the file are not included in the "riff size"
 	// Therefore, technically, we can consider the riff size as: total file size - 8 bytes
 
+#if CONFIG_MJPEG_FMP4
+	if (ctx->container == MJPEG_CONTAINER_FMP4) {
+		return mjpeg_fmp4_header(ctx);
+	}
+#endif
+
 	// Technically, for all the sizes, we could calculate them at compile time, but it is easier for it to be dynamic as it is because we are doing init
+	patch_init(&ctx->journal);
+
 	buffer[0] = FOURCC_RIFF;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write RIFF keyword to file: %s", esp_err_to_name(err));
 		return err;
 	}
 
 	// The current position is where we should be writing to the riff size
-	ctx->riff_size_pos = ctx->out_file_handle->pos;
+	ctx->riff_size_pos = mjpeg_out_pos(ctx);
 
 	// Write the placeholder for the riff size
 	buffer[0] = 0;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(uint32_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(uint32_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write temp RIFF size to file: %s", esp_err_to_name(err));
 		return err;
@@ -72,9 +1032,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 
 	// Write AVI keyword
 	buffer[0] = FOURCC_AVI;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write AVI keyword to file: %s", esp_err_to_name(err));
 		return err;
@@ -84,9 +1042,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 
 	// Write LIST keyword
 	buffer[0] = FOURCC_LIST;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write LIST keyword to file: %s", esp_err_to_name(err));
 		return err;
@@ -94,13 +1050,11 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->riff_size += sizeof(FOURCC);
 
 	// The current position is where we should be writing to the hdrl size
-	ctx->hdrl_size_pos = ctx->out_file_handle->pos;
+	ctx->hdrl_size_pos = mjpeg_out_pos(ctx);
 
 	// Write the placeholder for the HDRL size
 	buffer[0] = 0;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(uint32_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(uint32_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write temp HDRL size to file: %s", esp_err_to_name(err));
 		return err;
@@ -109,9 +1063,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 
 	// Write HDRL keyword
 	buffer[0] = FOURCC_HDLR;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write HDRL keyword to file: %s", esp_err_to_name(err));
 		return err;
@@ -121,9 +1073,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	// Write AVIH keyword and size of avih
 	buffer[0] = FOURCC_AVIH;
 	buffer[1] = sizeof(ctx->avih);
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC) + sizeof(size_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC) + sizeof(size_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write AVIH keyword and size to file: %s", esp_err_to_name(err));
 		return err;
@@ -131,12 +1081,10 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->hdrl_size += sizeof(FOURCC) + sizeof(size_t);
 
 	// Set the byte offset of the totalFrames field to overwrite later
-	ctx->avih_total_frames_pos = ctx->out_file_handle->pos + offsetof(AVIH, totalFrames);
+	ctx->avih_total_frames_pos = mjpeg_out_pos(ctx) + offsetof(AVIH, totalFrames);
 
 	// Write AVIH struct
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->avih);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->avih;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, &ctx->avih, sizeof(ctx->avih));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write AVIH struct to file: %s", esp_err_to_name(err));
 		return err;
@@ -145,9 +1093,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 
 	// Write LIST keyword
 	buffer[0] = FOURCC_LIST;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write LIST keyword to file: %s", esp_err_to_name(err));
 		return err;
@@ -155,13 +1101,11 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->hdrl_size += sizeof(FOURCC);
 
 	// The current position is where we should be writing to the strl size
-	ctx->strl_size_pos = ctx->out_file_handle->pos;
+	ctx->strl_size_pos = mjpeg_out_pos(ctx);
 	
 	// Write the placeholder for the STRL size
 	buffer[0] = 0;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(uint32_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(uint32_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write temp STRL size to file: %s", esp_err_to_name(err));
 		return err;
@@ -170,9 +1114,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	
 	// Write STRL keyword
 	buffer[0] = FOURCC_STRL;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write STRL keyword to file: %s", esp_err_to_name(err));
 		return err;
@@ -182,9 +1124,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	// Write STRH keyword and size of strh
 	buffer[0] = FOURCC_STRH;
 	buffer[1] = sizeof(ctx->strh);
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC) + sizeof(size_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC) + sizeof(size_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write STRH keyword and size to file: %s", esp_err_to_name(err));
 		return err;
@@ -192,12 +1132,10 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->strl_size += sizeof(FOURCC) + sizeof(size_t);
 
 	// Set the byte offset of the length field to overwrite later
-	ctx->strh_length_pos = ctx->out_file_handle->pos + offsetof(STRH, length);
+	ctx->strh_length_pos = mjpeg_out_pos(ctx) + offsetof(STRH, length);
 	
 	// Write STRH struct
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->strh);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->strh;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, &ctx->strh, sizeof(ctx->strh));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write STRH struct to file: %s", esp_err_to_name(err));
 		return err;
@@ -207,9 +1145,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	// Write BMPH keyword and size of bmph
 	buffer[0] = FOURCC_STRF;
 	buffer[1] = sizeof(ctx->bmph);
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC) + sizeof(size_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC) + sizeof(size_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write STRF keyword and size to file: %s", esp_err_to_name(err));
 		return err;
@@ -217,9 +1153,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->strl_size += sizeof(FOURCC) + sizeof(size_t);
 
 	// Write BMPH struct
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->bmph);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->bmph;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, &ctx->bmph, sizeof(ctx->bmph));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write BMPH struct to file: %s", esp_err_to_name(err));
 		return err;
@@ -229,9 +1163,7 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	// Write VPRP keyword and size of bmph
 	buffer[0] = FOURCC_VPRP;
 	buffer[1] = sizeof(ctx->vprp);
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC) + sizeof(size_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC) + sizeof(size_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write VPRP keyword and size to file: %s", esp_err_to_name(err));
 		return err;
@@ -239,42 +1171,25 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->strl_size += sizeof(FOURCC) + sizeof(size_t);
 
 	// Write VPRP struct
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->vprp);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->vprp;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, &ctx->vprp, sizeof(ctx->vprp));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write VPRP struct to file: %s", esp_err_to_name(err));
 		return err;
 	}
 	ctx->strl_size += sizeof(VPRP);
 
-	// We now know the size of strl, so update that value
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->strl_size);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->strl_size;
-	ctx->out_file_handle->payload.pos		= ctx->strl_size_pos;
-	err = update_file(ctx->out_file_handle);
-	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to update the strl size: %s", esp_err_to_name(err));
-		return err;
-	}
+	// We now know the size of strl, queue it with the hdrl size so both go out in one write
 	ctx->hdrl_size += ctx->strl_size;
-
-	// We now know the size of hdrl, so update that value
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->hdrl_size);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->hdrl_size;
-	ctx->out_file_handle->payload.pos		= ctx->hdrl_size_pos;
-	err = update_file(ctx->out_file_handle);
-	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to update the strl size: %s", esp_err_to_name(err));
-		return err;
+	if (!patch_add(&ctx->journal, ctx->strl_size_pos, ctx->strl_size) ||
+		!patch_add(&ctx->journal, ctx->hdrl_size_pos, ctx->hdrl_size)) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to queue the STRL and HDRL sizes, the patch journal is full");
+		return ESP_FAIL;
 	}
 	ctx->riff_size += ctx->hdrl_size;
 	
 	// Write LIST keyword
 	buffer[0] = FOURCC_LIST;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write LIST keyword to file: %s", esp_err_to_name(err));
 		return err;
@@ -282,13 +1197,11 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 	ctx->riff_size += sizeof(FOURCC);
 
 	// The current position is where we should be writing to the movi size
-	ctx->movi_size_pos = ctx->out_file_handle->pos;
+	ctx->movi_size_pos = mjpeg_out_pos(ctx);
 
 	// Write the placeholder for the MOVI size
 	buffer[0] = 0;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(uint32_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(uint32_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write temp MOVI size to file: %s", esp_err_to_name(err));
 		return err;
@@ -297,27 +1210,81 @@ esp_err_t write_riff_header(mjpeg_handle_t ctx) {
 
 	// Write MOVI keyword
 	buffer[0] = FOURCC_MOVI;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_write_header(ctx, buffer, sizeof(FOURCC));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write MOVI keyword to file: %s", esp_err_to_name(err));
 		return err;
 	}
 	ctx->movi_size += sizeof(FOURCC);
 
+	err = mjpeg_apply_patches(ctx);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to update the strl and hdrl sizes: %s", esp_err_to_name(err));
+		return err;
+	}
+
+#if CONFIG_MJPEG_REC_GROUP
+	err = mjpeg_group_init(ctx);
+	if (err != ESP_OK) {
+		return err;
+	}
+#endif
+
+#if CONFIG_MJPEG_SERVE
+	mjpeg_live_begin(ctx);
+	ctx->live_movi_size = ctx->movi_size;
+	ctx->live_entries = ctx->idx_entries;
+	ctx->live = !mjpeg_is_raw(ctx) && !mjpeg_is_sim(ctx);
+	mjpeg_live_end(ctx);
+#endif
 	return err;	
 }
 
 
-esp_err_t write_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+static esp_err_t mjpeg_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
 	const char F_TAG[] = "write-jpeg-frame";
 	esp_err_t err = ESP_OK;
 
 	uint8_t byte_alignment_buffer = 0x00;
 	uint32_t buffer[2] = {0x00};
+
+#if CONFIG_MJPEG_FMP4
+	if (ctx->container == MJPEG_CONTAINER_FMP4) {
+		return mjpeg_fmp4_frame(ctx, frame_buffer);
+	}
+#endif
+
+#if CONFIG_MJPEG_CHECKPOINT_FRAMES > 0
+	// Keep the header of the file in use describing what has been recorded so far
+	if (ctx->total_frames > 0 && ctx->total_frames % CONFIG_MJPEG_CHECKPOINT_FRAMES == 0) {
+		err = mjpeg_checkpoint(ctx);
+		if (err != ESP_OK) {
+			return err;
+		}
+	}
+#endif
+
+	// The scene filter looks at the frame as it came, the frame is only rewritten for storage once it is kept
+	bool skip = false;
+#if CONFIG_MJPEG_SCENE_FILTER
+	skip = mjpeg_scene_filter(ctx, frame_buffer);
+#endif
+	if (!skip) {
+		frame_buffer = mjpeg_encode_frame(ctx, frame_buffer);
+	}
 	
-	FABRIC_LOG_VERBOSE(F_TAG, "Received frame buffer: %zu", ctx->total_frames++);
+#if CONFIG_MJPEG_REC_GROUP
+	if (ctx->group != NULL) {
+		err = mjpeg_group_open(ctx, skip ? 0 : frame_buffer.buffer_len);
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to make room for the frame in a group: %s", esp_err_to_name(err));
+			return err;
+		}
+	}
+#endif
+
+	ctx->total_frames++;
+	FABRIC_LOG_VERBOSE(F_TAG, "Received frame buffer: %zu", ctx->total_frames);
 	IDX1 idx1 = {
 		.id	= FOURCC_00DC,
 		.flags	= 0,
@@ -325,22 +1292,57 @@ esp_err_t write_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
 		.size	= frame_buffer.buffer_len
 	};
 
-	// Write IDX1 struct
-	ctx->idx_file_handle->payload.current_data_len	= sizeof(idx1);
-	ctx->idx_file_handle->payload.data		= (char *)&idx1;
-	err = write_file(ctx->idx_file_handle);
-	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to write IDX1 struct to file: %s", esp_err_to_name(err));
+#if CONFIG_MJPEG_SCENE_FILTER
+	// A skipped frame keeps its slot in the timeline by pointing its index entry at the last stored frame
+	if (skip) {
+		idx1 = ctx->last_idx1;
+	}
+#endif
+
+#if CONFIG_MJPEG_REC_GROUP
+	// Entries of a group go to the index file with it, behind its 'rec ' entry
+	if (ctx->group != NULL) {
+		ctx->group->records[ctx->group->count++].idx1 = idx1;
+	}
+#endif
+
+	// Write IDX1 struct. A raw recording has no index file, its index is rebuilt from movi on export
+	if (!mjpeg_is_raw(ctx) && !mjpeg_is_grouped(ctx)) {
+		err = mjpeg_idx_write(ctx, &idx1, sizeof(idx1));
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to write IDX1 struct to file: %s", esp_err_to_name(err));
+			return err;
+		}
+		ctx->idx_entries++;
+		FABRIC_LOG_VERBOSE(F_TAG, "Saved index information to index file");
+	}
+
+#if CONFIG_MJPEG_SCENE_FILTER
+	if (skip) {
+#if CONFIG_MJPEG_FRAME_CRC
+		// The entry points at the last stored frame, so it carries that frame's checksum
+		err = mjpeg_write_crc_record(ctx, ctx->last_crc);
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to write CRC record to file: %s", esp_err_to_name(err));
+			return err;
+		}
+#endif
+		// The frame was never cropped or re-encoded, what it would have taken is that of the frame it repeats
+		ctx->scene_stats.frames_skipped++;
+		ctx->scene_stats.bytes_skipped += sizeof(FOURCC) + sizeof(uint32_t) + idx1.size + (idx1.size % 2);
 		return err;
 	}
-	FABRIC_LOG_VERBOSE(F_TAG, "Saved index information to index file");
+	ctx->last_idx1 = idx1;
+#endif
+
+#if CONFIG_MJPEG_RATE_CONTROL
+	int64_t write_start = esp_timer_get_time();
+#endif
 
 	// Write 00dc header and idx1 size to file
 	buffer[0] = FOURCC_00DC;
 	buffer[1] = frame_buffer.buffer_len;
-	ctx->out_file_handle->payload.current_data_len	= sizeof(FOURCC) + sizeof(uint32_t);
-	ctx->out_file_handle->payload.data		= (char *)buffer;
-	err = write_file(ctx->out_file_handle);
+	err = mjpeg_movi_write(ctx, buffer, sizeof(FOURCC) + sizeof(uint32_t));
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write 00dc header and size to file: %s", esp_err_to_name(err));
 		return err;
@@ -349,9 +1351,11 @@ esp_err_t write_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
 
 	// Write actual JPEG image
 	// Data must be byte aligned, so if we happent o write an odd amount of data, we must pad to make it even
-	ctx->out_file_handle->payload.current_data_len	= frame_buffer.buffer_len;
-	ctx->out_file_handle->payload.data		= (char *)frame_buffer.buffer;
-	err = write_file(ctx->out_file_handle);
+#if CONFIG_MJPEG_FRAME_CRC
+	err = mjpeg_write_checksummed(ctx, frame_buffer.buffer, frame_buffer.buffer_len, &ctx->last_crc);
+#else
+	err = mjpeg_movi_write(ctx, frame_buffer.buffer, frame_buffer.buffer_len);
+#endif
 	if (err != ESP_OK) {
 		FABRIC_LOG_ERROR(F_TAG, "Failed to write 00dc header and size to file: %s", esp_err_to_name(err));
 		return err;
@@ -359,36 +1363,331 @@ esp_err_t write_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
 	ctx->movi_size += frame_buffer.buffer_len;
 
 	if (frame_buffer.buffer_len % 2 != 0) {
-		ctx->out_file_handle->payload.current_data_len	= sizeof(byte_alignment_buffer);
-		ctx->out_file_handle->payload.data		= (char *)&byte_alignment_buffer;
-		err = write_file(ctx->out_file_handle);
+		err = mjpeg_movi_write(ctx, &byte_alignment_buffer, sizeof(byte_alignment_buffer));
 		if (err != ESP_OK) {
 			FABRIC_LOG_ERROR(F_TAG, "Failed to write byte alignment buffer to file: %s", esp_err_to_name(err));
 			return err;
 		}
 		ctx->movi_size += sizeof(byte_alignment_buffer);
 	}
+
+#if CONFIG_MJPEG_FRAME_CRC
+	err = mjpeg_write_crc_record(ctx, ctx->last_crc);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write CRC record to file: %s", esp_err_to_name(err));
+		return err;
+	}
+#endif
+
+#if CONFIG_MJPEG_REC_GROUP
+	// Nothing has reached the card yet, the controller hears about the frame when its group is written
+	if (ctx->group != NULL) {
+		ctx->group->frames++;
+		return err;
+	}
+#endif
+
+#if CONFIG_MJPEG_RATE_CONTROL
+	if (ctx->rate.callback != NULL) {
+		uint32_t elapsed = (uint32_t)(esp_timer_get_time() - write_start);
+		if (rate_update(&ctx->rate, sizeof(FOURCC) + sizeof(uint32_t) + frame_buffer.buffer_len, elapsed)) {
+			FABRIC_LOG_INFO(F_TAG, "Storage at %lu KB/s, %lu%% of the frame period spent writing, asking for %lu bytes per frame",
+				(unsigned long)(ctx->rate.throughput / 1024), (unsigned long)(ctx->rate.utilisation / 10), (unsigned long)ctx->rate.target);
+		}
+	}
+#endif
+	return err;
+}
+
+esp_err_t write_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	esp_err_t err = mjpeg_jpeg_frame(ctx, frame_buffer);
+#if CONFIG_MJPEG_SERVE
+	// Whether or not the frame made it, the counters are published once they are back in step
+	mjpeg_live_publish(ctx);
+#endif
 	return err;
 }
 
 
-esp_err_t write_final_riff_updates(mjpeg_handle_t ctx) {
+#if CONFIG_MJPEG_THUMBNAILS
+struct mjpeg_thumb {
+	jpeg_info_t jpeg;
+	thumb_header_t header;
+	uint8_t *pixels;		// One cell, allocated once the first frame sets the cell size
+	size_t cells;			// Cells in the strip so far
+	size_t decoded;
+	uint64_t decode_us;
+};
+
+// Fills the strip with grey cells up to the cell of the given frame
+static esp_err_t mjpeg_thumb_fill(mjpeg_handle_t ctx, size_t cell) {
+	struct mjpeg_thumb *thumb = ctx->thumb;
+	size_t cell_size = (size_t)thumb->header.width * thumb->header.height;
+	esp_err_t err = ESP_OK;
+
+	memset(thumb->pixels, THUMB_FILL, cell_size);
+	while (thumb->cells < cell && err == ESP_OK) {
+		ctx->thumb_file_handle->payload.current_data_len	= cell_size;
+		ctx->thumb_file_handle->payload.data			= (char *)thumb->pixels;
+		err = write_file(ctx->thumb_file_handle);
+		thumb->cells++;
+	}
+	return err;
+}
+
+esp_err_t write_jpeg_thumbnail(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	const char F_TAG[] = "write-jpeg-thumbnail";
+	esp_err_t err = ESP_OK;
+
+	// Call right after write_jpeg_frame(), the frame it just counted is the one thumbnailed
+	if (ctx->thumb_file_handle == NULL || ctx->total_frames == 0 || (ctx->total_frames - 1) % CONFIG_MJPEG_THUMB_INTERVAL != 0) {
+		return ESP_OK;
+	}
+	size_t cell = (ctx->total_frames - 1) / CONFIG_MJPEG_THUMB_INTERVAL;
+
+#if CONFIG_MJPEG_CROP
+	// The region that was recorded, of the frame last stored, which is the one a repeat shows
+	if (ctx->crop != NULL && ctx->crop->stored > 0) {
+		frame_buffer.buffer = ctx->crop->buffer;
+		frame_buffer.buffer_len = ctx->crop->stored;
+	}
+#endif
+
+	if (ctx->thumb == NULL) {
+		ctx->thumb = heap_caps_calloc(1, sizeof(struct mjpeg_thumb), MJPEG_SVC_TASK_MALLOC);
+		if (ctx->thumb == NULL) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to allocate thumbnail state");
+			return ESP_ERR_NO_MEM;
+		}
+	}
+	struct mjpeg_thumb *thumb = ctx->thumb;
+
+	// The first frame that parses sets the cell size, the strip header goes out with it
+	if (thumb->pixels == NULL) {
+		uint16_t width;
+		uint16_t height;
+		if (!jpeg_parse(&thumb->jpeg, frame_buffer.buffer, frame_buffer.buffer_len) || !thumb_size(&thumb->jpeg, &width, &height)) {
+			FABRIC_LOG_WARN(F_TAG, "Frame %zu cannot be thumbnailed yet", ctx->total_frames - 1);
+			return ESP_OK;
+		}
+		thumb->pixels = heap_caps_malloc((size_t)width * height, MJPEG_SVC_TASK_MALLOC);
+		if (thumb->pixels == NULL) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to allocate a %ux%u thumbnail", width, height);
+			return ESP_ERR_NO_MEM;
+		}
+		thumb_header_init(&thumb->header, width, height, CONFIG_MJPEG_THUMB_INTERVAL);
+		ctx->thumb_file_handle->payload.current_data_len	= sizeof(thumb->header);
+		ctx->thumb_file_handle->payload.data			= (char *)&thumb->header;
+		err = write_file(ctx->thumb_file_handle);
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to write the thumbnail strip header: %s", esp_err_to_name(err));
+			return err;
+		}
+	}
+
+	// Cells of earlier frames that could not be decoded keep their place in the strip
+	err = mjpeg_thumb_fill(ctx, cell);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write thumbnail fill: %s", esp_err_to_name(err));
+		return err;
+	}
+
+	int64_t start = esp_timer_get_time();
+	if (thumb_decode(&thumb->jpeg, frame_buffer.buffer, frame_buffer.buffer_len, thumb->pixels, thumb->header.width, thumb->header.height)) {
+		thumb->decoded++;
+	} else {
+		memset(thumb->pixels, THUMB_FILL, (size_t)thumb->header.width * thumb->header.height);
+	}
+	thumb->decode_us += esp_timer_get_time() - start;
+
+	ctx->thumb_file_handle->payload.current_data_len	= (size_t)thumb->header.width * thumb->header.height;
+	ctx->thumb_file_handle->payload.data			= (char *)thumb->pixels;
+	err = write_file(ctx->thumb_file_handle);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write thumbnail: %s", esp_err_to_name(err));
+		return err;
+	}
+	thumb->cells++;
+	return err;
+}
+#endif
+
+
+// Logs what the optional stages did over the recording and frees their state, whatever the container and
+// however the recording ended. The context is left ready for the next write_riff_header()
+static void mjpeg_release(mjpeg_handle_t ctx, const char *F_TAG) {
+	// Only the configured stages use them, a build without any leaves both unused
+	(void)ctx;
+	(void)F_TAG;
+#if CONFIG_MJPEG_SERVE
+	mjpeg_live_begin(ctx);
+	ctx->live = false;
+	mjpeg_live_end(ctx);
+#endif
+#if CONFIG_MJPEG_RAW_RECORDING
+	ctx->raw = NULL;
+#endif
+
+#if CONFIG_MJPEG_FMP4
+	if (ctx->fmp4 != NULL) {
+		free(ctx->fmp4->samples);
+		free(ctx->fmp4->region);
+		free(ctx->fmp4);
+		ctx->fmp4 = NULL;
+	}
+#endif
+
+#if CONFIG_MJPEG_SCENE_FILTER
+	if (ctx->total_frames > 0) {
+		FABRIC_LOG_INFO(F_TAG, "Scene filter skipped %zu of %zu frames (%zu%%), saving %zu bytes. Filter cost: %llu us/frame average, %lu us worst",
+			ctx->scene_stats.frames_skipped, ctx->total_frames, ctx->scene_stats.frames_skipped * 100 / ctx->total_frames,
+			ctx->scene_stats.bytes_skipped, (unsigned long long)(ctx->scene_stats.filter_us / ctx->total_frames),
+			(unsigned long)ctx->scene_stats.filter_us_max);
+	}
+	free(ctx->scene);
+	ctx->scene = NULL;
+#endif
+
+#if CONFIG_MJPEG_THUMBNAILS
+	if (ctx->thumb != NULL) {
+		if (ctx->thumb->decoded > 0) {
+			FABRIC_LOG_INFO(F_TAG, "Thumbnail strip of %zu %ux%u cells, %llu us per decoded frame", ctx->thumb->cells,
+				ctx->thumb->header.width, ctx->thumb->header.height, (unsigned long long)(ctx->thumb->decode_us / ctx->thumb->decoded));
+		}
+		free(ctx->thumb->pixels);
+		free(ctx->thumb);
+		ctx->thumb = NULL;
+	}
+#endif
+
+#if CONFIG_MJPEG_CROP
+	if (ctx->crop != NULL) {
+		struct mjpeg_crop *crop = ctx->crop;
+		if (crop->frames > 0 && crop->bytes_in > 0) {
+			FABRIC_LOG_INFO(F_TAG, "Cropped %zu frames to %ux%u, %llu of %llu bytes stored (%llu%%). Crop cost: %llu us/frame average, %lu us worst, %zu frames stored whole",
+				crop->frames - crop->failed, crop->rect.width, crop->rect.height, (unsigned long long)crop->bytes_out,
+				(unsigned long long)crop->bytes_in, (unsigned long long)(crop->bytes_out * 100 / crop->bytes_in),
+				(unsigned long long)(crop->crop_us / crop->frames), (unsigned long)crop->crop_us_max, crop->failed);
+		}
+		// So the next recording on this context crops the camera's frame again
+		ctx->avih = crop->avih;
+		ctx->strh = crop->strh;
+		ctx->bmph = crop->bmph;
+		ctx->vprp = crop->vprp;
+		free(crop->buffer);
+		free(crop);
+		ctx->crop = NULL;
+	}
+#endif
+
+#if CONFIG_MJPEG_REHUFF
+	if (ctx->rehuff != NULL) {
+		struct mjpeg_rehuff *r = ctx->rehuff;
+		size_t encoded = r->frames - r->skipped;
+		if (r->frames > 0 && r->bytes_in > 0) {
+			FABRIC_LOG_INFO(F_TAG, "Re-encoded %zu of %zu frames, %llu of %llu bytes stored (%llu%%). Cost: %llu us/frame average, %lu us worst, %zu skipped for CPU, %zu not smaller",
+				encoded - r->kept, r->frames, (unsigned long long)r->bytes_out, (unsigned long long)r->bytes_in,
+				(unsigned long long)(r->bytes_out * 100 / r->bytes_in), (unsigned long long)(encoded ? r->rehuff_us / encoded : 0),
+				(unsigned long)r->rehuff_us_max, r->skipped, r->kept);
+		}
+		free(r->buffer);
+		free(r);
+		ctx->rehuff = NULL;
+	}
+#endif
+
+#if CONFIG_MJPEG_REC_GROUP
+	if (ctx->group != NULL) {
+		struct mjpeg_group *g = ctx->group;
+		if (g->groups > 0) {
+			FABRIC_LOG_INFO(F_TAG, "Stored frames in %zu 'rec ' lists of %llu bytes average. Write cost: %llu us/list average, %lu us worst",
+				g->groups, (unsigned long long)(g->bytes / g->groups), (unsigned long long)(g->write_us / g->groups),
+				(unsigned long)g->write_us_max);
+		}
+		free(g->buffer);
+		free(g->records);
+		free(g);
+		ctx->group = NULL;
+	}
+#endif
+}
+
+esp_err_t write_riff_header(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "write-riff-header";
+	esp_err_t err = mjpeg_riff_header(ctx);
+	if (err != ESP_OK) {
+		// Nothing can be recorded without the header, whatever it allocated so far goes
+		mjpeg_release(ctx, F_TAG);
+	}
+	return err;
+}
+
+static esp_err_t mjpeg_final_riff_updates(mjpeg_handle_t ctx) {
 	const char F_TAG[] = "write-final-riff-updates";
 	esp_err_t err = ESP_OK;
 
 	uint8_t byte_alignment_buffer = 0x00;
 
-	// We now know the size of movi, so update that value
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->movi_size);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->movi_size;
-	ctx->out_file_handle->payload.pos		= ctx->movi_size_pos;
-	err = update_file(ctx->out_file_handle);
+#if CONFIG_MJPEG_FMP4
+	if (ctx->container == MJPEG_CONTAINER_FMP4) {
+		return mjpeg_fmp4_finalize(ctx);
+	}
+#endif
+
+#if CONFIG_MJPEG_REC_GROUP
+	err = mjpeg_group_flush(ctx);
 	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to update the movi size: %s", esp_err_to_name(err));
 		return err;
 	}
+#endif
+
+#if CONFIG_MJPEG_SERVE
+	// From here on the file is no longer appended to, the server serves it as it is once it is closed
+	mjpeg_live_begin(ctx);
+	ctx->live = false;
+	mjpeg_live_end(ctx);
+#endif
+
+	// We now know the size of movi, it is patched in along with the rest of the header below
 	ctx->riff_size += ctx->movi_size;
 
+#if CONFIG_MJPEG_RAW_RECORDING
+	if (ctx->raw != NULL) {
+		// The stream ends with movi, rawrec_export() appends the index when the recording is copied out
+		err = mjpeg_queue_size_patches(ctx, ctx->riff_size);
+		if (err == ESP_OK) {
+			err = mjpeg_apply_patches(ctx);
+		}
+		if (err == ESP_OK) {
+			err = mjpeg_raw_err(rawrec_end(ctx->raw));
+		}
+		if (err != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to close the raw recording: %s", esp_err_to_name(err));
+			return err;
+		}
+		FABRIC_LOG_INFO(F_TAG, "Raw recording of %lu bytes closed after %lu device writes and %lu superblock commits",
+			(unsigned long)ctx->raw->super.entries[ctx->raw->super.count - 1].bytes, (unsigned long)ctx->raw->writes,
+			(unsigned long)ctx->raw->commits);
+		return err;
+	}
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+	if (ctx->sim != NULL) {
+		// Nothing to copy, the index and checksums only cost the time to write them
+		ctx->riff_size += sizeof(CHNK) + ctx->idx_entries * sizeof(IDX1);
+		simstore_write(ctx->sim, sizeof(CHNK) + ctx->idx_entries * sizeof(IDX1));
+#if CONFIG_MJPEG_FRAME_CRC
+		ctx->riff_size += sizeof(CHNK) + ctx->idx_entries * sizeof(uint32_t);
+		simstore_write(ctx->sim, sizeof(CHNK) + ctx->idx_entries * sizeof(uint32_t));
+#endif
+		err = mjpeg_queue_size_patches(ctx, ctx->riff_size);
+		if (err == ESP_OK) {
+			err = mjpeg_apply_patches(ctx);
+		}
+		return err;
+	}
+#endif
+
 	// We now have to write the indicies in the temporary file into the actual file
 	ctx->idx_file_handle->payload.pos		= 0;
 	err = seek_file(ctx->idx_file_handle);
@@ -397,11 +1696,23 @@ esp_err_t write_final_riff_updates(mjpeg_handle_t ctx) {
 		return err;
 	}
 
+	// Write IDX1 keyword and size of the index. Without it the index is not a chunk and nothing can follow it
+	uint32_t buffer[2] = { FOURCC_IDX1, ctx->idx_entries * sizeof(IDX1) };
+	ctx->out_file_handle->payload.current_data_len	= sizeof(buffer);
+	ctx->out_file_handle->payload.data		= (char *)buffer;
+	err = write_file(ctx->out_file_handle);
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write IDX1 keyword and size to file: %s", esp_err_to_name(err));
+		return err;
+	}
+	ctx->riff_size += sizeof(buffer);
+
 	// Read and write each IDX1 saved to the temp file
-	for (size_t i = 0; i < ctx->total_frames; i++) {
-		IDX1 idx1 = {0x00};
-		ctx->idx_file_handle->payload.max_data_len	= sizeof(idx1);
-		ctx->idx_file_handle->payload.data		= (char *)&idx1;
+	for (size_t i = 0; i < ctx->idx_entries; i++) {
+		mjpeg_idx_record_t record = {0x00};
+		IDX1 idx1;
+		ctx->idx_file_handle->payload.max_data_len	= sizeof(record);
+		ctx->idx_file_handle->payload.data		= (char *)&record;
 		err = read_file(ctx->idx_file_handle);
 		if (err != ESP_OK) {
 			FABRIC_LOG_ERROR(F_TAG, "Failed to read IDX1 from temp file: %s", esp_err_to_name(err));
@@ -411,6 +1722,7 @@ esp_err_t write_final_riff_updates(mjpeg_handle_t ctx) {
 			FABRIC_LOG_ERROR(F_TAG, "We did not retrieve the expected amount of data! Expected: %lu, got: %lu", ctx->idx_file_handle->payload.max_data_len, ctx->idx_file_handle->payload.current_data_len);
 			return ESP_ERR_INVALID_SIZE;
 		}
+		idx1 = record.idx1;
 
 		ctx->out_file_handle->payload.current_data_len	= sizeof(idx1);
 		ctx->out_file_handle->payload.data		= (char *)&idx1;
@@ -433,34 +1745,248 @@ esp_err_t write_final_riff_updates(mjpeg_handle_t ctx) {
 		}
 	}
 
-	// We now know the size of riff, so update that value
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->riff_size);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->riff_size;
-	ctx->out_file_handle->payload.pos		= ctx->riff_size_pos;
-	err = update_file(ctx->out_file_handle);
+#if CONFIG_MJPEG_FRAME_CRC
+	err = mjpeg_write_crcs(ctx);
 	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to update the riff size: %s", esp_err_to_name(err));
+		FABRIC_LOG_ERROR(F_TAG, "Failed to write the frame checksums: %s", esp_err_to_name(err));
 		return err;
 	}
+	if (ctx->crc_us > 0) {
+		FABRIC_LOG_INFO(F_TAG, "CRC32C of %zu movi bytes took %llu us (%llu KB/s)", ctx->movi_size,
+			(unsigned long long)ctx->crc_us, (unsigned long long)(ctx->movi_size * 1000000ULL / 1024 / ctx->crc_us));
+	}
+#endif
 
-	// We know the number of frames we recorded, so update that value
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->total_frames);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->total_frames;
-	ctx->out_file_handle->payload.pos		= ctx->avih_total_frames_pos;
-	err = update_file(ctx->out_file_handle);
+	// We now know the size of riff and the number of frames we recorded. All of these fields
+	// sit in the first sector of the file, so they are written back together
+	err = mjpeg_queue_size_patches(ctx, ctx->riff_size);
+	if (err == ESP_OK) {
+		err = mjpeg_apply_patches(ctx);
+	}
 	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to update the avih total frames: %s", esp_err_to_name(err));
+		FABRIC_LOG_ERROR(F_TAG, "Failed to update the riff header: %s", esp_err_to_name(err));
 		return err;
 	}
+	FABRIC_LOG_DEBUG(F_TAG, "Applied %zu header patches in %zu writes", ctx->journal.applied, ctx->journal.writes);
+	return err;
+}
+
+esp_err_t write_final_riff_updates(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "write-final-riff-updates";
+	size_t riff_size = ctx->riff_size;
+
+	// The recording is over either way. When finishing it failed the file keeps what was written
+	esp_err_t err = mjpeg_final_riff_updates(ctx);
+	if (err != ESP_OK && ctx->container == MJPEG_CONTAINER_AVI) {
+		// As at a checkpoint the riff then ends with movi, readers that scan movi play every frame written
+		if (mjpeg_queue_size_patches(ctx, riff_size + ctx->movi_size) != ESP_OK || mjpeg_apply_patches(ctx) != ESP_OK) {
+			FABRIC_LOG_ERROR(F_TAG, "Failed to leave a playable header behind");
+		}
+	}
+	mjpeg_release(ctx, F_TAG);
+	return err;
+}
+
+// Drops a recording that cannot go on, for instance after write_jpeg_frame() failed. The files are left as
+// they are, with the header as of the last checkpoint
+void mjpeg_abort(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "mjpeg-abort";
+	mjpeg_release(ctx, F_TAG);
+}
+
+
+esp_err_t mjpeg_checkpoint(mjpeg_handle_t ctx) {
+	const char F_TAG[] = "mjpeg-checkpoint";
+
+#if CONFIG_MJPEG_FMP4
+	// Every closed fragment is already complete on the card
+	if (ctx->container == MJPEG_CONTAINER_FMP4) {
+		return ESP_OK;
+	}
+#endif
+
+	esp_err_t err = ESP_OK;
+#if CONFIG_MJPEG_REC_GROUP
+	// The checkpoint covers every frame received so far
+	err = mjpeg_group_flush(ctx);
+#endif
 
-	ctx->out_file_handle->payload.current_data_len	= sizeof(ctx->total_frames);
-	ctx->out_file_handle->payload.data		= (char *)&ctx->total_frames;
-	ctx->out_file_handle->payload.pos		= ctx->strh_length_pos;
-	err = update_file(ctx->out_file_handle);
+	// Without the index the riff ends where movi does. Readers that scan movi can play the file back up to here
+	if (err == ESP_OK) {
+		err = mjpeg_queue_size_patches(ctx, ctx->riff_size + ctx->movi_size);
+	}
+	if (err == ESP_OK) {
+		err = mjpeg_apply_patches(ctx);
+	}
+#if CONFIG_MJPEG_RAW_RECORDING
+	// Staged data has to reach the device and the superblock before the checkpoint means anything
+	if (err == ESP_OK && ctx->raw != NULL) {
+		err = mjpeg_raw_err(rawrec_sync(ctx->raw));
+	}
+#endif
 	if (err != ESP_OK) {
-		FABRIC_LOG_ERROR(F_TAG, "Failed to update the strh length: %s", esp_err_to_name(err));
-		return err;
+		FABRIC_LOG_ERROR(F_TAG, "Failed to checkpoint the riff header: %s", esp_err_to_name(err));
+	}
+	return err;
+}
+
+#if CONFIG_MJPEG_BURST
+esp_err_t mjpeg_burst_alloc(burst_t *burst) {
+	const char F_TAG[] = "mjpeg-burst-alloc";
+	size_t arena_size = (size_t)CONFIG_MJPEG_BURST_ARENA_KB * 1024;
+	uint8_t *arena = heap_caps_malloc(arena_size, MALLOC_CAP_SPIRAM);
+	burst_entry_t *entries = heap_caps_malloc(CONFIG_MJPEG_BURST_MAX_FRAMES * sizeof(burst_entry_t), MALLOC_CAP_SPIRAM);
+
+	SemaphoreHandle_t wake = xSemaphoreCreateBinary();
+	SemaphoreHandle_t lock = xSemaphoreCreateMutex();
+
+	if (arena == NULL || entries == NULL || wake == NULL || lock == NULL) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to allocate a %zu byte burst arena for %d frames", arena_size, CONFIG_MJPEG_BURST_MAX_FRAMES);
+		heap_caps_free(arena);
+		heap_caps_free(entries);
+		if (wake != NULL) {
+			vSemaphoreDelete(wake);
+		}
+		if (lock != NULL) {
+			vSemaphoreDelete(lock);
+		}
+		return ESP_ERR_NO_MEM;
+	}
+	burst_init(burst, arena, arena_size, entries, CONFIG_MJPEG_BURST_MAX_FRAMES);
+	burst->wake = wake;
+	burst->lock = lock;
+	return ESP_OK;
+}
+
+void mjpeg_burst_free(burst_t *burst) {
+	heap_caps_free(burst->arena);
+	heap_caps_free(burst->entries);
+	if (burst->wake != NULL) {
+		vSemaphoreDelete(burst->wake);
+	}
+	if (burst->lock != NULL) {
+		vSemaphoreDelete(burst->lock);
+	}
+	burst->arena = NULL;
+	burst->entries = NULL;
+	burst->wake = NULL;
+	burst->lock = NULL;
+}
+
+esp_err_t mjpeg_burst_begin(burst_t *burst) {
+	return burst_begin(burst, esp_timer_get_time()) ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+// Called by the camera task. Only copies the frame, which the caller can hand back to the camera right away.
+// The lock keeps a flush that gives up on the burst from ending it while the frame is half added
+esp_err_t mjpeg_burst_add(burst_t *burst, frame_buffer_t frame_buffer) {
+	xSemaphoreTake(burst->lock, portMAX_DELAY);
+	int added = burst_add(burst, frame_buffer.buffer, frame_buffer.buffer_len, esp_timer_get_time());
+	xSemaphoreGive(burst->lock);
+	if (!added) {
+		return ESP_ERR_NO_MEM;
+	}
+	xSemaphoreGive(burst->wake);
+	return ESP_OK;
+}
+
+// Called by the camera task after its last frame, the flush writes out what is left and finishes the file
+void mjpeg_burst_end(burst_t *burst) {
+	burst_end(burst);
+	xSemaphoreGive(burst->wake);
+}
+
+// The burst is played back at the rate it was captured, not the one the context was set up with
+static esp_err_t mjpeg_burst_timing(mjpeg_handle_t ctx, uint32_t period_us) {
+	long avih_pos = ctx->avih_total_frames_pos - offsetof(AVIH, totalFrames);
+	long strh_pos = ctx->strh_length_pos - offsetof(STRH, length);
+
+	if (!patch_add(&ctx->journal, avih_pos + offsetof(AVIH, microSecPerFrame), period_us) ||
+		!patch_add(&ctx->journal, strh_pos + offsetof(STRH, scale), period_us) ||
+		!patch_add(&ctx->journal, strh_pos + offsetof(STRH, rate), 1000000)) {
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+esp_err_t mjpeg_burst_flush(mjpeg_handle_t ctx, burst_t *burst) {
+	const char F_TAG[] = "mjpeg-burst-flush";
+	uint32_t first_us = 0;
+	uint32_t last_us = 0;
+	size_t frames = 0;
+	bool timed_out = false;
+	int64_t start = esp_timer_get_time();
+
+	// The capture rate is patched into the AVI header, fMP4 has no such field for a whole recording
+	esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+	if (ctx->container == MJPEG_CONTAINER_AVI) {
+		err = write_riff_header(ctx);
+	}
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Failed to start the burst recording: %s", esp_err_to_name(err));
+	}
+	bool recording = err == ESP_OK;
+
+	// A failed recording still drains the arena, so the camera side can begin the next burst
+	while (!burst_done(burst)) {
+		burst_entry_t entry;
+		const uint8_t *data;
+		if (!burst_peek(burst, &entry, &data)) {
+			// Woken by the next mjpeg_burst_add() or by mjpeg_burst_end(). A camera task that stops feeding the burst
+			// without ending it would hold the arena forever, so the flush ends it instead. Under the lock a frame
+			// being added is either in the arena before the burst ends or refused after
+			if (xSemaphoreTake(burst->wake, pdMS_TO_TICKS(CONFIG_MJPEG_BURST_TIMEOUT_MS)) == pdTRUE || timed_out) {
+				continue;
+			}
+			FABRIC_LOG_WARN(F_TAG, "No burst frame for %d ms, ending the burst", CONFIG_MJPEG_BURST_TIMEOUT_MS);
+			timed_out = true;
+			xSemaphoreTake(burst->lock, portMAX_DELAY);
+			burst_end(burst);
+			xSemaphoreGive(burst->lock);
+			burst_status_t status;
+			burst_status(burst, &status);
+			if (status.state == BURST_IDLE) {
+				// Never begun, there is nothing to wait for
+				break;
+			}
+			continue;
+		}
+		if (err == ESP_OK) {
+			frame_buffer_t frame_buffer = {
+				.buffer		= (uint8_t *)data,
+				.buffer_len	= entry.size,
+			};
+			err = write_jpeg_frame(ctx, frame_buffer);
+			if (err != ESP_OK) {
+				FABRIC_LOG_ERROR(F_TAG, "Failed to write burst frame %zu, dropping the rest: %s", frames, esp_err_to_name(err));
+			}
+			if (frames++ == 0) {
+				first_us = entry.time_us;
+			}
+			last_us = entry.time_us;
+		}
+		burst_pop(burst);
+	}
+
+	if (recording) {
+		if (err == ESP_OK && frames > 1 && last_us - first_us >= frames - 1) {
+			err = mjpeg_burst_timing(ctx, (last_us - first_us) / (frames - 1));
+		}
+		// After a failed frame the file is still finished, with the frames written before it
+		esp_err_t final_err = write_final_riff_updates(ctx);
+		if (err == ESP_OK) {
+			err = final_err;
+		}
+	}
+	if (err == ESP_OK && timed_out) {
+		err = ESP_ERR_TIMEOUT;
 	}
 
+	burst_status_t status;
+	burst_status(burst, &status);
+	FABRIC_LOG_INFO(F_TAG, "Burst of %lu frames: %lu written (%llu bytes) in %llu ms, %lu lost to overflow, arena peak %lu%%",
+		(unsigned long)status.captured, (unsigned long)status.written, (unsigned long long)status.written_bytes,
+		(unsigned long long)((esp_timer_get_time() - start) / 1000), (unsigned long)status.lost, (unsigned long)(status.peak_permille / 10));
 	return err;
 }
+#endif
@@ -1,6 +1,7 @@
 #ifndef MJPEG_H
 #define MJPEG_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "freertos/FreeRTOS.h"
@@ -11,8 +12,40 @@
 
 #include "esp_err.h"
 
+#include "patch.h"
 #include "riff.h"
 
+#if CONFIG_MJPEG_SCENE_FILTER
+#include "scene.h"
+#endif
+#if CONFIG_MJPEG_RATE_CONTROL
+#include "rate.h"
+#endif
+#if CONFIG_MJPEG_RAW_RECORDING
+#include "rawrec.h"
+#endif
+#if CONFIG_MJPEG_THUMBNAILS
+#include "thumb.h"
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+#include "simstore.h"
+#endif
+#if CONFIG_MJPEG_FMP4
+#include "fmp4.h"
+#endif
+#if CONFIG_MJPEG_CROP
+#include "crop.h"
+#endif
+#if CONFIG_MJPEG_REHUFF
+#include "rehuff.h"
+#endif
+#if CONFIG_MJPEG_SERVE
+#include "serve.h"
+#endif
+#if CONFIG_MJPEG_BURST
+#include "burst.h"
+#endif
+
 #define MJPEG_SVC_TASK                 mjpeg_svc
 #define MJPEG_SVC_TASK_NAME            "MJPEG-SVC-TASK"
 #define MJPEG_SVC_STACK_SIZE           4096
@@ -20,6 +53,28 @@
 #define MJPEG_SVC_TASK_CORE            1
 #define MJPEG_SVC_TASK_MALLOC          MALLOC_CAP_SPIRAM
 
+struct mjpeg_thumb;
+struct mjpeg_fmp4;
+struct mjpeg_crop;
+struct mjpeg_rehuff;
+struct mjpeg_group;
+
+typedef enum {
+	MJPEG_CONTAINER_AVI = 0,
+	MJPEG_CONTAINER_FMP4,		// Fragmented MP4, needs CONFIG_MJPEG_FMP4
+} mjpeg_container_t;
+
+#if CONFIG_MJPEG_SCENE_FILTER
+struct mjpeg_scene;
+
+typedef struct {
+	size_t frames_skipped;
+	size_t bytes_skipped;
+	uint64_t filter_us;	// CPU time spent deciding, over all frames
+	uint32_t filter_us_max;
+} mjpeg_scene_stats_t;
+#endif
+
 struct mjpeg_context {
 	sd_handle_t out_file_handle; // This is the real file that the avi will be stored in
 	sd_handle_t idx_file_handle; // This is a temporary file. It stores the index table for seeking to particular frames that is appended to the end of the avi file after we are done
@@ -31,6 +86,7 @@ struct mjpeg_context {
 	size_t strl_size;
 	size_t movi_size;
 	size_t total_frames;
+	size_t idx_entries;	// Entries in the temporary index file, one per frame plus one per 'rec ' list
 	long riff_size_pos;
 	long hdrl_size_pos;
 	long strl_size_pos;
@@ -41,6 +97,48 @@ struct mjpeg_context {
 	STRH strh;
 	BMPH bmph;
 	VPRP vprp;
+#if CONFIG_MJPEG_SCENE_FILTER
+	struct mjpeg_scene *scene;	// Allocated on the first frame
+	IDX1 last_idx1;			// Index entry of the last frame that was actually stored
+	mjpeg_scene_stats_t scene_stats;
+#endif
+	patch_journal_t journal;	// Size and count fields waiting to be written back into the header
+#if CONFIG_MJPEG_RATE_CONTROL
+	rate_t rate;			// Storage feedback, only active once a callback is set
+#endif
+#if CONFIG_MJPEG_FRAME_CRC
+	uint32_t last_crc;		// CRC32C of the last stored frame
+	uint64_t crc_us;		// Time spent checksumming, over all frames
+#endif
+#if CONFIG_MJPEG_RAW_RECORDING
+	rawrec_t *raw;			// Raw block region recorded to instead of out_file_handle, see mjpeg_use_raw_device()
+#endif
+#if CONFIG_MJPEG_THUMBNAILS
+	sd_handle_t thumb_file_handle;	// Thumbnail strip sidecar, see write_jpeg_thumbnail(). Optional
+	struct mjpeg_thumb *thumb;	// Allocated on the first thumbnail
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+	simstore_t *sim;		// Simulated card charged instead of writing anything, see soak.h
+#endif
+	mjpeg_container_t container;	// Picked before write_riff_header(), the three calls then write that format
+#if CONFIG_MJPEG_FMP4
+	struct mjpeg_fmp4 *fmp4;	// Allocated by write_riff_header() for MJPEG_CONTAINER_FMP4
+#endif
+#if CONFIG_MJPEG_CROP
+	struct mjpeg_crop *crop;	// Allocated by write_riff_header(), see crop.h
+#endif
+#if CONFIG_MJPEG_REHUFF
+	struct mjpeg_rehuff *rehuff;	// Allocated on the first stored frame, see rehuff.h
+#endif
+#if CONFIG_MJPEG_REC_GROUP
+	struct mjpeg_group *group;	// Allocated by write_riff_header(), see mjpeg_group_flush()
+#endif
+#if CONFIG_MJPEG_SERVE
+	bool live;			// An AVI is being recorded to the card, see mjpeg_live_snapshot()
+	uint32_t live_seq;		// Odd while the fields the server reads are being changed
+	size_t live_movi_size;		// movi_size and idx_entries as of the last whole frame
+	size_t live_entries;
+#endif
 };
 
 typedef struct mjpeg_context	mjpeg_context_t;
@@ -49,5 +147,33 @@ typedef struct mjpeg_context*	mjpeg_handle_t;
 esp_err_t write_riff_header(mjpeg_handle_t ctx);
 esp_err_t write_jpeg_frame(mjpeg_handle_t ctx, frame_buffer_t frame_buffer);
 esp_err_t write_final_riff_updates(mjpeg_handle_t ctx);
+void mjpeg_abort(mjpeg_handle_t ctx);
+#if CONFIG_MJPEG_THUMBNAILS
+esp_err_t write_jpeg_thumbnail(mjpeg_handle_t ctx, frame_buffer_t frame_buffer);
+#endif
+esp_err_t mjpeg_checkpoint(mjpeg_handle_t ctx);
+#if CONFIG_MJPEG_RATE_CONTROL
+void mjpeg_set_rate_callback(mjpeg_handle_t ctx, rate_callback_t callback, void *arg);
+#endif
+#if CONFIG_MJPEG_RAW_RECORDING
+esp_err_t mjpeg_use_raw_device(mjpeg_handle_t ctx, rawrec_t *raw);
+#endif
+#if CONFIG_MJPEG_STORAGE_SIM
+void mjpeg_use_storage_sim(mjpeg_handle_t ctx, simstore_t *sim);
+#endif
+#if CONFIG_MJPEG_SERVE
+int mjpeg_live_snapshot(void *arg, serve_live_t *live);
+#endif
+#if CONFIG_MJPEG_REC_GROUP
+size_t mjpeg_group_pending(mjpeg_handle_t ctx);
+#endif
+#if CONFIG_MJPEG_BURST
+esp_err_t mjpeg_burst_alloc(burst_t *burst);
+void mjpeg_burst_free(burst_t *burst);
+esp_err_t mjpeg_burst_begin(burst_t *burst);
+esp_err_t mjpeg_burst_add(burst_t *burst, frame_buffer_t frame_buffer);
+void mjpeg_burst_end(burst_t *burst);
+esp_err_t mjpeg_burst_flush(mjpeg_handle_t ctx, burst_t *burst);
+#endif
 
 #endif /* MJPEG_H */
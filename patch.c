@@ -0,0 +1,96 @@
+/*
+ * patch.c - Deferred header patches, applied in one pass
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "patch.h"
+
+#define PATCH_SIZE	sizeof(uint32_t)
+
+void patch_init(patch_journal_t *journal) {
+	memset(journal, 0, sizeof(*journal));
+}
+
+// Only a sequential prefix of the file is mirrored, which is how the header gets written
+void patch_shadow(patch_journal_t *journal, long offset, const void *data, size_t len) {
+	if (offset < 0 || (size_t)offset != journal->shadow_len) return;
+	if (len > PATCH_SECTOR_SIZE - journal->shadow_len) len = PATCH_SECTOR_SIZE - journal->shadow_len;
+	memcpy(journal->shadow + journal->shadow_len, data, len);
+	journal->shadow_len += len;
+}
+
+// A later patch of the same field replaces the earlier one
+int patch_add(patch_journal_t *journal, long offset, uint32_t value) {
+	for (size_t i = 0; i < journal->count; i++) {
+		if (journal->patches[i].offset == offset) {
+			journal->patches[i].value = value;
+			return 1;
+		}
+	}
+	if (offset < 0 || journal->count == PATCH_MAX) return 0;
+	journal->patches[journal->count].offset = offset;
+	journal->patches[journal->count].value = value;
+	journal->count++;
+	return 1;
+}
+
+static int patch_in_shadow(const patch_journal_t *journal, long start, long end) {
+	return start >= 0 && end <= (long)journal->shadow_len;
+}
+
+int patch_apply(patch_journal_t *journal, patch_write_fn_t write, void *io) {
+	patch_t *p = journal->patches;
+	size_t n = journal->count;
+	int err = 0;
+
+	// Insertion sort, there are only a handful of patches
+	for (size_t i = 1; i < n; i++) {
+		patch_t key = p[i];
+		size_t j = i;
+		for (; j > 0 && p[j - 1].offset > key.offset; j--) p[j] = p[j - 1];
+		p[j] = key;
+	}
+
+	size_t i = 0;
+	while (i < n) {
+		long sector = p[i].offset / PATCH_SECTOR_SIZE;
+		long start = p[i].offset;
+		long end = start + (long)PATCH_SIZE;
+		size_t j = i + 1;
+
+		// Grow the run while the next patch sits in the same sector and the gap is known,
+		// either because it is mirrored or because the patches touch
+		while (j < n && p[j].offset / PATCH_SECTOR_SIZE == sector && p[j].offset >= end) {
+			long next_end = p[j].offset + (long)PATCH_SIZE;
+			if (p[j].offset != end && !patch_in_shadow(journal, start, next_end)) break;
+			end = next_end;
+			j++;
+		}
+
+		// Keep the shadow current so later checkpoints write the patched values back
+		for (size_t k = i; k < j; k++) {
+			if (patch_in_shadow(journal, p[k].offset, p[k].offset + (long)PATCH_SIZE)) {
+				memcpy(journal->shadow + p[k].offset, &p[k].value, PATCH_SIZE);
+			}
+		}
+		if (patch_in_shadow(journal, start, end)) {
+			err = write(io, start, journal->shadow + start, (size_t)(end - start));
+		} else {
+			uint32_t values[PATCH_MAX];
+			for (size_t k = i; k < j; k++) values[k - i] = p[k].value;
+			err = write(io, start, values, (size_t)(end - start));
+		}
+		if (err) break;
+		journal->writes++;
+		journal->applied += j - i;
+		i = j;
+	}
+
+	// Whatever did not make it stays queued for the next attempt
+	memmove(p, p + i, (n - i) * sizeof(patch_t));
+	journal->count = n - i;
+	return err;
+}
@@ -0,0 +1,45 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+/*
+ * patch.h - Deferred header patches, applied in one pass
+ *
+ * The size and count fields of an AVI header are only known once the
+ * recording is done (or at a checkpoint). Instead of seeking back for every
+ * field, callers register (offset, value) patches here. They are applied in
+ * offset order and every patch falling in the same sector goes out in a
+ * single write.
+ *
+ * Writes that cover the bytes between two patches are built from a shadow
+ * copy of the start of the file, so nothing is ever read back.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PATCH_SECTOR_SIZE	512
+#define PATCH_MAX		16
+
+typedef struct {
+	long offset;
+	uint32_t value;
+} patch_t;
+
+// Writes len bytes at an absolute file offset, returns 0 on success or an error code
+typedef int (*patch_write_fn_t)(void *io, long offset, const void *data, size_t len);
+
+typedef struct {
+	patch_t patches[PATCH_MAX];	// Pending, in registration order
+	size_t count;
+	uint8_t shadow[PATCH_SECTOR_SIZE];	// Copy of the file bytes [0, shadow_len)
+	size_t shadow_len;
+	size_t applied;			// Patches applied so far
+	size_t writes;			// Writes issued so far
+} patch_journal_t;
+
+void patch_init(patch_journal_t *journal);
+void patch_shadow(patch_journal_t *journal, long offset, const void *data, size_t len);
+int patch_add(patch_journal_t *journal, long offset, uint32_t value);
+int patch_apply(patch_journal_t *journal, patch_write_fn_t write, void *io);
+
+#endif /* PATCH_H */
@@ -0,0 +1,81 @@
+/*
+ * rate.c - Storage-aware frame size controller
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "rate.h"
+
+#define RATE_EWMA_SHIFT		3	// Smoothing over roughly the last 8 frames
+#define RATE_DOWN_NUM		3	// Multiplicative decrease to 3/4 ...
+#define RATE_DOWN_DEN		4
+#define RATE_UP_STEPS		8	// ... additive increase of 1/8 of the range
+
+void rate_init(rate_t *rate, const rate_config_t *config, rate_callback_t callback, void *arg) {
+	memset(rate, 0, sizeof(*rate));
+	rate->config = *config;
+	if (rate->config.min_bytes > rate->config.max_bytes) rate->config.min_bytes = rate->config.max_bytes;
+	if (rate->config.low_permille > rate->config.high_permille) rate->config.low_permille = rate->config.high_permille;
+	rate->callback = callback;
+	rate->callback_arg = arg;
+	rate->target = rate->config.max_bytes;
+}
+
+static uint32_t rate_ewma(uint32_t avg, uint32_t sample, int first) {
+	if (first) return sample;
+	return (uint32_t)((int64_t)avg + (((int64_t)sample - (int64_t)avg) >> RATE_EWMA_SHIFT));
+}
+
+static uint32_t rate_clamp(const rate_t *rate, uint64_t bytes) {
+	if (bytes < rate->config.min_bytes) return rate->config.min_bytes;
+	if (bytes > rate->config.max_bytes) return rate->config.max_bytes;
+	return (uint32_t)bytes;
+}
+
+// Frame size the card sustains while spending no more than the low threshold of each period writing
+static uint64_t rate_sustainable(const rate_t *rate) {
+	return (uint64_t)rate->throughput * rate->config.frame_us / 1000000 * rate->config.low_permille / 1000;
+}
+
+// Returns 1 when the target changed and the callback was called
+int rate_update(rate_t *rate, uint32_t bytes, uint32_t elapsed_us) {
+	const rate_config_t *config = &rate->config;
+	uint32_t target = rate->target;
+	int first = rate->frames++ == 0;
+
+	if (elapsed_us == 0) elapsed_us = 1;
+	rate->throughput = rate_ewma(rate->throughput, (uint32_t)((uint64_t)bytes * 1000000 / elapsed_us), first);
+	rate->write_us = rate_ewma(rate->write_us, elapsed_us, first);
+	rate->utilisation = config->frame_us ? (uint32_t)((uint64_t)rate->write_us * 1000 / config->frame_us) : 0;
+
+	rate->over = rate->utilisation > config->high_permille ? rate->over + 1 : 0;
+	rate->under = rate->utilisation < config->low_permille ? rate->under + 1 : 0;
+	if (rate->hold > 0) {
+		rate->hold--;
+		return 0;
+	}
+
+	if (rate->over >= config->down_frames) {
+		// Cut straight to what the card currently sustains when that is lower still
+		uint64_t down = (uint64_t)target * RATE_DOWN_NUM / RATE_DOWN_DEN;
+		uint64_t sustainable = rate_sustainable(rate);
+		target = rate_clamp(rate, sustainable < down ? sustainable : down);
+	} else if (rate->under >= config->up_frames) {
+		uint64_t up = (uint64_t)target + (config->max_bytes - config->min_bytes) / RATE_UP_STEPS + 1;
+		uint64_t sustainable = rate_sustainable(rate);
+		// Never step above what was measured, a slow card stays where it is
+		if (sustainable > target && up > sustainable) up = sustainable;
+		if (sustainable > target) target = rate_clamp(rate, up);
+	}
+
+	if (target == rate->target) return 0;
+	rate->target = target;
+	rate->changes++;
+	rate->over = 0;
+	rate->under = 0;
+	rate->hold = config->hold_frames;
+	if (rate->callback) rate->callback(target, rate->callback_arg);
+	return 1;
+}
@@ -0,0 +1,53 @@
+#ifndef RATE_H
+#define RATE_H
+
+/*
+ * rate.h - Storage-aware frame size controller
+ *
+ * Every stored frame reports how many bytes went to the card and how long
+ * the writes took. The controller keeps smoothed estimates of the write
+ * throughput and of the share of the frame period spent writing, and turns
+ * them into a target number of bytes per frame for the camera.
+ *
+ * The target drops quickly when the card cannot keep up and recovers
+ * slowly. The gap between the two utilisation thresholds, the number of
+ * frames a condition has to persist and a hold-off after every change keep
+ * the camera quality from oscillating.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Called with the new target whenever it changes
+typedef void (*rate_callback_t)(uint32_t target_bytes, void *arg);
+
+typedef struct {
+	uint32_t frame_us;		// Frame period
+	uint32_t min_bytes;		// Never ask for less than this
+	uint32_t max_bytes;		// Target when the card keeps up, the starting point
+	uint16_t high_permille;		// Write time per frame period above which the target drops
+	uint16_t low_permille;		// Write time per frame period below which the target may rise
+	uint16_t down_frames;		// Frames above high before dropping
+	uint16_t up_frames;		// Frames below low before rising
+	uint16_t hold_frames;		// Frames after a change during which no other change is made
+} rate_config_t;
+
+typedef struct {
+	rate_config_t config;
+	rate_callback_t callback;
+	void *callback_arg;
+	uint32_t target;		// Bytes per frame currently asked for
+	uint32_t throughput;		// Smoothed write throughput, bytes per second
+	uint32_t write_us;		// Smoothed write time per frame
+	uint32_t utilisation;		// write_us per frame period, per mille
+	uint16_t over;			// Consecutive frames above high
+	uint16_t under;			// Consecutive frames below low
+	uint16_t hold;			// Frames left before another change is allowed
+	uint32_t frames;
+	uint32_t changes;
+} rate_t;
+
+void rate_init(rate_t *rate, const rate_config_t *config, rate_callback_t callback, void *arg);
+int rate_update(rate_t *rate, uint32_t bytes, uint32_t elapsed_us);
+
+#endif /* RATE_H */
@@ -0,0 +1,382 @@
+/*
+ * rawrec.c - Recording straight to a raw block region, without FAT
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "riff.h"
+#include "crc32c.h"
+#include "rawrec.h"
+
+#define RAWREC_MAGIC		FOURCC_STR_TO_INT('M','J','R','W')
+#define RAWREC_COMMIT_BLOCKS	2048	// 1 MB of recording at most is lost to a power cut
+#define RAWREC_EXPORT_WINDOW	(64 * 1024)
+
+#define RAWREC_BLOCKS(bytes)	(((bytes) + RAWREC_BLOCK_SIZE - 1) / RAWREC_BLOCK_SIZE)
+
+typedef char rawrec_super_fits_a_block[sizeof(rawrec_super_t) == RAWREC_BLOCK_SIZE ? 1 : -1];
+
+static uint32_t rawrec_super_crc(const rawrec_super_t *super) {
+	return crc32c_update(0, super, offsetof(rawrec_super_t, crc));
+}
+
+static int rawrec_super_valid(const rawrec_t *raw, const rawrec_super_t *super) {
+	return super->magic == RAWREC_MAGIC && super->version == RAWREC_VERSION &&
+		super->block_count == raw->dev.block_count && super->count <= RAWREC_MAX_ENTRIES &&
+		super->crc == rawrec_super_crc(super);
+}
+
+// Each generation goes to the other copy, the one being replaced is always the older one
+static int rawrec_commit(rawrec_t *raw) {
+	rawrec_super_t *super = &raw->super;
+	super->generation++;
+	super->crc = rawrec_super_crc(super);
+	if (raw->dev.write(raw->dev.dev, raw->dev.first_lba + super->generation % RAWREC_SUPER_BLOCKS, super, 1) != 0) return RAWREC_ERR_IO;
+	raw->writes++;
+	raw->commits++;
+	raw->uncommitted = 0;
+	return RAWREC_OK;
+}
+
+int rawrec_init(rawrec_t *raw, const rawrec_dev_t *dev, uint8_t *stage, size_t stage_size) {
+	rawrec_super_t copy;
+
+	memset(raw, 0, sizeof(*raw));
+	raw->dev = *dev;
+	raw->stage = stage;
+	raw->stage_size = stage_size - stage_size % RAWREC_BLOCK_SIZE;
+	raw->commit_blocks = RAWREC_COMMIT_BLOCKS;
+	raw->open = -1;
+	if (dev->block_count <= RAWREC_SUPER_BLOCKS) return RAWREC_ERR_ARG;
+
+	// The newer of the two valid copies wins
+	int have = dev->read(dev->dev, dev->first_lba, &raw->super, 1) == 0 && rawrec_super_valid(raw, &raw->super);
+	if (dev->read(dev->dev, dev->first_lba + 1, &copy, 1) == 0 && rawrec_super_valid(raw, &copy) &&
+		(!have || copy.generation > raw->super.generation)) {
+		raw->super = copy;
+		have = 1;
+	}
+	if (!have) {
+		// Keep the generation of whatever was there so a format always supersedes it
+		uint32_t generation = raw->super.generation > copy.generation ? raw->super.generation : copy.generation;
+		memset(&raw->super, 0, sizeof(raw->super));
+		raw->super.generation = generation;
+		return RAWREC_ERR_FORMAT;
+	}
+	return RAWREC_OK;
+}
+
+int rawrec_format(rawrec_t *raw) {
+	uint32_t generation = raw->super.generation;
+	if (raw->open >= 0) return RAWREC_ERR_STATE;
+
+	memset(&raw->super, 0, sizeof(raw->super));
+	raw->super.magic = RAWREC_MAGIC;
+	raw->super.version = RAWREC_VERSION;
+	raw->super.block_count = raw->dev.block_count;
+	raw->super.next_block = RAWREC_SUPER_BLOCKS;
+	raw->super.generation = generation;
+	// Both copies, so a stale copy from before the format can never win
+	for (int i = 0; i < RAWREC_SUPER_BLOCKS; i++) {
+		int err = rawrec_commit(raw);
+		if (err != RAWREC_OK) return err;
+	}
+	return RAWREC_OK;
+}
+
+int rawrec_begin(rawrec_t *raw) {
+	rawrec_super_t *super = &raw->super;
+	if (super->magic != RAWREC_MAGIC || raw->open >= 0 || !raw->stage || raw->stage_size == 0) return RAWREC_ERR_STATE;
+	if (super->count == RAWREC_MAX_ENTRIES || super->next_block >= super->block_count) return RAWREC_ERR_FULL;
+
+	rawrec_entry_t *entry = &super->entries[super->count];
+	entry->start = super->next_block;
+	entry->bytes = 0;
+	entry->state = RAWREC_OPEN;
+	entry->id = super->count ? super->entries[super->count - 1].id + 1 : 1;
+	raw->open = (int)super->count++;
+	raw->flushed = 0;
+	raw->staged = 0;
+	raw->pos = 0;
+	return rawrec_commit(raw);
+}
+
+// Records how much of the open recording is safely on the device
+static int rawrec_commit_open(rawrec_t *raw, uint32_t bytes) {
+	rawrec_entry_t *entry = &raw->super.entries[raw->open];
+	entry->bytes = bytes;
+	raw->super.next_block = entry->start + RAWREC_BLOCKS(bytes);
+	return rawrec_commit(raw);
+}
+
+static int rawrec_write_blocks(rawrec_t *raw, uint32_t block, const void *buf, uint32_t count) {
+	const rawrec_entry_t *entry = &raw->super.entries[raw->open];
+	if (entry->start + block + count > raw->super.block_count) return RAWREC_ERR_FULL;
+	if (raw->dev.write(raw->dev.dev, raw->dev.first_lba + entry->start + block, buf, count) != 0) return RAWREC_ERR_IO;
+	raw->writes++;
+	return RAWREC_OK;
+}
+
+static int rawrec_flush_stage(rawrec_t *raw) {
+	uint32_t blocks = (uint32_t)(raw->staged / RAWREC_BLOCK_SIZE);
+	int err = rawrec_write_blocks(raw, raw->flushed, raw->stage, blocks);
+	if (err != RAWREC_OK) return err;
+	raw->flushed += blocks;
+	raw->uncommitted += blocks;
+	raw->staged = 0;
+	if (raw->uncommitted >= raw->commit_blocks) return rawrec_commit_open(raw, raw->flushed * RAWREC_BLOCK_SIZE);
+	return RAWREC_OK;
+}
+
+int rawrec_write(rawrec_t *raw, const void *data, size_t len) {
+	const uint8_t *p = data;
+	if (raw->open < 0) return RAWREC_ERR_STATE;
+	if (len > UINT32_MAX - raw->pos) return RAWREC_ERR_FULL;
+
+	while (len > 0) {
+		size_t n = raw->stage_size - raw->staged < len ? raw->stage_size - raw->staged : len;
+		memcpy(raw->stage + raw->staged, p, n);
+		raw->staged += n;
+		raw->pos += (uint32_t)n;
+		p += n;
+		len -= n;
+		if (raw->staged == raw->stage_size) {
+			int err = rawrec_flush_stage(raw);
+			if (err != RAWREC_OK) return err;
+		}
+	}
+	return RAWREC_OK;
+}
+
+// Rewrites bytes already written, the header fields patched at checkpoints and at the end
+int rawrec_pwrite(rawrec_t *raw, uint32_t offset, const void *data, size_t len) {
+	const uint8_t *p = data;
+	uint8_t block[RAWREC_BLOCK_SIZE];
+	uint32_t staged_from = raw->flushed * RAWREC_BLOCK_SIZE;
+
+	if (raw->open < 0) return RAWREC_ERR_STATE;
+	if (offset > raw->pos || len > raw->pos - offset) return RAWREC_ERR_ARG;
+
+	while (len > 0) {
+		uint32_t index = offset / RAWREC_BLOCK_SIZE;
+		uint32_t within = offset % RAWREC_BLOCK_SIZE;
+		size_t n = RAWREC_BLOCK_SIZE - within < len ? RAWREC_BLOCK_SIZE - within : len;
+
+		if (offset >= staged_from) {
+			memcpy(raw->stage + (offset - staged_from), p, n);
+		} else {
+			const rawrec_entry_t *entry = &raw->super.entries[raw->open];
+			if (raw->dev.read(raw->dev.dev, raw->dev.first_lba + entry->start + index, block, 1) != 0) return RAWREC_ERR_IO;
+			memcpy(block + within, p, n);
+			int err = rawrec_write_blocks(raw, index, block, 1);
+			if (err != RAWREC_OK) return err;
+		}
+		offset += (uint32_t)n;
+		p += n;
+		len -= n;
+	}
+	return RAWREC_OK;
+}
+
+// Puts the partial stage on the device, zero padded, without giving it up: later
+// writes land in the same blocks again. Everything written so far is then committed
+int rawrec_sync(rawrec_t *raw) {
+	if (raw->open < 0) return RAWREC_ERR_STATE;
+	if (raw->staged > 0) {
+		uint32_t blocks = (uint32_t)RAWREC_BLOCKS(raw->staged);
+		memset(raw->stage + raw->staged, 0, blocks * RAWREC_BLOCK_SIZE - raw->staged);
+		int err = rawrec_write_blocks(raw, raw->flushed, raw->stage, blocks);
+		if (err != RAWREC_OK) return err;
+	}
+	return rawrec_commit_open(raw, raw->pos);
+}
+
+int rawrec_end(rawrec_t *raw) {
+	int err = rawrec_sync(raw);
+	if (err != RAWREC_OK) return err;
+	raw->super.entries[raw->open].state = RAWREC_CLOSED;
+	err = rawrec_commit(raw);
+	raw->open = -1;
+	return err;
+}
+
+int rawrec_read(rawrec_t *raw, int index, uint32_t offset, void *buf, size_t len) {
+	uint8_t *p = buf;
+	uint8_t block[RAWREC_BLOCK_SIZE];
+
+	if (index < 0 || (uint32_t)index >= raw->super.count) return RAWREC_ERR_ARG;
+	const rawrec_entry_t *entry = &raw->super.entries[index];
+	if (offset > entry->bytes || len > entry->bytes - offset) return RAWREC_ERR_ARG;
+	uint32_t lba = raw->dev.first_lba + entry->start;
+
+	while (len > 0) {
+		uint32_t within = offset % RAWREC_BLOCK_SIZE;
+		if (within == 0 && len >= RAWREC_BLOCK_SIZE) {
+			// Whole blocks go straight into the caller's buffer
+			uint32_t count = (uint32_t)(len / RAWREC_BLOCK_SIZE);
+			if (raw->dev.read(raw->dev.dev, lba + offset / RAWREC_BLOCK_SIZE, p, count) != 0) return RAWREC_ERR_IO;
+			offset += count * RAWREC_BLOCK_SIZE;
+			p += count * RAWREC_BLOCK_SIZE;
+			len -= count * RAWREC_BLOCK_SIZE;
+			continue;
+		}
+		size_t n = RAWREC_BLOCK_SIZE - within < len ? RAWREC_BLOCK_SIZE - within : len;
+		if (raw->dev.read(raw->dev.dev, lba + offset / RAWREC_BLOCK_SIZE, block, 1) != 0) return RAWREC_ERR_IO;
+		memcpy(p, block + within, n);
+		offset += (uint32_t)n;
+		p += n;
+		len -= n;
+	}
+	return RAWREC_OK;
+}
+
+// A forward-only view of a recording, refilled as the walk moves on
+struct rawrec_window {
+	rawrec_t *raw;
+	int index;
+	uint32_t size;			// Length of the recording
+	uint8_t *buf;
+	uint32_t base;			// Recording offset of buf[0]
+	uint32_t len;
+};
+
+static const uint8_t *rawrec_window_get(struct rawrec_window *w, uint32_t offset, uint32_t n) {
+	if (offset > w->size || n > w->size - offset || n > RAWREC_EXPORT_WINDOW) return NULL;
+	if (offset < w->base || offset + n > w->base + w->len) {
+		uint32_t len = w->size - offset < RAWREC_EXPORT_WINDOW ? w->size - offset : RAWREC_EXPORT_WINDOW;
+		if (rawrec_read(w->raw, w->index, offset, w->buf, len) != RAWREC_OK) return NULL;
+		w->base = offset;
+		w->len = len;
+	}
+	return w->buf + (offset - w->base);
+}
+
+// A chunk a recording can legitimately hold. Anything else marks the end of what made it to the device
+static int rawrec_known_chunk(FOURCC fcc) {
+	return fcc == FOURCC_00DC || fcc == FOURCC_LIST || fcc == FOURCC_JUNK;
+}
+
+static void rawrec_put32(uint8_t *header, uint32_t header_len, long offset, uint32_t value) {
+	if (offset >= 0 && (uint32_t)offset + sizeof(value) <= header_len) memcpy(header + offset, &value, sizeof(value));
+}
+
+int rawrec_export(rawrec_t *raw, int index, FILE *out, uint32_t *frames) {
+	struct rawrec_window w = { raw, index, 0, NULL, 0, 0 };
+	IDX1 *entries = NULL;
+	uint8_t *header = NULL;
+	uint32_t count = 0;
+	uint32_t capacity = 0;
+	uint32_t movi_pos = 0;		// Offset of the 'movi' fourcc
+	long avih_frames = -1;
+	long strh_length = -1;
+	const uint8_t *p;
+	int err = RAWREC_ERR_FORMAT;
+
+	if (index < 0 || (uint32_t)index >= raw->super.count) return RAWREC_ERR_ARG;
+	w.size = raw->super.entries[index].bytes;
+	if (!(w.buf = malloc(RAWREC_EXPORT_WINDOW))) return RAWREC_ERR_IO;
+
+	// Top level: RIFF AVI, the header list and the start of movi. Sizes past the header list may be unset
+	if (!(p = rawrec_window_get(&w, 0, 3 * sizeof(uint32_t))) || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "AVI ", 4) != 0) goto out;
+	for (uint32_t at = 3 * sizeof(uint32_t); (p = rawrec_window_get(&w, at, sizeof(CHNK) + sizeof(FOURCC))); ) {
+		FOURCC fcc;
+		FOURCC type;
+		uint32_t size;
+		riff_chunk_header(p, sizeof(CHNK), &fcc, &size);
+		memcpy(&type, p + sizeof(CHNK), sizeof(type));
+		if (fcc == FOURCC_LIST && type == FOURCC_MOVI) {
+			movi_pos = at + sizeof(CHNK);
+			break;
+		}
+		if (size > w.size - at - sizeof(CHNK)) goto out;
+		if (fcc == FOURCC_LIST && (type == FOURCC_HDRL || type == FOURCC_HDLR)) {
+			riff_span_t hdrl;
+			riff_span_t strl;
+			riff_chunk_t chunk;
+			if (size < sizeof(FOURCC) || !(p = rawrec_window_get(&w, at + sizeof(CHNK) + sizeof(FOURCC), size - sizeof(FOURCC)))) goto out;
+			riff_span_init(&hdrl, p, size - sizeof(FOURCC));
+			hdrl.origin = at + sizeof(CHNK) + sizeof(FOURCC);
+			while (riff_span_next(&hdrl, &chunk)) {
+				if (chunk.fcc == FOURCC_AVIH) {
+					avih_frames = (long)(chunk.offset + sizeof(CHNK) + offsetof(AVIH, totalFrames));
+				} else if (chunk.fcc == FOURCC_LIST && chunk.type == FOURCC_STRL && strh_length < 0) {
+					riff_span_enter(&strl, &chunk);
+					if (riff_span_find(&strl, FOURCC_STRH, 0, &chunk)) {
+						strh_length = (long)(chunk.offset + sizeof(CHNK) + offsetof(STRH, length));
+					}
+				}
+			}
+		}
+		at += sizeof(CHNK) + size + (size & 1);
+	}
+	if (!movi_pos || movi_pos + sizeof(FOURCC) > RAWREC_EXPORT_WINDOW) goto out;
+
+	// Walk movi for as long as whole, plausible chunks follow, indexing the frames on the way
+	uint32_t at = movi_pos + sizeof(FOURCC);
+	while ((p = rawrec_window_get(&w, at, sizeof(CHNK))) != NULL) {
+		FOURCC fcc;
+		uint32_t size;
+		riff_chunk_header(p, sizeof(CHNK), &fcc, &size);
+		if (!rawrec_known_chunk(fcc)) break;
+		if (fcc == FOURCC_LIST) {
+			// Step inside, the chunks of a list follow linearly
+			if (w.size - at < sizeof(CHNK) + sizeof(FOURCC)) break;
+			at += sizeof(CHNK) + sizeof(FOURCC);
+			continue;
+		}
+		uint32_t end = at + sizeof(CHNK) + size + (size & 1);
+		if (size > w.size - at - sizeof(CHNK) || end > w.size) break;
+		if (fcc == FOURCC_00DC) {
+			if (count == capacity) {
+				uint32_t grown_capacity = capacity ? capacity * 2 : 1024;
+				IDX1 *grown = realloc(entries, grown_capacity * sizeof(IDX1));
+				if (!grown) {
+					err = RAWREC_ERR_IO;
+					goto out;
+				}
+				entries = grown;
+				capacity = grown_capacity;
+			}
+			entries[count].id = fcc;
+			entries[count].flags = 0;
+			entries[count].offset = at - movi_pos;
+			entries[count].size = size;
+			count++;
+		}
+		at = end;
+	}
+	uint32_t movi_end = at;
+
+	// Header with the sizes and counts of what was recovered
+	uint32_t header_len = movi_pos + sizeof(FOURCC);
+	uint32_t idx1_size = count * sizeof(IDX1);
+	if (!(header = malloc(header_len)) || rawrec_read(raw, index, 0, header, header_len) != RAWREC_OK) {
+		err = RAWREC_ERR_IO;
+		goto out;
+	}
+	rawrec_put32(header, header_len, sizeof(FOURCC), movi_end + sizeof(CHNK) + idx1_size - sizeof(CHNK));
+	rawrec_put32(header, header_len, movi_pos - sizeof(uint32_t), movi_end - movi_pos);
+	rawrec_put32(header, header_len, avih_frames, count);
+	rawrec_put32(header, header_len, strh_length, count);
+
+	err = RAWREC_ERR_IO;
+	if (fwrite(header, 1, header_len, out) != header_len) goto out;
+	for (uint32_t from = header_len; from < movi_end; ) {
+		uint32_t n = movi_end - from < RAWREC_EXPORT_WINDOW ? movi_end - from : RAWREC_EXPORT_WINDOW;
+		if (rawrec_read(raw, index, from, w.buf, n) != RAWREC_OK || fwrite(w.buf, 1, n, out) != n) goto out;
+		from += n;
+	}
+	if (!fwritechunk(FOURCC_IDX1, idx1_size, out) || (count && fwrite(entries, sizeof(IDX1), count, out) != count)) goto out;
+	if (frames) *frames = count;
+	err = RAWREC_OK;
+
+out:
+	free(entries);
+	free(header);
+	free(w.buf);
+	return err;
+}
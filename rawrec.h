@@ -0,0 +1,96 @@
+#ifndef RAWREC_H
+#define RAWREC_H
+
+/*
+ * rawrec.h - Recording straight to a raw block region, without FAT
+ *
+ * The region is a reserved partition of the card or a preallocated
+ * contiguous extent, handed over as a first LBA and a block count. The AVI
+ * byte stream of a recording is laid down block after block exactly as the
+ * muxer produces it, staged so the device only ever sees whole, multi-block
+ * writes. Nothing else is written during a recording except the superblock
+ * every commit_blocks blocks.
+ *
+ * The first two blocks of the region hold alternating copies of a small
+ * superblock listing every recording (start block, committed length,
+ * state). Each commit goes to the older copy with a higher generation and a
+ * CRC32C, so a torn write always leaves the other copy intact. After a power
+ * loss a recording is still found, with everything up to its last commit.
+ *
+ * The muxer does not write an index in this mode. rawrec_export() copies a
+ * recording out as a normal AVI, trimming a torn last frame, rebuilding
+ * idx1 from the movi list and fixing the header sizes and frame counts.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define RAWREC_BLOCK_SIZE	512
+#define RAWREC_SUPER_BLOCKS	2
+#define RAWREC_MAX_ENTRIES	30
+#define RAWREC_VERSION		1
+
+#define RAWREC_OK		0
+#define RAWREC_ERR_IO		-1
+#define RAWREC_ERR_FORMAT	-2	// No valid superblock, the region needs rawrec_format()
+#define RAWREC_ERR_FULL		-3	// Out of blocks or recording slots
+#define RAWREC_ERR_STATE	-4
+#define RAWREC_ERR_ARG		-5
+
+#define RAWREC_OPEN		1	// Being recorded, or cut short
+#define RAWREC_CLOSED		2
+
+typedef struct {
+	void *dev;
+	int (*read)(void *dev, uint32_t lba, void *buf, uint32_t count);	// 0 on success
+	int (*write)(void *dev, uint32_t lba, const void *buf, uint32_t count);
+	uint32_t first_lba;
+	uint32_t block_count;
+} rawrec_dev_t;
+
+typedef struct {
+	uint32_t start;			// First block, relative to the region
+	uint32_t bytes;			// Length of the stream up to the last commit
+	uint32_t state;
+	uint32_t id;
+} rawrec_entry_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t generation;
+	uint32_t block_count;
+	uint32_t next_block;		// First free block, relative to the region
+	uint32_t count;
+	rawrec_entry_t entries[RAWREC_MAX_ENTRIES];
+	uint32_t reserved;
+	uint32_t crc;			// CRC32C of everything above
+} rawrec_super_t;
+
+typedef struct {
+	rawrec_dev_t dev;
+	rawrec_super_t super;
+	uint8_t *stage;			// Caller owned, a multiple of RAWREC_BLOCK_SIZE
+	size_t stage_size;
+	size_t staged;			// Bytes waiting in stage
+	uint32_t commit_blocks;		// Blocks between superblock commits during a recording
+	int open;			// Index of the recording in progress, -1 when none
+	uint32_t flushed;		// Blocks of the recording in progress on the device
+	uint32_t uncommitted;		// Blocks flushed since the last commit
+	uint32_t pos;			// Bytes written to the recording in progress
+	uint32_t writes;		// Device writes issued
+	uint32_t commits;
+} rawrec_t;
+
+int rawrec_init(rawrec_t *raw, const rawrec_dev_t *dev, uint8_t *stage, size_t stage_size);
+int rawrec_format(rawrec_t *raw);
+int rawrec_begin(rawrec_t *raw);
+int rawrec_write(rawrec_t *raw, const void *data, size_t len);
+int rawrec_pwrite(rawrec_t *raw, uint32_t offset, const void *data, size_t len);
+int rawrec_sync(rawrec_t *raw);
+int rawrec_end(rawrec_t *raw);
+int rawrec_read(rawrec_t *raw, int index, uint32_t offset, void *buf, size_t len);
+int rawrec_export(rawrec_t *raw, int index, FILE *out, uint32_t *frames);
+
+#endif /* RAWREC_H */
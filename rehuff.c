@@ -0,0 +1,183 @@
+/*
+ * rehuff.c - Lossless re-encoding of baseline JPEG frames with optimal Huffman tables
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "jpeg.h"
+#include "rehuff.h"
+
+#define RD16(p) ((uint16_t)((p)[0] << 8 | (p)[1]))
+#define WR16(p, v) do { (p)[0] = (uint8_t)((v) >> 8); (p)[1] = (uint8_t)(v); } while (0)
+
+void rehuff_init(rehuff_t *rehuff, uint32_t window) {
+	memset(rehuff, 0, sizeof(*rehuff));
+	rehuff->window = window;
+}
+
+static void rehuff_reset(rehuff_t *rehuff) {
+	for (int t = 0; t < REHUFF_TABLES; t++) memset(rehuff->stats[t].freq, 0, sizeof(rehuff->stats[t].freq));
+}
+
+// Every symbol baseline can send gets a count, so tables built from other frames can encode this one
+static void rehuff_smooth(rehuff_t *rehuff) {
+	for (int t = 0; t < JPEG_MAX_HUFF_TABLES; t++) {
+		uint32_t *dc = rehuff->stats[t].freq;
+		uint32_t *ac = rehuff->stats[JPEG_MAX_HUFF_TABLES + t].freq;
+		for (int s = 0; s <= 11; s++) dc[s]++;
+		ac[0x00]++;
+		ac[0xF0]++;
+		for (int run = 0; run < 16; run++) {
+			for (int s = 1; s <= 10; s++) ac[run << 4 | s]++;
+		}
+	}
+}
+
+static int rehuff_build(rehuff_t *rehuff) {
+	for (int t = 0; t < REHUFF_TABLES; t++) {
+		if (!jpeg_build_optimal(&rehuff->stats[t], rehuff->bits[t], rehuff->vals[t])) return 0;
+		jpeg_build_huff_enc(&rehuff->enc[t], rehuff->bits[t], rehuff->vals[t]);
+	}
+	rehuff_reset(rehuff);
+	rehuff->frames = 0;
+	rehuff->ready = 1;
+	return 1;
+}
+
+static void rehuff_count_mcu(rehuff_t *rehuff, int16_t *pred) {
+	const jpeg_info_t *info = &rehuff->jpeg;
+
+	for (int b = 0; b < info->mcu_blocks; b++) {
+		const jpeg_component_t *comp = &info->comp[info->mcu_comp[b]];
+		jpeg_count_block(rehuff->coef[b], &pred[info->mcu_comp[b]], &rehuff->stats[comp->td],
+			&rehuff->stats[JPEG_MAX_HUFF_TABLES + comp->ta]);
+	}
+}
+
+// First pass: the symbols of the whole scan. Restart intervals reset the predictors, the output has none
+static int rehuff_count(rehuff_t *rehuff) {
+	const jpeg_info_t *info = &rehuff->jpeg;
+	uint32_t total = (uint32_t)info->mcus_x * info->mcus_y;
+	int16_t pred[JPEG_MAX_COMPONENTS] = { 0 };
+	jpeg_scan_t scan;
+
+	jpeg_scan_begin(&scan, info);
+	for (uint32_t mcu = 0; mcu < total; mcu++) {
+		if (!jpeg_decode_mcu(&scan, rehuff->coef)) return 0;
+		rehuff_count_mcu(rehuff, pred);
+	}
+	return 1;
+}
+
+// The frame's segments up to SOS without its DHT, a DHT with the tables the scan uses, then SOS
+static size_t rehuff_headers(rehuff_t *rehuff, const uint8_t *data, uint8_t *out, size_t cap) {
+	const jpeg_info_t *info = &rehuff->jpeg;
+	uint8_t used[REHUFF_TABLES] = { 0 };
+	size_t dht_len = 2;
+	size_t pos = 2;
+	size_t o = 2;
+
+	for (int c = 0; c < info->num_components; c++) {
+		used[info->comp[c].td] = 1;
+		used[JPEG_MAX_HUFF_TABLES + info->comp[c].ta] = 1;
+	}
+	for (int t = 0; t < REHUFF_TABLES; t++) {
+		if (!used[t]) continue;
+		dht_len += 17;
+		for (int n = 1; n <= 16; n++) dht_len += rehuff->bits[t][n];
+	}
+	if (cap < info->scan_pos + dht_len + 2) {
+		rehuff->overflow = 1;
+		return 0;
+	}
+
+	out[0] = 0xFF;
+	out[1] = JPEG_MARKER_SOI;
+	while (pos < info->sos_pos) {
+		size_t start = pos;
+		while (pos < info->sos_pos && data[pos] == 0xFF) pos++;
+		if (pos + 3 > info->sos_pos) return 0;
+		uint8_t marker = data[pos];
+		size_t end = pos + 1 + RD16(data + pos + 1);
+		if (end > info->sos_pos) return 0;
+		if (marker != JPEG_MARKER_DHT) {
+			memcpy(out + o, data + start, end - start);
+			if (marker == JPEG_MARKER_DRI) WR16(out + o + (pos + 3 - start), 0);
+			o += end - start;
+		}
+		pos = end;
+	}
+
+	out[o++] = 0xFF;
+	out[o++] = JPEG_MARKER_DHT;
+	WR16(out + o, dht_len);
+	o += 2;
+	for (int t = 0; t < REHUFF_TABLES; t++) {
+		if (!used[t]) continue;
+		int count = 0;
+		out[o++] = (uint8_t)((t >= JPEG_MAX_HUFF_TABLES) << 4 | t % JPEG_MAX_HUFF_TABLES);
+		for (int n = 1; n <= 16; n++) {
+			out[o++] = rehuff->bits[t][n];
+			count += rehuff->bits[t][n];
+		}
+		memcpy(out + o, rehuff->vals[t], count);
+		o += count;
+	}
+	memcpy(out + o, data + info->sos_pos, info->scan_pos - info->sos_pos);
+	return o + info->scan_pos - info->sos_pos;
+}
+
+size_t rehuff_jpeg(rehuff_t *rehuff, const uint8_t *data, size_t len, uint8_t *out, size_t cap) {
+	jpeg_info_t *info = &rehuff->jpeg;
+	int16_t pred[JPEG_MAX_COMPONENTS] = { 0 };
+	int16_t count_pred[JPEG_MAX_COMPONENTS] = { 0 };
+	jpeg_scan_t scan;
+	jpeg_writer_t w;
+
+	rehuff->overflow = 0;
+	if (!jpeg_parse(info, data, len)) return 0;
+
+	// Tables of its own for every frame, or to start the window
+	int own = rehuff->window == 0 || !rehuff->ready;
+	if (own) {
+		rehuff_reset(rehuff);
+		if (!rehuff_count(rehuff)) return 0;
+		if (rehuff->window > 0) rehuff_smooth(rehuff);
+		if (!rehuff_build(rehuff)) return 0;
+	}
+
+	size_t head = rehuff_headers(rehuff, data, out, cap);
+	if (head == 0) return 0;
+
+	uint32_t total = (uint32_t)info->mcus_x * info->mcus_y;
+	jpeg_scan_begin(&scan, info);
+	jpeg_writer_begin(&w, out + head, cap - head - 2);
+	for (uint32_t mcu = 0; mcu < total; mcu++) {
+		if (!jpeg_decode_mcu(&scan, rehuff->coef)) return 0;
+		for (int b = 0; b < info->mcu_blocks; b++) {
+			const jpeg_component_t *comp = &info->comp[info->mcu_comp[b]];
+			if (!jpeg_encode_block(&w, rehuff->coef[b], &pred[info->mcu_comp[b]], &rehuff->enc[comp->td],
+				&rehuff->enc[JPEG_MAX_HUFF_TABLES + comp->ta])) {
+				return 0;
+			}
+		}
+		// The window's counts come from the same decode
+		if (rehuff->window > 0) rehuff_count_mcu(rehuff, count_pred);
+	}
+
+	size_t scan_len = jpeg_writer_end(&w);
+	if (scan_len == 0) {
+		rehuff->overflow = w.overflow;
+		return 0;
+	}
+	out[head + scan_len] = 0xFF;
+	out[head + scan_len + 1] = JPEG_MARKER_EOI;
+
+	if (rehuff->window > 0 && ++rehuff->frames >= rehuff->window) {
+		rehuff_smooth(rehuff);
+		if (!rehuff_build(rehuff)) rehuff->ready = 0;
+	}
+	return head + scan_len + 2;
+}
@@ -0,0 +1,48 @@
+#ifndef REHUFF_H
+#define REHUFF_H
+
+/*
+ * rehuff.h - Lossless re-encoding of baseline JPEG frames with optimal Huffman tables
+ *
+ * Camera encoders use the example tables of Annex K, which fit no frame in
+ * particular. The quantised coefficients are decoded (see jpeg.h), their
+ * symbols counted and the scan encoded again with tables built for those
+ * counts (Annex K.2), usually 5-15% smaller. The pixels do not change: the
+ * quantisers and coefficients are the same, only their code words are.
+ *
+ * With a window of 0 every frame gets its own tables, at the cost of
+ * decoding the scan twice. With a window of N frames the scan is decoded
+ * once and encoded with tables built from the counts of the previous N
+ * frames, plus one for every symbol so that any frame can be encoded; the
+ * first frame builds them itself. Consecutive frames of a camera are close
+ * enough that this keeps most of the gain.
+ *
+ * The output drops the frame's DHT segments for one with the new tables
+ * and drops the restart interval. Like jpeg.c, rehuff_jpeg() returns 0 on
+ * failure, leaving the frame to be stored as it came.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jpeg.h"
+
+#define REHUFF_TABLES	(2 * JPEG_MAX_HUFF_TABLES)	// DC tables, then AC tables
+
+typedef struct {
+	jpeg_info_t jpeg;
+	int16_t coef[JPEG_MAX_MCU_BLOCKS][64];
+	jpeg_huff_stats_t stats[REHUFF_TABLES];
+	uint8_t bits[REHUFF_TABLES][17];
+	uint8_t vals[REHUFF_TABLES][256];
+	jpeg_huff_enc_t enc[REHUFF_TABLES];
+	uint32_t window;		// Frames per table rebuild, 0 for tables per frame
+	uint32_t frames;		// Frames counted since the tables were built
+	int ready;			// Tables from earlier frames are in enc
+	int overflow;			// Set when the last frame failed only because the output buffer was too small
+} rehuff_t;
+
+void rehuff_init(rehuff_t *rehuff, uint32_t window);
+size_t rehuff_jpeg(rehuff_t *rehuff, const uint8_t *data, size_t len, uint8_t *out, size_t cap);
+
+#endif /* REHUFF_H */
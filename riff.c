@@ -30,47 +30,139 @@
 
 #include "riff.h"
 
+#define RD32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+
+const char *fourcc_r(FOURCC fcc, char *buf) {
+	buf[0] = (char)(fcc & 0xff);
+	buf[1] = (char)((fcc >> 8) & 0xff);
+	buf[2] = (char)((fcc >> 16) & 0xff);
+	buf[3] = (char)(fcc >> 24);
+	buf[4] = 0;
+	return buf;
+}
+
+/* Rotating buffers so a few calls can share one printf, one set per thread */
 const char *fourcc(FOURCC fcc) {
-	static char sfcc[8][5];
-	static int rot = -1;
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+	static _Thread_local char sfcc[8][5];
+	static _Thread_local int rot;
+#else
+	static __thread char sfcc[8][5];
+	static __thread int rot;
+#endif
 	rot = (rot + 1) % 8;
-	sfcc[rot][4] = 0;
-	*(FOURCC *)sfcc[rot] = fcc;
-	return sfcc[rot++];
+	return fourcc_r(fcc, sfcc[rot]);
+}
+
+int riff_chunk_header(const void *data, size_t size, FOURCC *fcc, uint32_t *chunk_size) {
+	const uint8_t *p = data;
+	if(!p || size < sizeof(CHNK)) return 0;
+	if(fcc) *fcc = RD32(p);
+	if(chunk_size) *chunk_size = RD32(p + 4);
+	return 1;
+}
+
+void riff_span_init(riff_span_t *span, const void *data, size_t size) {
+	span->base = data;
+	span->size = data ? size : 0;
+	span->pos = 0;
+	span->origin = 0;
+	span->error = 0;
+}
+
+int riff_span_next(riff_span_t *span, riff_chunk_t *chunk) {
+	const uint8_t *p;
+	size_t left;
+	if(span->error || span->pos >= span->size) return 0;
+	left = span->size - span->pos;
+	p = span->base + span->pos;
+	if(left < sizeof(CHNK)) {
+		span->error = RIFF_ERR_SHORT;
+		return 0;
+	}
+	chunk->fcc = RD32(p);
+	chunk->size = RD32(p + 4);
+	chunk->offset = span->origin + span->pos;
+	if(chunk->size > left - sizeof(CHNK)) {
+		span->error = RIFF_ERR_OVERRUN;
+		return 0;
+	}
+	chunk->type = 0;
+	chunk->data = p + sizeof(CHNK);
+	chunk->data_size = chunk->size;
+	if((chunk->fcc == FOURCC_RIFF || chunk->fcc == FOURCC_LIST) && chunk->size >= sizeof(FOURCC)) {
+		chunk->type = RD32(chunk->data);
+		chunk->data += sizeof(FOURCC);
+		chunk->data_size -= sizeof(FOURCC);
+	}
+	/* Chunks are word aligned, a missing pad byte at the very end is tolerated */
+	span->pos += sizeof(CHNK) + chunk->size;
+	if((chunk->size & 1) && span->pos < span->size) span->pos++;
+	return 1;
+}
+
+void riff_span_enter(riff_span_t *child, const riff_chunk_t *list) {
+	riff_span_init(child, list->data, list->data_size);
+	child->origin = list->offset + sizeof(CHNK) + (list->size - list->data_size);
+}
+
+int riff_span_find(riff_span_t *span, FOURCC fcc, FOURCC type, riff_chunk_t *chunk) {
+	while(riff_span_next(span, chunk)) {
+		if(chunk->fcc == fcc && (!type || chunk->type == type)) return 1;
+	}
+	return 0;
 }
 
 int freadchunk(FOURCC *fcc, uint32_t *size, FILE *in) {
-	CHNK chnk;
+	uint8_t hdr[sizeof(CHNK)];
 	if(!fcc || !in || !size) return 0;
-	if(!fread(&chnk, sizeof(CHNK), 1, in)) return 0;
-	*fcc = chnk.fcc;
-	*size = chnk.size;
-	return 1;
+	if(!fread(hdr, sizeof(hdr), 1, in)) return 0;
+	return riff_chunk_header(hdr, sizeof(hdr), fcc, size);
 }
 
 int freadcc(FOURCC *fcc, FILE *in) {
+	uint8_t cc[sizeof(FOURCC)];
 	if(!fcc || !in) return 0;
-	return fread(fcc, sizeof(FOURCC), 1, in);
+	if(!fread(cc, sizeof(cc), 1, in)) return 0;
+	*fcc = RD32(cc);
+	return 1;
 }
 
 #ifndef MIN
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #endif
 
+#define FCOPY_BUFFER_SIZE 65536
+
+/* The buffer comes from the heap, a 4 KB stack buffer does not fit the muxer task */
 size_t fcopy(FILE *in, FILE *out, uint32_t size) {
-	uint8_t buf[4096]; /* usually one memory page */
-	size_t wrote = 0;
+	uint8_t *buf;
+	size_t wrote;
 	if(in && !out) {
 		fseek(in, size, SEEK_CUR);
 		return 0;
 	}
-	for(;;) {
-		size_t wants = MIN(size, sizeof(buf));
+	buf = malloc(FCOPY_BUFFER_SIZE);
+	if(!buf) return 0;
+	wrote = fcopybuf(in, out, size, buf, FCOPY_BUFFER_SIZE);
+	free(buf);
+	return wrote;
+}
+
+size_t fcopybuf(FILE *in, FILE *out, uint32_t size, uint8_t *buf, size_t buf_size) {
+	size_t wrote = 0;
+	if(!in || !buf || !buf_size) return 0;
+	if(!out) {
+		fseek(in, size, SEEK_CUR);
+		return 0;
+	}
+	while(size > 0) {
+		size_t wants = MIN(size, buf_size);
 		size_t read = fread(buf, 1, wants, in);
-		if(read > 0 && out) {
+		if(read > 0) {
 			wrote += fwrite(buf, 1, read, out);
 		}
-		if(read < wants || size == wants) break;
+		if(read < wants) break;
 		size -= wants;
 	}
 	return wrote;
@@ -104,16 +196,14 @@ void fgetpossafe(FILE *out, fpos_t *pos) {
 	fgetpos(out, pos);
 }
 
+/* Only the size field changes, so step over the fourcc instead of reading it back */
 int fupdate(FILE *out, fpos_t *pos, uint32_t value) {
 	fpos_t back;
-	FOURCC fcc;
-	uint32_t size;
 	if(!out) return 0;
-	fgetpos(out, &back);
-	fsetpos(out, pos);
-	freadchunk(&fcc, &size, out);
-	fsetpos(out, pos);
-	fwritechunk(fcc, value, out);
-	fsetpos(out, &back);
-	return 1;
+	if(fgetpos(out, &back) != 0) return 0;
+	if(fsetpos(out, pos) != 0 || fseek(out, sizeof(FOURCC), SEEK_CUR) != 0 || fwrite(&value, sizeof(value), 1, out) != 1) {
+		fsetpos(out, &back);
+		return 0;
+	}
+	return fsetpos(out, &back) == 0;
 }
@@ -36,6 +36,7 @@
 #define FOURCC_INFO FOURCC_STR_TO_INT('I','N','F','O')
 #define FOURCC_DXDT FOURCC_STR_TO_INT('D','X','D','T')
 #define FOURCC_HDLR FOURCC_STR_TO_INT('H','D','L','R')
+#define FOURCC_HDRL FOURCC_STR_TO_INT('h','d','r','l')
 #define FOURCC_AVIH FOURCC_STR_TO_INT('a','v','i','h')
 #define FOURCC_STRL FOURCC_STR_TO_INT('s','t','r','l')
 #define FOURCC_STRH FOURCC_STR_TO_INT('s','t','r','h')
@@ -47,6 +48,7 @@
 #define FOURCC_ODML FOURCC_STR_TO_INT('o','d','m','l')
 #define FOURCC_DMLH FOURCC_STR_TO_INT('d','m','l','h')
 #define FOURCC_MOVI FOURCC_STR_TO_INT('m','o','v','i')
+#define FOURCC_REC  FOURCC_STR_TO_INT('r','e','c',' ')
 #define FOURCC_IDX1 FOURCC_STR_TO_INT('i','d','x','1')
 #define FOURCC_VPRP FOURCC_STR_TO_INT('v','p','r','p')
 
@@ -56,6 +58,7 @@
 
 #define FOURCC_00DC FOURCC_STR_TO_INT('0','0','d','c')
 #define FOURCC_JPEG FOURCC_STR_TO_INT('M','J','P','G')
+#define FOURCC_CRCS FOURCC_STR_TO_INT('c','r','c','s')	// CRC32C of every indexed frame, follows idx1
 
 /*
 #define SWAPL(x) (((x) >> 24) | (((x)&0x00ff0000) >> 8) | (((x)&0x0000ff00) << 8) | ((x) << 24))
@@ -381,10 +384,39 @@ typedef struct {
 #define WAVE_FORMAT_DVM                     0x2000 /* FAST Multimedia AG */
 #define WAVE_FORMAT_EXTENSIBLE              0xFFFE /* Microsoft */
 
+/* Span based chunk parsing over memory or mmap regions: bounds checked, no global state */
+typedef struct {
+	FOURCC fcc;
+	FOURCC type;           /* List type of RIFF and LIST chunks, 0 otherwise */
+	uint32_t size;         /* Size as declared in the chunk header */
+	const uint8_t *data;   /* Payload, starting after the list type for lists */
+	size_t data_size;
+	size_t offset;         /* Offset of the chunk header from the start of the outermost span */
+} riff_chunk_t;
+
+typedef struct {
+	const uint8_t *base;
+	size_t size;
+	size_t pos;
+	size_t origin;         /* Offset of base from the start of the outermost span */
+	int error;
+} riff_span_t;
+
+#define RIFF_ERR_SHORT   1 /* Trailing bytes too short for a chunk header */
+#define RIFF_ERR_OVERRUN 2 /* Chunk payload runs past the end of its span */
+
+void riff_span_init(riff_span_t *span, const void *data, size_t size);
+int riff_span_next(riff_span_t *span, riff_chunk_t *chunk);
+void riff_span_enter(riff_span_t *child, const riff_chunk_t *list);
+int riff_span_find(riff_span_t *span, FOURCC fcc, FOURCC type, riff_chunk_t *chunk);
+int riff_chunk_header(const void *data, size_t size, FOURCC *fcc, uint32_t *chunk_size);
+
 const char *fourcc(FOURCC fcc);
+const char *fourcc_r(FOURCC fcc, char *buf);
 int freadchunk(FOURCC *fcc, uint32_t *size, FILE *in);
 int freadcc(FOURCC *fcc, FILE *in);
 size_t fcopy(FILE *in, FILE *out, uint32_t size);
+size_t fcopybuf(FILE *in, FILE *out, uint32_t size, uint8_t *buf, size_t buf_size);
 size_t fwritechunk(FOURCC fcc, uint32_t size, FILE *out);
 size_t fwritecc(FOURCC fcc, FILE *out);
 size_t fwritesafe(const void *ptr, size_t size, FILE *out);
@@ -0,0 +1,119 @@
+/*
+ * scene.c - Cheap static scene detection on compressed JPEG frames
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "jpeg.h"
+#include "scene.h"
+
+void scene_init(scene_t *scene, const scene_config_t *config, jpeg_info_t *scratch) {
+	memset(scene, 0, sizeof(*scene));
+	scene->config = *config;
+	scene->jpeg = scratch;
+}
+
+// Averages the dequantised luma DC of every block into a SCENE_GRID_W x SCENE_GRID_H grid.
+// A dequantised DC is 8x the mean of its block, so the cells end up in 1/8 luma levels.
+int scene_signature(scene_t *scene, const uint8_t *data, size_t len, int16_t *sig) {
+	jpeg_info_t *info = scene->jpeg;
+	jpeg_scan_t scan;
+	int32_t *sum = scene->sum;
+	uint16_t *count = scene->count;
+	int16_t dc[JPEG_MAX_MCU_BLOCKS];
+
+	if (!info || !jpeg_parse(info, data, len)) return 0;
+
+	const scene_config_t *config = &scene->config;
+	const jpeg_component_t *luma = &info->comp[0];
+	int32_t quant = info->dc_quant[luma->tq] ? info->dc_quant[luma->tq] : 1;
+	uint32_t x0 = 0;
+	uint32_t y0 = 0;
+	uint32_t x1 = info->width;
+	uint32_t y1 = info->height;
+	if (config->region_width) {
+		x0 = config->region_x < x1 ? config->region_x : x1;
+		y0 = config->region_y < y1 ? config->region_y : y1;
+		x1 = x0 + config->region_width < x1 ? x0 + config->region_width : x1;
+		y1 = y0 + config->region_height < y1 ? y0 + config->region_height : y1;
+	}
+	// Only blocks covering real pixels of the region take part, the right and bottom MCU padding is ignored
+	uint16_t bx0 = x0 * luma->h / info->max_h / 8;
+	uint16_t by0 = y0 * luma->v / info->max_v / 8;
+	uint16_t bx1 = (x1 * luma->h / info->max_h + 7) / 8;
+	uint16_t by1 = (y1 * luma->v / info->max_v + 7) / 8;
+	if (bx1 <= bx0 || by1 <= by0) return 0;
+	uint16_t blocks_w = bx1 - bx0;
+	uint16_t blocks_h = by1 - by0;
+	// Rows below the region are not even decoded
+	uint16_t mcus_y = (by1 + luma->v - 1) / luma->v;
+	if (mcus_y > info->mcus_y) mcus_y = info->mcus_y;
+
+	memset(scene->sum, 0, sizeof(scene->sum));
+	memset(scene->count, 0, sizeof(scene->count));
+	jpeg_scan_begin(&scan, info);
+	for (uint16_t my = 0; my < mcus_y; my++) {
+		for (uint16_t mx = 0; mx < info->mcus_x; mx++) {
+			if (!jpeg_decode_mcu_dc(&scan, dc)) return 0;
+			for (int b = 0; b < info->mcu_blocks && info->mcu_comp[b] == 0; b++) {
+				uint16_t bx = mx * luma->h + info->mcu_bx[b];
+				uint16_t by = my * luma->v + info->mcu_by[b];
+				if (bx < bx0 || by < by0 || bx >= bx1 || by >= by1) continue;
+				int cell = ((by - by0) * SCENE_GRID_H / blocks_h) * SCENE_GRID_W + (bx - bx0) * SCENE_GRID_W / blocks_w;
+				sum[cell] += dc[b] * quant;
+				count[cell]++;
+			}
+		}
+	}
+
+	for (int i = 0; i < SCENE_GRID_CELLS; i++) {
+		sig[i] = count[i] ? (int16_t)(sum[i] / count[i]) : 0;
+	}
+	return 1;
+}
+
+// Returns 1 when the frame can be dropped in favour of the last kept one, 0 when it has to be kept.
+// A kept frame becomes the new reference.
+int scene_is_static(scene_t *scene, const uint8_t *data, size_t len) {
+	const scene_config_t *config = &scene->config;
+	uint32_t size_delta = config->region_width ? 0 : 1000;
+	uint32_t dc_delta = 0;
+	int comparable = scene->has_ref && (config->max_skip == 0 || scene->skip_run < config->max_skip);
+
+	// With a region, the size also counts changes outside it, only the signature can tell
+	if (scene->ref_len && !config->region_width) {
+		size_t diff = len > scene->ref_len ? len - scene->ref_len : scene->ref_len - len;
+		size_delta = (uint32_t)(diff * 1000 / scene->ref_len);
+	}
+	scene->last_size_delta = size_delta;
+
+	// Even a frame that is clearly different has to be decoded, it becomes the next reference
+	if (!scene_signature(scene, data, len, scene->cur)) {
+		scene->has_ref = 0;
+		scene->ref_len = 0;
+		scene->skip_run = 0;
+		return 0;
+	}
+
+	if (comparable && size_delta < config->size_delta_permille) {
+		// Motion is usually local, so the worst cell decides rather than the frame average
+		for (int i = 0; i < SCENE_GRID_CELLS; i++) {
+			uint32_t d = scene->cur[i] > scene->ref[i] ? scene->cur[i] - scene->ref[i] : scene->ref[i] - scene->cur[i];
+			if (d > dc_delta) dc_delta = d;
+		}
+		dc_delta /= 8;
+		scene->last_dc_delta = dc_delta;
+		if (dc_delta < config->dc_delta) {
+			scene->skip_run++;
+			return 1;
+		}
+	}
+
+	memcpy(scene->ref, scene->cur, sizeof(scene->ref));
+	scene->ref_len = len;
+	scene->has_ref = 1;
+	scene->skip_run = 0;
+	return 0;
+}
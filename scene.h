@@ -0,0 +1,53 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+/*
+ * scene.h - Cheap static scene detection on compressed JPEG frames
+ *
+ * A frame is compared against the last frame that was kept, first by
+ * compressed size and then by a coarse luma signature built from the DC
+ * coefficients only (see jpeg.h). No pixels are ever reconstructed.
+ *
+ * When only a region of the frame is kept, the signature is laid over that
+ * region and the compressed size, which also covers the rest of the frame,
+ * is not compared.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jpeg.h"
+
+#define SCENE_GRID_W		16
+#define SCENE_GRID_H		12
+#define SCENE_GRID_CELLS	(SCENE_GRID_W * SCENE_GRID_H)
+
+typedef struct {
+	uint16_t size_delta_permille;	// Compressed size change that always counts as motion
+	uint8_t  dc_delta;		// Mean luma change (0-255 levels) of any one grid cell that counts as motion
+	uint16_t max_skip;		// Keep at least one frame after this many skipped frames, 0 for no limit
+	uint16_t region_x;		// Part of the frame that is compared, in pixels. A width of 0 for the whole frame
+	uint16_t region_y;
+	uint16_t region_width;
+	uint16_t region_height;
+} scene_config_t;
+
+typedef struct {
+	scene_config_t config;
+	jpeg_info_t *jpeg;		// Caller owned scratch, too large for a task stack
+	size_t   ref_len;
+	uint16_t skip_run;
+	uint8_t  has_ref;
+	int16_t  ref[SCENE_GRID_CELLS];	// Signature of the last kept frame
+	int16_t  cur[SCENE_GRID_CELLS];
+	int32_t  sum[SCENE_GRID_CELLS];	// Accumulators, kept here to stay off the muxer task stack
+	uint16_t count[SCENE_GRID_CELLS];
+	uint32_t last_dc_delta;		// Score of the last compared frame, for tuning
+	uint32_t last_size_delta;
+} scene_t;
+
+void scene_init(scene_t *scene, const scene_config_t *config, jpeg_info_t *scratch);
+int scene_signature(scene_t *scene, const uint8_t *data, size_t len, int16_t *sig);
+int scene_is_static(scene_t *scene, const uint8_t *data, size_t len);
+
+#endif /* SCENE_H */
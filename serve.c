@@ -0,0 +1,428 @@
+/*
+ * serve.c - Small HTTP server for recordings, with Range support
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "riff.h"
+#include "serve.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0	// lwIP has no SIGPIPE to suppress
+#endif
+
+#define SERVE_MIN_BUFFER_SIZE	4096
+#define SERVE_PATH_MAX		256
+#define SERVE_PIECES		4
+
+// A response body is a few pieces laid end to end, each from memory or from a file
+struct serve_piece {
+	const uint8_t *data;
+	FILE    *file;
+	long     pos;
+	uint64_t len;
+	uint32_t stride;	// File records this far apart of which only the leading IDX1 is sent, 0 for plain bytes
+};
+
+struct serve_body {
+	struct serve_piece pieces[SERVE_PIECES];
+	int      count;
+	uint64_t len;
+	FILE    *files[2];
+	const char *type;
+	CHNK     idx1;
+};
+
+static void serve_add(struct serve_body *body, const uint8_t *data, FILE *file, long pos, uint64_t len) {
+	struct serve_piece *piece = &body->pieces[body->count++];
+	piece->data = data;
+	piece->file = file;
+	piece->pos = pos;
+	piece->len = len;
+	piece->stride = 0;
+	body->len += len;
+}
+
+static void serve_body_close(struct serve_body *body) {
+	for (int i = 0; i < 2; i++) {
+		if (body->files[i]) fclose(body->files[i]);
+	}
+}
+
+static long serve_file_size(FILE *f) {
+	return fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+}
+
+static int serve_send(int fd, const void *data, size_t len) {
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent <= 0) return 0;
+		p += sent;
+		len -= (size_t)sent;
+	}
+	return 1;
+}
+
+// Sends body bytes [start, start + len), file pieces through the server buffer
+static int serve_send_body(serve_t *server, int fd, const struct serve_body *body, uint64_t start, uint64_t len) {
+	uint64_t base = 0;
+
+	for (int i = 0; i < body->count && len > 0; base += body->pieces[i++].len) {
+		const struct serve_piece *piece = &body->pieces[i];
+		if (start >= base + piece->len) continue;
+		uint64_t offset = start - base;
+		uint64_t n = piece->len - offset < len ? piece->len - offset : len;
+
+		if (piece->data) {
+			if (!serve_send(fd, piece->data + offset, (size_t)n)) return 0;
+		} else if (piece->stride) {
+			// Records are read in batches and packed down to their IDX1 in place, the buffer holds at least one
+			uint32_t batch = (uint32_t)(server->buffer_size / piece->stride);
+			for (uint64_t left = n, at = offset; left > 0;) {
+				uint64_t first = at / sizeof(IDX1);
+				size_t skip = (size_t)(at % sizeof(IDX1));
+				uint64_t need = (skip + left + sizeof(IDX1) - 1) / sizeof(IDX1);
+				uint32_t count = need < batch ? (uint32_t)need : batch;
+				if (fseek(piece->file, piece->pos + (long)(first * piece->stride), SEEK_SET) != 0 ||
+					fread(server->buffer, piece->stride, count, piece->file) != count) {
+					return 0;
+				}
+				for (uint32_t r = 1; r < count; r++) {
+					memmove(server->buffer + r * sizeof(IDX1), server->buffer + r * piece->stride, sizeof(IDX1));
+				}
+				size_t chunk = count * sizeof(IDX1) - skip;
+				if (chunk > left) chunk = (size_t)left;
+				if (!serve_send(fd, server->buffer + skip, chunk)) return 0;
+				at += chunk;
+				left -= chunk;
+			}
+		} else {
+			if (fseek(piece->file, piece->pos + (long)offset, SEEK_SET) != 0) return 0;
+			for (uint64_t left = n; left > 0;) {
+				size_t chunk = left < server->buffer_size ? (size_t)left : server->buffer_size;
+				if (fread(server->buffer, 1, chunk, piece->file) != chunk || !serve_send(fd, server->buffer, chunk)) return 0;
+				left -= chunk;
+			}
+		}
+		server->bytes_sent += n;
+		start += n;
+		len -= n;
+	}
+	return len == 0;
+}
+
+static int serve_read_request(serve_t *server, int fd) {
+	size_t len = 0;
+
+	while (len + 1 < sizeof(server->request)) {
+		ssize_t got = recv(fd, server->request + len, sizeof(server->request) - 1 - len, 0);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return 0;
+		len += (size_t)got;
+		server->request[len] = '\0';
+		if (strstr(server->request, "\r\n\r\n")) return 1;
+	}
+	return 0;
+}
+
+// A single "bytes=" range of the body. Returns 1 with the range set, 0 to send the whole body (no Range header,
+// or one that is malformed or asks for several ranges) and -1 when nothing of the body is in range
+static int serve_parse_range(const char *request, uint64_t len, uint64_t *first, uint64_t *last) {
+	const char *line = strstr(request, "\r\n");
+
+	while (line && strncasecmp(line + 2, "Range:", 6) != 0) line = strstr(line + 2, "\r\n");
+	if (!line) return 0;
+	const char *p = line + 8;
+	while (*p == ' ') p++;
+	if (strncmp(p, "bytes=", 6) != 0) return 0;
+	p += 6;
+	const char *end = strstr(p, "\r\n");
+	const char *comma = strchr(p, ',');
+	if (comma && comma < end) return 0;
+
+	char *next;
+	if (*p == '-') {
+		uint64_t suffix = strtoull(p + 1, &next, 10);
+		if (next == p + 1) return 0;
+		if (suffix == 0 || len == 0) return -1;
+		*first = suffix < len ? len - suffix : 0;
+		*last = len - 1;
+		return 1;
+	}
+	if (*p < '0' || *p > '9') return 0;
+	*first = strtoull(p, &next, 10);
+	if (*next != '-') return 0;
+	p = next + 1;
+	*last = len ? len - 1 : 0;
+	if (*p >= '0' && *p <= '9') {
+		uint64_t to = strtoull(p, &next, 10);
+		if (to < *first) return 0;
+		if (to < *last) *last = to;
+	}
+	return *first < len ? 1 : -1;
+}
+
+static int serve_head(int fd, int status, const char *reason, const char *type, uint64_t len, const char *extra) {
+	char head[320];
+	int n = snprintf(head, sizeof(head),
+		"HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %llu\r\nAccept-Ranges: bytes\r\n%sConnection: close\r\n\r\n",
+		status, reason, type, (unsigned long long)len, extra ? extra : "");
+	return n > 0 && (size_t)n < sizeof(head) && serve_send(fd, head, (size_t)n);
+}
+
+static void serve_error(int fd, int status, const char *reason, const char *extra) {
+	char text[64];
+	int n = snprintf(text, sizeof(text), "%d %s\n", status, reason);
+	if (serve_head(fd, status, reason, "text/plain", (uint64_t)n, extra)) serve_send(fd, text, (size_t)n);
+}
+
+static int serve_is_recording(const char *name) {
+	size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".avi") == 0;
+}
+
+static const char *serve_live_file(const serve_t *server) {
+	const char *path = server->config.live_path;
+	const char *slash = path ? strrchr(path, '/') : NULL;
+	return slash ? slash + 1 : path;
+}
+
+// The recording in progress as a complete AVI: its header with the sizes filled in, the movi bytes the readable
+// index entries cover, and an idx1 of those entries
+static int serve_snapshot(serve_t *server, struct serve_body *body) {
+	const serve_config_t *config = &server->config;
+	serve_live_t *live = &server->live;
+
+	if (!config->live || !config->live_path || !config->live_idx_path || !config->live(config->live_arg, live)) return 0;
+	long movi_pos = (long)live->movi_size_pos + (long)sizeof(uint32_t);	// The 'movi' fourcc
+	if (live->header_len > SERVE_HEADER_MAX || live->header_len != (uint32_t)movi_pos + sizeof(FOURCC) ||
+		live->riff_size_pos + sizeof(uint32_t) > live->header_len || live->total_frames_pos + sizeof(uint32_t) > live->header_len ||
+		live->length_pos + sizeof(uint32_t) > live->header_len) {
+		return 0;
+	}
+
+	FILE *data = body->files[0] = fopen(config->live_path, "rb");
+	FILE *idx = body->files[1] = fopen(config->live_idx_path, "rb");
+	long data_size = data ? serve_file_size(data) : -1;
+	long idx_size = idx ? serve_file_size(idx) : -1;
+	uint32_t record = live->record_size;
+	if (data_size < (long)live->header_len || idx_size < 0 || record < sizeof(IDX1) || record > server->buffer_size) return 0;
+
+	// Entries are written before their frame, so the snapshot ends at the first one whose chunk is not all readable
+	uint32_t available = (uint32_t)(idx_size / (long)record);
+	uint32_t wanted = live->entries < available ? live->entries : available;
+	long limit = live->movi_size < (uint32_t)(data_size - movi_pos) ? movi_pos + (long)live->movi_size : data_size;
+	long movi_end = (long)live->header_len;
+	uint32_t batch = (uint32_t)(server->buffer_size / record);
+	uint32_t entries = 0;
+	uint32_t frames = 0;	// 'rec ' list entries are not frames
+	int stop = 0;
+	if (fseek(idx, 0, SEEK_SET) != 0) return 0;
+	while (entries < wanted && !stop) {
+		uint32_t count = wanted - entries < batch ? wanted - entries : batch;
+		if (fread(server->buffer, record, count, idx) != count) break;
+		for (uint32_t i = 0; i < count; i++) {
+			IDX1 entry;
+			memcpy(&entry, server->buffer + i * record, sizeof(entry));
+			long end = movi_pos + (long)entry.offset + (long)sizeof(CHNK) + (long)(entry.size + (entry.size & 1));
+			if (entry.offset < sizeof(FOURCC) || end > limit) {
+				stop = 1;
+				break;
+			}
+			if (end > movi_end) movi_end = end;
+			if (!(entry.flags & AVIIF_LIST)) frames++;
+			entries++;
+		}
+	}
+
+	uint32_t movi_size = (uint32_t)(movi_end - movi_pos);
+	uint64_t total = (uint64_t)movi_end + sizeof(CHNK) + (uint64_t)entries * sizeof(IDX1);
+	uint32_t riff_size = (uint32_t)(total - sizeof(CHNK));
+	memcpy(live->header + live->riff_size_pos, &riff_size, sizeof(uint32_t));
+	memcpy(live->header + live->movi_size_pos, &movi_size, sizeof(uint32_t));
+	memcpy(live->header + live->total_frames_pos, &frames, sizeof(uint32_t));
+	memcpy(live->header + live->length_pos, &frames, sizeof(uint32_t));
+	body->idx1.fcc = FOURCC_IDX1;
+	body->idx1.size = entries * (uint32_t)sizeof(IDX1);
+
+	serve_add(body, live->header, NULL, 0, live->header_len);
+	serve_add(body, NULL, data, (long)live->header_len, (uint64_t)(movi_end - (long)live->header_len));
+	serve_add(body, (const uint8_t *)&body->idx1, NULL, 0, sizeof(body->idx1));
+	serve_add(body, NULL, idx, 0, body->idx1.size);
+	if (record != sizeof(IDX1)) body->pieces[body->count - 1].stride = record;
+	body->type = "video/x-msvideo";
+	server->snapshots++;
+	return 1;
+}
+
+static int serve_listing(serve_t *server, struct serve_body *body) {
+	const serve_config_t *config = &server->config;
+	char *out = (char *)server->buffer;
+	size_t cap = server->buffer_size;
+	size_t len = 0;
+	struct dirent *entry;
+	DIR *dir = opendir(config->root);
+
+	if (!dir) return 0;
+	len += (size_t)snprintf(out + len, cap - len, "<html><body><ul>\n");
+	if (config->live && config->live(config->live_arg, &server->live)) {
+		len += (size_t)snprintf(out + len, cap - len, "<li><a href=\"%s\">%s</a> recording in progress</li>\n", SERVE_LIVE_NAME,
+			SERVE_LIVE_NAME);
+	}
+	while ((entry = readdir(dir)) != NULL && len + SERVE_PATH_MAX * 2 + 64 < cap) {
+		char path[SERVE_PATH_MAX * 2];
+		struct stat st;
+		if (!serve_is_recording(entry->d_name)) continue;
+		snprintf(path, sizeof(path), "%s/%s", config->root, entry->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+		len += (size_t)snprintf(out + len, cap - len, "<li><a href=\"%s\">%s</a> %lld bytes</li>\n", entry->d_name, entry->d_name,
+			(long long)st.st_size);
+	}
+	closedir(dir);
+	len += (size_t)snprintf(out + len, cap - len, "</ul></body></html>\n");
+	if (len >= cap) len = cap - 1;
+	serve_add(body, server->buffer, NULL, 0, len);
+	body->type = "text/html";
+	return 1;
+}
+
+static int serve_file(serve_t *server, struct serve_body *body, const char *name) {
+	char path[SERVE_PATH_MAX * 2];
+	long size;
+
+	snprintf(path, sizeof(path), "%s/%s", server->config.root, name);
+	FILE *f = body->files[0] = fopen(path, "rb");
+	if (!f || (size = serve_file_size(f)) < 0) return 0;
+	serve_add(body, NULL, f, 0, (uint64_t)size);
+	body->type = "video/x-msvideo";
+	return 1;
+}
+
+static void serve_answer(serve_t *server, int fd) {
+	struct serve_body body = { 0 };
+	char extra[96];
+	int head_only = 0;
+
+	if (!serve_read_request(server, fd)) return;
+	char *target = server->request;
+	if (strncmp(target, "GET ", 4) == 0) {
+		target += 4;
+	} else if (strncmp(target, "HEAD ", 5) == 0) {
+		target += 5;
+		head_only = 1;
+	} else {
+		serve_error(fd, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+		return;
+	}
+	size_t target_len = strcspn(target, " ?\r\n");
+	if (target_len == 0 || target_len >= SERVE_PATH_MAX || target[0] != '/') {
+		serve_error(fd, 400, "Bad Request", NULL);
+		return;
+	}
+	char name[SERVE_PATH_MAX];
+	memcpy(name, target + 1, target_len - 1);
+	name[target_len - 1] = '\0';
+
+	// The file being recorded is only ever served as a snapshot, under either name. Once it is finished it is a file
+	// like any other
+	int found = 0;
+	if (name[0] == '\0') {
+		found = serve_listing(server, &body);
+	} else if (!strchr(name, '/') && !strchr(name, '%') && !strstr(name, "..") && serve_is_recording(name)) {
+		const char *live_file = serve_live_file(server);
+		int alias = strcmp(name, SERVE_LIVE_NAME) == 0;
+		if (alias || (live_file && strcmp(name, live_file) == 0)) {
+			found = serve_snapshot(server, &body);
+		}
+		if (!found && !alias) {
+			serve_body_close(&body);
+			memset(&body, 0, sizeof(body));
+			found = serve_file(server, &body, name);
+		}
+	}
+	if (!found) {
+		serve_error(fd, 404, "Not Found", NULL);
+		serve_body_close(&body);
+		return;
+	}
+
+	uint64_t first = 0;
+	uint64_t last = body.len ? body.len - 1 : 0;
+	int range = serve_parse_range(server->request, body.len, &first, &last);
+	if (range < 0) {
+		snprintf(extra, sizeof(extra), "Content-Range: bytes */%llu\r\n", (unsigned long long)body.len);
+		serve_error(fd, 416, "Range Not Satisfiable", extra);
+	} else {
+		uint64_t len = body.len ? last - first + 1 : 0;
+		if (range > 0) {
+			snprintf(extra, sizeof(extra), "Content-Range: bytes %llu-%llu/%llu\r\n", (unsigned long long)first,
+				(unsigned long long)last, (unsigned long long)body.len);
+		}
+		if (serve_head(fd, range > 0 ? 206 : 200, range > 0 ? "Partial Content" : "OK", body.type, len, range > 0 ? extra : NULL) &&
+			!head_only && len > 0) {
+			serve_send_body(server, fd, &body, first, len);
+		}
+	}
+	serve_body_close(&body);
+}
+
+int serve_open(serve_t *server, const serve_config_t *config) {
+	struct sockaddr_in addr = { 0 };
+	int one = 1;
+
+	memset(server, 0, sizeof(*server));
+	server->config = *config;
+	server->listen_fd = -1;
+	server->buffer_size = config->buffer_size ? config->buffer_size : SERVE_DEFAULT_BUFFER_SIZE;
+	if (server->buffer_size < SERVE_MIN_BUFFER_SIZE) server->buffer_size = SERVE_MIN_BUFFER_SIZE;
+	server->buffer = malloc(server->buffer_size);
+	if (!server->buffer || !config->root) goto fail;
+
+	server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (server->listen_fd < 0) goto fail;
+	setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(config->port ? config->port : SERVE_DEFAULT_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server->listen_fd, 4) != 0) goto fail;
+	return 1;
+
+fail:
+	serve_close(server);
+	return 0;
+}
+
+// Answers one request, waiting for a client first. Returns 0 once the listening socket is gone
+int serve_poll(serve_t *server) {
+	struct timeval timeout = { SERVE_TIMEOUT_MS / 1000, SERVE_TIMEOUT_MS % 1000 * 1000 };
+	int fd = accept(server->listen_fd, NULL, NULL);
+
+	if (fd < 0) return errno == EINTR || errno == ECONNABORTED;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	serve_answer(server, fd);
+	close(fd);
+	server->requests++;
+	return 1;
+}
+
+void serve_close(serve_t *server) {
+	if (server->listen_fd >= 0) close(server->listen_fd);
+	server->listen_fd = -1;
+	free(server->buffer);
+	server->buffer = NULL;
+}
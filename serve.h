@@ -0,0 +1,84 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+/*
+ * serve.h - Small HTTP server for recordings, with Range support
+ *
+ * Serves the .avi files of one directory over plain BSD sockets, so the
+ * same code runs over lwIP on the device and over loopback on Linux:
+ *
+ *   curl http://HOST:PORT/                        list of recordings
+ *   curl -r 0-1023 http://HOST:PORT/name.avi      any byte range of one
+ *   curl -o live.avi http://HOST:PORT/live.avi    the recording in progress
+ *
+ * One connection is answered at a time, GET and HEAD only, a single range
+ * per request, and the connection is closed after every response. File
+ * data goes out through one large buffer allocated when the server opens.
+ *
+ * The recording in progress is served as a snapshot that is a complete
+ * AVI on its own: the header as it was written with its sizes and frame
+ * counts filled in, the part of movi covered by index entries whose frame
+ * is already readable, then an idx1 built from those entries, cut down to
+ * their IDX1 when the index file keeps more per entry. Only the
+ * counters the muxer publishes (see mjpeg_live_snapshot()) and read-only
+ * opens of its files are used, nothing is written to them. Every request
+ * takes its own snapshot, so ranges of one download should not span
+ * successive snapshots. On FATFS a second handle only sees a file as far as
+ * its last sync, which CONFIG_MJPEG_CHECKPOINT_FRAMES bounds.
+ *
+ * Like clip.c, functions return non-zero on success and 0 on failure.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SERVE_DEFAULT_PORT		8080
+#define SERVE_DEFAULT_BUFFER_SIZE	(64 * 1024)
+#define SERVE_HEADER_MAX		512	// Largest header a snapshot can carry, the size of the muxer's header shadow
+#define SERVE_LIVE_NAME			"live.avi"
+#define SERVE_TIMEOUT_MS		5000	// A client that stops reading or sending is dropped
+#define SERVE_REQUEST_MAX		2048	// Request line and headers
+
+// The recording in progress, as published by the muxer
+typedef struct {
+	uint8_t  header[SERVE_HEADER_MAX];	// File bytes [0, header_len), up to the first movi chunk
+	uint32_t header_len;
+	uint32_t riff_size_pos;		// Fields of the header the snapshot fills in
+	uint32_t movi_size_pos;
+	uint32_t total_frames_pos;
+	uint32_t length_pos;
+	uint32_t movi_size;		// Bytes of movi written so far, 'movi' fourcc included
+	uint32_t entries;		// Index entries written so far
+	uint32_t record_size;		// Bytes per entry of the index file, an IDX1 followed by anything the muxer keeps with it
+} serve_live_t;
+
+// Fills in the live recording, returns 0 when nothing is being recorded
+typedef int (*serve_live_fn_t)(void *arg, serve_live_t *live);
+
+typedef struct {
+	const char *root;		// Directory the recordings are served from
+	uint16_t port;
+	size_t buffer_size;		// 0 for SERVE_DEFAULT_BUFFER_SIZE
+	const char *live_path;		// File being recorded and its temporary index file, NULL when there is none
+	const char *live_idx_path;
+	serve_live_fn_t live;
+	void *live_arg;
+} serve_config_t;
+
+typedef struct {
+	serve_config_t config;
+	int listen_fd;
+	uint8_t *buffer;
+	size_t buffer_size;
+	char request[SERVE_REQUEST_MAX];
+	serve_live_t live;		// Scratch for the last snapshot
+	uint64_t requests;
+	uint64_t bytes_sent;		// Body bytes, headers excluded
+	uint32_t snapshots;
+} serve_t;
+
+int serve_open(serve_t *server, const serve_config_t *config);
+int serve_poll(serve_t *server);
+void serve_close(serve_t *server);
+
+#endif /* SERVE_H */
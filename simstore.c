@@ -0,0 +1,105 @@
+/*
+ * simstore.c - Simulated SD card latency for soak tests
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "simstore.h"
+
+void simstore_init(simstore_t *sim, const simstore_config_t *config) {
+	memset(sim, 0, sizeof(*sim));
+	sim->config = *config;
+	if (sim->config.bandwidth == 0) sim->config.bandwidth = 1;
+	if (sim->config.spike_max_us < sim->config.spike_min_us) sim->config.spike_max_us = sim->config.spike_min_us;
+	sim->gc_left = sim->config.gc_bytes;
+	sim->random = sim->config.seed ? sim->config.seed : 1;
+}
+
+static uint32_t simstore_random(simstore_t *sim) {
+	// xorshift32, the state never reaches 0
+	uint32_t x = sim->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->random = x;
+	return x;
+}
+
+// Rewriting data already written costs the same as writing it
+uint32_t simstore_pwrite(simstore_t *sim, size_t len) {
+	const simstore_config_t *config = &sim->config;
+	uint64_t us = config->call_us + (uint64_t)len * 1000000 / config->bandwidth;
+
+	if (config->gc_bytes) {
+		// A long write may run into more than one collection
+		while (len >= sim->gc_left) {
+			len -= sim->gc_left;
+			sim->gc_left = config->gc_bytes;
+			us += config->gc_us;
+			sim->stalls++;
+		}
+		sim->gc_left -= (uint32_t)len;
+	}
+	if (config->spike_ppm && simstore_random(sim) % 1000000 < config->spike_ppm) {
+		us += config->spike_min_us + simstore_random(sim) % (config->spike_max_us - config->spike_min_us + 1);
+		sim->spikes++;
+	}
+
+	if (us > UINT32_MAX) us = UINT32_MAX;
+	sim->calls++;
+	sim->clock_us += us;
+	sim->busy_us += us;
+	return (uint32_t)us;
+}
+
+uint32_t simstore_write(simstore_t *sim, size_t len) {
+	sim->pos += (uint32_t)len;
+	sim->bytes += len;
+	return simstore_pwrite(sim, len);
+}
+
+void simstore_hist_init(simstore_hist_t *hist) {
+	memset(hist, 0, sizeof(*hist));
+}
+
+// Values below SIMSTORE_HIST_SUB get a bucket each, above that every power of two is split SIMSTORE_HIST_SUB ways
+static uint32_t simstore_hist_bucket(uint32_t value) {
+	if (value < SIMSTORE_HIST_SUB) return value;
+	uint32_t shift = 0;
+	while ((value >> shift) >= 2 * SIMSTORE_HIST_SUB) shift++;
+	uint32_t bucket = SIMSTORE_HIST_SUB + shift * SIMSTORE_HIST_SUB + ((value >> shift) - SIMSTORE_HIST_SUB);
+	return bucket < SIMSTORE_HIST_BUCKETS ? bucket : SIMSTORE_HIST_BUCKETS - 1;
+}
+
+// Largest value that lands in the bucket, so percentiles err on the slow side
+static uint32_t simstore_hist_value(uint32_t bucket) {
+	if (bucket < SIMSTORE_HIST_SUB) return bucket;
+	uint32_t shift = (bucket - SIMSTORE_HIST_SUB) / SIMSTORE_HIST_SUB;
+	uint32_t sub = (bucket - SIMSTORE_HIST_SUB) % SIMSTORE_HIST_SUB;
+	return (uint32_t)((((uint64_t)SIMSTORE_HIST_SUB + sub + 1) << shift) - 1);
+}
+
+void simstore_hist_add(simstore_hist_t *hist, uint32_t value) {
+	hist->buckets[simstore_hist_bucket(value)]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max) hist->max = value;
+}
+
+// per_100000 of 50000 is the median, 99900 is p99.9
+uint32_t simstore_hist_percentile(const simstore_hist_t *hist, uint32_t per_100000) {
+	if (hist->count == 0) return 0;
+	uint64_t rank = ((uint64_t)hist->count * per_100000 + 99999) / 100000;
+	uint64_t seen = 0;
+	if (rank == 0) rank = 1;
+	for (uint32_t i = 0; i < SIMSTORE_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			uint32_t value = simstore_hist_value(i);
+			return value < hist->max ? value : hist->max;
+		}
+	}
+	return hist->max;
+}
@@ -0,0 +1,192 @@
+/*
+ * soak.c - Hours of recording against a simulated card
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mjpeg.h"
+#include "simstore.h"
+#include "soak.h"
+
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+
+#include "fabric_log.h"
+
+#if CONFIG_MJPEG_STORAGE_SIM
+#if CONFIG_MJPEG_REC_GROUP
+#define MJPEG_SOAK_WAITING	(CONFIG_MJPEG_REC_GROUP_FRAMES + 2)	// A full group and the frame that closes it
+#else
+#define MJPEG_SOAK_WAITING	1
+#endif
+
+// Frames the muxer has taken but not written yet, those of the open 'rec ' list
+static size_t mjpeg_soak_pending(mjpeg_handle_t ctx) {
+#if CONFIG_MJPEG_REC_GROUP
+	return mjpeg_group_pending(ctx);
+#else
+	(void)ctx;
+	return 0;
+#endif
+}
+
+// Frames captured at waiting[] whose writes were done by the given time count their latency, the oldest first
+static void mjpeg_soak_written(mjpeg_soak_result_t *result, uint64_t *waiting, size_t *count, size_t pending, uint64_t done) {
+	size_t written = *count > pending ? *count - pending : 0;
+	for (size_t i = 0; i < written; i++) {
+		simstore_hist_add(&result->latency, (uint32_t)(done - waiting[i]));
+	}
+	memmove(waiting, waiting + written, (*count - written) * sizeof(uint64_t));
+	*count -= written;
+}
+
+// Runs one muxer call starting at the given simulated time, returns when it is done
+static esp_err_t mjpeg_soak_call(simstore_t *sim, uint64_t start, uint64_t *done, mjpeg_soak_result_t *result,
+		esp_err_t (*fn)(mjpeg_handle_t, frame_buffer_t), mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	sim->clock_us = start;
+	int64_t cpu_start = esp_timer_get_time();
+	esp_err_t err = fn(ctx, frame_buffer);
+	uint64_t cpu = (uint64_t)(esp_timer_get_time() - cpu_start);
+	result->cpu_us += cpu;
+	*done = sim->clock_us + cpu;
+	return err;
+}
+
+static esp_err_t mjpeg_soak_header(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	(void)frame_buffer;
+	return write_riff_header(ctx);
+}
+
+static esp_err_t mjpeg_soak_final(mjpeg_handle_t ctx, frame_buffer_t frame_buffer) {
+	(void)frame_buffer;
+	return write_final_riff_updates(ctx);
+}
+
+esp_err_t mjpeg_soak_run(const mjpeg_soak_config_t *config, mjpeg_soak_result_t *result) {
+	const char F_TAG[] = "mjpeg-soak";
+	const frame_buffer_t none = {0};
+	esp_err_t err = ESP_OK;
+	simstore_t sim;
+
+	if (config->prototype == NULL || config->frames == NULL || config->frame_count == 0 || config->buffers == 0) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	uint8_t fps = config->prototype->fps ? config->prototype->fps : CONFIG_MJPEG_RECORD_FPS;
+	uint64_t period = 1000000 / fps;
+	uint64_t total = (uint64_t)config->seconds * fps;
+	uint64_t segment = config->segment_seconds ? (uint64_t)config->segment_seconds * fps : total;
+
+	mjpeg_handle_t ctx = heap_caps_malloc(sizeof(mjpeg_context_t), MJPEG_SVC_TASK_MALLOC);
+	uint64_t *done = heap_caps_malloc(config->buffers * sizeof(uint64_t), MJPEG_SVC_TASK_MALLOC);
+	uint64_t *waiting = heap_caps_malloc(MJPEG_SOAK_WAITING * sizeof(uint64_t), MJPEG_SVC_TASK_MALLOC);
+	if (ctx == NULL || done == NULL || waiting == NULL) {
+		free(ctx);
+		free(done);
+		free(waiting);
+		return ESP_ERR_NO_MEM;
+	}
+
+	memset(result, 0, sizeof(*result));
+	simstore_hist_init(&result->latency);
+	simstore_init(&sim, &config->storage);
+
+	uint64_t busy_until = 0;	// When the muxer gets to the next frame
+	uint32_t queued = 0;		// Frames holding a buffer, each until done[] has passed
+	uint32_t drop_run = 0;
+	size_t waiting_count = 0;	// Frames taken by the muxer whose writes are not done yet
+	bool open = false;
+
+	for (uint64_t i = 0; i < total && err == ESP_OK; i++) {
+		uint64_t now = i * period;
+
+		if (i % segment == 0) {
+			if (open) {
+				uint64_t start = busy_until;
+				err = mjpeg_soak_call(&sim, start, &busy_until, result, mjpeg_soak_final, ctx, none);
+				if (busy_until - start > result->finalize_max_us) result->finalize_max_us = (uint32_t)(busy_until - start);
+				mjpeg_soak_written(result, waiting, &waiting_count, 0, busy_until);
+				open = false;
+			}
+			// Every recording starts from the prototype, as a fresh file on the same card
+			*ctx = *config->prototype;
+			ctx->out_file_handle = NULL;
+			ctx->idx_file_handle = NULL;
+#if CONFIG_MJPEG_THUMBNAILS
+			ctx->thumb_file_handle = NULL;
+#endif
+			mjpeg_use_storage_sim(ctx, &sim);
+			sim.pos = 0;
+			if (err == ESP_OK) {
+				err = mjpeg_soak_call(&sim, busy_until > now ? busy_until : now, &busy_until, result, mjpeg_soak_header, ctx, none);
+			}
+			if (err != ESP_OK) break;
+			open = true;
+			result->recordings++;
+		}
+
+		// Buffers whose frame made it to the card go back to the camera
+		uint32_t retired = 0;
+		while (retired < queued && done[retired] <= now) retired++;
+		memmove(done, done + retired, (queued - retired) * sizeof(uint64_t));
+		queued -= retired;
+
+		result->captured++;
+		if (queued == config->buffers) {
+			result->dropped++;
+			if (++drop_run > result->longest_drop_run) result->longest_drop_run = drop_run;
+			continue;
+		}
+		drop_run = 0;
+
+		// Counted from the capture, so the time the frame waits behind a slow write is part of its latency. A frame
+		// copied into a 'rec ' list gives its buffer back at once, but is only written when the list is
+		uint64_t start = busy_until > now ? busy_until : now;
+		err = mjpeg_soak_call(&sim, start, &busy_until, result, write_jpeg_frame, ctx, config->frames[i % config->frame_count]);
+		done[queued++] = busy_until;
+		waiting[waiting_count++] = now;
+		mjpeg_soak_written(result, waiting, &waiting_count, mjpeg_soak_pending(ctx), busy_until);
+		result->stored++;
+
+		if ((i + 1) % ((uint64_t)fps * 3600) == 0) {
+			FABRIC_LOG_INFO(F_TAG, "%llu h simulated: %lu frames stored, %lu dropped, p99 %lu us",
+				(unsigned long long)((i + 1) / fps / 3600), (unsigned long)result->stored, (unsigned long)result->dropped,
+				(unsigned long)simstore_hist_percentile(&result->latency, 99000));
+		}
+	}
+	if (open && err == ESP_OK) {
+		uint64_t start = busy_until;
+		err = mjpeg_soak_call(&sim, start, &busy_until, result, mjpeg_soak_final, ctx, none);
+		if (busy_until - start > result->finalize_max_us) result->finalize_max_us = (uint32_t)(busy_until - start);
+		mjpeg_soak_written(result, waiting, &waiting_count, 0, busy_until);
+	} else if (open) {
+		// A frame failed, the recording it belonged to is dropped
+		mjpeg_abort(ctx);
+	}
+	if (err != ESP_OK) {
+		FABRIC_LOG_ERROR(F_TAG, "Muxer failed after %lu frames: %s", (unsigned long)result->captured, esp_err_to_name(err));
+	}
+
+	result->p50_us = simstore_hist_percentile(&result->latency, 50000);
+	result->p99_us = simstore_hist_percentile(&result->latency, 99000);
+	result->p999_us = simstore_hist_percentile(&result->latency, 99900);
+	result->max_us = result->latency.max;
+	result->stalls = sim.stalls;
+	result->spikes = sim.spikes;
+	result->bytes = sim.bytes;
+
+	FABRIC_LOG_INFO(F_TAG, "%lu s with %u buffers: %lu captured, %lu dropped (longest run %lu), frame latency p50 %lu us, p99 %lu us, p99.9 %lu us, max %lu us, worst close %lu us, %lu stalls, %lu spikes",
+		(unsigned long)config->seconds, config->buffers, (unsigned long)result->captured, (unsigned long)result->dropped,
+		(unsigned long)result->longest_drop_run, (unsigned long)result->p50_us, (unsigned long)result->p99_us,
+		(unsigned long)result->p999_us, (unsigned long)result->max_us, (unsigned long)result->finalize_max_us,
+		(unsigned long)result->stalls, (unsigned long)result->spikes);
+
+	free(ctx);
+	free(done);
+	free(waiting);
+	return err;
+}
+#endif
@@ -0,0 +1,61 @@
+#ifndef SOAK_H
+#define SOAK_H
+
+/*
+ * soak.h - Hours of recording against a simulated card
+ *
+ * Drives the real muxer, write_jpeg_frame() and everything configured
+ * behind it, with its output charged to a simstore_t instead of being
+ * written (CONFIG_MJPEG_STORAGE_SIM). A camera with a fixed number of frame
+ * buffers delivers a frame every period on the simulated clock, a frame
+ * that finds every buffer still waiting on the card is dropped. The
+ * latency of a frame runs from its capture until its writes are done: the
+ * time it waited in a buffer behind earlier frames, the simulated card time
+ * of its own writes and the real time the muxer spent on it. So the run
+ * shows what a change to buffering or to the muxer costs in tail latency
+ * and drops, run after run with the same seed.
+ *
+ * tools/soak_run runs it on the host.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#include "mjpeg.h"
+#include "simstore.h"
+
+typedef struct {
+	const mjpeg_context_t *prototype;	// Set up as for a real recording, before write_riff_header()
+	const frame_buffer_t *frames;		// Played in a loop
+	size_t frame_count;
+	uint8_t buffers;			// Camera frame buffers, the one being written included
+	uint32_t seconds;			// Simulated time to record
+	uint32_t segment_seconds;		// Length of each recording, 0 for a single one
+	simstore_config_t storage;
+} mjpeg_soak_config_t;
+
+typedef struct {
+	uint32_t captured;
+	uint32_t stored;
+	uint32_t dropped;
+	uint32_t longest_drop_run;	// Consecutive frames lost, the longest gap in the video
+	uint32_t recordings;
+	uint32_t p50_us;		// Frame latency, from capture until written
+	uint32_t p99_us;
+	uint32_t p999_us;
+	uint32_t max_us;
+	uint32_t finalize_max_us;	// Longest close of a recording, frames keep arriving meanwhile
+	uint32_t stalls;		// Garbage collection stalls and spikes the card went through
+	uint32_t spikes;
+	uint64_t bytes;
+	uint64_t cpu_us;		// Real time spent in the muxer, over the whole run
+	simstore_hist_t latency;
+} mjpeg_soak_result_t;
+
+#if CONFIG_MJPEG_STORAGE_SIM
+esp_err_t mjpeg_soak_run(const mjpeg_soak_config_t *config, mjpeg_soak_result_t *result);
+#endif
+
+#endif /* SOAK_H */
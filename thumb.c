@@ -0,0 +1,73 @@
+/*
+ * thumb.c - DC-only thumbnails and the thumbnail strip sidecar
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "jpeg.h"
+#include "thumb.h"
+
+// Size of the thumbnail of a parsed frame: one pixel per luma block covering real pixels
+int thumb_size(const jpeg_info_t *info, uint16_t *width, uint16_t *height) {
+	const jpeg_component_t *luma = &info->comp[0];
+	uint16_t w = (info->width * luma->h / info->max_h + 7) / 8;
+	uint16_t h = (info->height * luma->v / info->max_v + 7) / 8;
+
+	if (w == 0 || h == 0 || w > THUMB_MAX_WIDTH || h > THUMB_MAX_HEIGHT) return 0;
+	*width = w;
+	*height = h;
+	return 1;
+}
+
+// Fails when the frame does not decode or its thumbnail is not width x height
+int thumb_decode(jpeg_info_t *info, const uint8_t *data, size_t len, uint8_t *pixels, uint16_t width, uint16_t height) {
+	jpeg_scan_t scan;
+	int16_t dc[JPEG_MAX_MCU_BLOCKS];
+	uint16_t w;
+	uint16_t h;
+
+	if (!jpeg_parse(info, data, len) || !thumb_size(info, &w, &h) || w != width || h != height) return 0;
+
+	const jpeg_component_t *luma = &info->comp[0];
+	int32_t quant = info->dc_quant[luma->tq] ? info->dc_quant[luma->tq] : 1;
+
+	jpeg_scan_begin(&scan, info);
+	for (uint16_t my = 0; my < info->mcus_y; my++) {
+		for (uint16_t mx = 0; mx < info->mcus_x; mx++) {
+			if (!jpeg_decode_mcu_dc(&scan, dc)) return 0;
+			for (int b = 0; b < info->mcu_blocks && info->mcu_comp[b] == 0; b++) {
+				uint16_t bx = mx * luma->h + info->mcu_bx[b];
+				uint16_t by = my * luma->v + info->mcu_by[b];
+				if (bx >= width || by >= height) continue;
+				// A dequantised DC is 8x the block mean, level shifted by 128
+				int32_t v = dc[b] * quant / 8 + 128;
+				pixels[by * width + bx] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+			}
+		}
+	}
+	return 1;
+}
+
+void thumb_header_init(thumb_header_t *header, uint16_t width, uint16_t height, uint32_t interval) {
+	memset(header, 0, sizeof(*header));
+	header->magic = THUMB_MAGIC;
+	header->version = THUMB_VERSION;
+	header->header_size = sizeof(*header);
+	header->width = width;
+	header->height = height;
+	header->interval = interval ? interval : 1;
+}
+
+int thumb_header_valid(const thumb_header_t *header) {
+	return header->magic == THUMB_MAGIC && header->version == THUMB_VERSION &&
+		header->header_size >= sizeof(*header) && header->interval > 0 &&
+		header->width > 0 && header->width <= THUMB_MAX_WIDTH &&
+		header->height > 0 && header->height <= THUMB_MAX_HEIGHT;
+}
+
+// Offset of the cell showing the frame, or the last thumbnailed frame before it
+size_t thumb_cell_offset(const thumb_header_t *header, uint32_t frame) {
+	return header->header_size + (size_t)(frame / header->interval) * header->width * header->height;
+}
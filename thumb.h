@@ -0,0 +1,48 @@
+#ifndef THUMB_H
+#define THUMB_H
+
+/*
+ * thumb.h - DC-only thumbnails and the thumbnail strip sidecar
+ *
+ * The DC coefficient of a block is its mean, so one DC per 8x8 luma block
+ * is the frame at 1/8 scale, without dequantising the AC coefficients or
+ * running an IDCT (see jpeg.h). Thumbnails are 8 bit greyscale.
+ *
+ * A strip is a small header followed by fixed size cells, one for every
+ * interval-th frame of the recording ('rec ' list entries of the index are
+ * not frames). The cell of any frame is found arithmetically, so a scrub
+ * bar is drawn from a single read of the whole file. A frame that cannot
+ * be decoded keeps its cell, filled mid grey.
+ * The cell count follows from the file size, a strip cut short by a power
+ * loss stays usable.
+ *
+ * Like jpeg.c, functions return non-zero on success and 0 on failure.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "jpeg.h"
+
+#define THUMB_MAGIC		0x424D4854	// "THMB"
+#define THUMB_VERSION		1
+#define THUMB_MAX_WIDTH		256
+#define THUMB_MAX_HEIGHT	256
+#define THUMB_FILL		128
+
+typedef struct {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;		// Offset of the first cell
+	uint16_t width;			// Every cell is width x height bytes, row by row
+	uint16_t height;
+	uint32_t interval;		// Cell n shows frame n * interval
+} __attribute__((packed)) thumb_header_t;
+
+int thumb_size(const jpeg_info_t *info, uint16_t *width, uint16_t *height);
+int thumb_decode(jpeg_info_t *info, const uint8_t *data, size_t len, uint8_t *pixels, uint16_t width, uint16_t height);
+void thumb_header_init(thumb_header_t *header, uint16_t width, uint16_t height, uint32_t interval);
+int thumb_header_valid(const thumb_header_t *header);
+size_t thumb_cell_offset(const thumb_header_t *header, uint32_t frame);
+
+#endif /* THUMB_H */
@@ -0,0 +1,91 @@
+/*
+ * avi_clip.c - Cut or join recordings without re-encoding
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o avi_clip avi_clip.c ../clip.c ../avi.c ../riff.c ../crc32c.c
+ *
+ * Usage:
+ *   avi_clip -o out.avi in.avi FIRST COUNT     extract COUNT frames starting at FIRST
+ *   avi_clip -o out.avi -c a.avi b.avi ...     concatenate whole recordings
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../riff.h"
+#include "../clip.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s -o out.avi in.avi FIRST COUNT\n", name);
+	fprintf(stderr, "       %s -o out.avi -c a.avi b.avi ...\n", name);
+}
+
+int main(int argc, char **argv) {
+	clip_t clip = { 0 };
+	clip_segment_t *segments;
+	const char *out_path;
+	int concat;
+	int count;
+	int ok;
+	FILE *out;
+
+	if (argc < 4 || strcmp(argv[1], "-o") != 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	out_path = argv[2];
+	concat = strcmp(argv[3], "-c") == 0;
+	count = concat ? argc - 4 : 1;
+	if (count < 1 || (!concat && argc != 6)) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	segments = calloc(count, sizeof(*segments));
+	if (!segments) return 1;
+	for (int i = 0; i < count; i++) {
+		const char *path = concat ? argv[4 + i] : argv[3];
+		segments[i].in = fopen(path, "rb");
+		if (!segments[i].in) {
+			perror(path);
+			return 1;
+		}
+		segments[i].first = concat ? 0 : (uint32_t)strtoul(argv[4], NULL, 0);
+		segments[i].count = concat ? UINT32_MAX : (uint32_t)strtoul(argv[5], NULL, 0);
+	}
+
+	out = fopen(out_path, "wb");
+	if (!out) {
+		perror(out_path);
+		return 1;
+	}
+
+	double start = now();
+	ok = clip_write(&clip, out, segments, count);
+	double elapsed = now() - start;
+	ok = fclose(out) == 0 && ok;
+
+	if (!ok) {
+		fprintf(stderr, "%s: failed, the inputs are unreadable or incompatible\n", out_path);
+		remove(out_path);
+		return 1;
+	}
+	printf("%s: %u frames, %llu payload bytes (%llu zero-copy) in %.3f s\n", out_path, clip.frames,
+		(unsigned long long)clip.bytes_copied, (unsigned long long)clip.bytes_zero_copy, elapsed);
+
+	for (int i = 0; i < count; i++) {
+		fclose(segments[i].in);
+	}
+	free(segments);
+	free(clip.buffer);
+	return 0;
+}
@@ -0,0 +1,335 @@
+/*
+ * avi_rehuff.c - Recompress existing recordings losslessly, in place
+ *
+ * Re-encodes every frame with Huffman tables built for its own symbol
+ * statistics (see rehuff.h), the offline counterpart of
+ * CONFIG_MJPEG_REHUFF. The pixels do not change. Frames that would not get
+ * smaller are kept as they are.
+ *
+ * The file is rewritten in place: movi is walked chunk by chunk and every
+ * chunk written back at or before where it was read, so nothing is
+ * overwritten before it has been read. Behind the shrunk movi the idx1
+ * comes back with the new offsets and sizes (repeated entries of the
+ * scene filter still share a chunk), then the crcs chunk with the CRC32C
+ * of the new frames, and the file is truncated. A rewrite cut short leaves
+ * a broken file, so work on a copy of anything that matters. Files are
+ * spread over the work-stealing pool (pool.c).
+ *
+ * Build on the host:
+ *   cc -O2 -pthread -I.. -o avi_rehuff avi_rehuff.c pool.c ../avi.c ../riff.c ../jpeg.c ../rehuff.c ../crc32c.c
+ *
+ * Usage:
+ *   avi_rehuff [-j THREADS] [-w WINDOW] file.avi ...
+ *     -w  frames per table rebuild as with CONFIG_MJPEG_REHUFF_WINDOW, 0 (tables per frame) by default
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../avi.h"
+#include "../crc32c.h"
+#include "../rehuff.h"
+#include "pool.h"
+
+// Where a chunk of movi went, looked up by its old offset when the index is rebuilt
+typedef struct {
+	long old_pos;
+	long new_pos;
+	uint32_t size;			// New size of the chunk body
+	uint32_t crc;			// CRC32C of the new body, frames only
+} moved_t;
+
+struct job {
+	const char *path;
+	uint32_t window;
+	int ok;
+	uint32_t frames;
+	uint32_t rewritten;
+	uint64_t bytes_in;		// File sizes before and after
+	uint64_t bytes_out;
+	char error[160];
+};
+
+static int grow(uint8_t **buf, size_t *cap, size_t need) {
+	if (need <= *cap) return 1;
+	uint8_t *grown = realloc(*buf, need);
+	if (!grown) return 0;
+	*buf = grown;
+	*cap = need;
+	return 1;
+}
+
+static int put(FILE *f, long pos, const void *data, size_t len) {
+	return fseek(f, pos, SEEK_SET) == 0 && fwrite(data, 1, len, f) == len;
+}
+
+static const moved_t *find_moved(const moved_t *moved, uint32_t count, long old_pos) {
+	uint32_t lo = 0;
+	uint32_t hi = count;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (moved[mid].old_pos < old_pos) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < count && moved[lo].old_pos == old_pos ? &moved[lo] : NULL;
+}
+
+// Walks the chunk headers of movi before anything is moved, a rewrite must not stop half way
+static int check_movi(FILE *f, long pos, long end) {
+	while (pos + (long)sizeof(CHNK) <= end) {
+		CHNK chunk;
+		if (fseek(f, pos, SEEK_SET) != 0 || fread(&chunk, sizeof(chunk), 1, f) != 1) return 0;
+		if (chunk.fcc == FOURCC_LIST) {
+			pos += (long)(sizeof(CHNK) + sizeof(FOURCC));
+			continue;
+		}
+		pos += (long)(sizeof(CHNK) + chunk.size + (chunk.size & 1));
+	}
+	return pos == end;
+}
+
+static void rehuff_file(void *arg, int worker) {
+	struct job *job = arg;
+	rehuff_t *rehuff = malloc(sizeof(*rehuff));
+	IDX1 *entries = NULL;
+	uint32_t *crcs = NULL;
+	moved_t *moved = NULL;
+	uint32_t moved_count = 0;
+	uint32_t moved_cap = 0;
+	uint8_t *frame = NULL;
+	uint8_t *out = NULL;
+	size_t frame_cap = 0;
+	size_t out_cap = 0;
+	avi_file_t avi;
+	FILE *f = NULL;
+
+	(void)worker;
+	if (!rehuff) {
+		snprintf(job->error, sizeof(job->error), "out of memory");
+		goto done;
+	}
+	rehuff_init(rehuff, job->window);
+	f = fopen(job->path, "r+b");
+	if (!f || !avi_open(&avi, f)) {
+		snprintf(job->error, sizeof(job->error), f ? "not a recording" : "cannot open");
+		goto done;
+	}
+	long movi_end = avi.movi_pos + (long)avi.movi_size;
+	if (avi.idx1_count == 0 || avi.idx1_pos < movi_end || (avi.crcs_pos && avi.crcs_pos < movi_end)) {
+		snprintf(job->error, sizeof(job->error), "no index behind movi");
+		goto done;
+	}
+	if (!check_movi(f, avi.movi_pos + (long)sizeof(FOURCC), movi_end)) {
+		snprintf(job->error, sizeof(job->error), "movi damaged, left as it is");
+		goto done;
+	}
+	job->bytes_in = (uint64_t)avi.file_size;
+
+	// The index and checksums are held in memory, their place in the file is about to be reused
+	entries = malloc((size_t)avi.idx1_count * sizeof(IDX1));
+	crcs = avi.crcs_pos ? malloc((size_t)avi.crcs_count * sizeof(uint32_t)) : NULL;
+	if (!entries || (avi.crcs_pos && !crcs)) {
+		snprintf(job->error, sizeof(job->error), "out of memory");
+		goto done;
+	}
+	if (avi_read_index(&avi, 0, avi.idx1_count, entries) != avi.idx1_count ||
+		(crcs && (fseek(f, avi.crcs_pos, SEEK_SET) != 0 || fread(crcs, sizeof(uint32_t), avi.crcs_count, f) != avi.crcs_count))) {
+		snprintf(job->error, sizeof(job->error), "cannot read the index");
+		goto done;
+	}
+
+	long read_pos = avi.movi_pos + (long)sizeof(FOURCC);
+	long write_pos = read_pos;
+	long list_end = 0;		// End of the LIST being walked, before and after
+	long list_pos = 0;
+	uint32_t list_moved = 0;
+	while (read_pos + (long)sizeof(CHNK) <= movi_end) {
+		CHNK chunk;
+		if (list_end && read_pos >= list_end) {
+			uint32_t size = (uint32_t)(write_pos - list_pos - sizeof(CHNK));
+			if (!put(f, list_pos + (long)sizeof(FOURCC), &size, sizeof(size))) goto write_error;
+			moved[list_moved].size = size;
+			list_end = 0;
+		}
+		if (fseek(f, read_pos, SEEK_SET) != 0 || fread(&chunk, sizeof(chunk), 1, f) != 1) break;
+		if (moved_count == moved_cap) {
+			moved_t *grown = realloc(moved, (moved_cap ? 2 * moved_cap : 1024) * sizeof(moved_t));
+			if (!grown) {
+				snprintf(job->error, sizeof(job->error), "out of memory");
+				goto done;
+			}
+			moved = grown;
+			moved_cap = moved_cap ? 2 * moved_cap : 1024;
+		}
+		moved_t *m = &moved[moved_count++];
+		m->old_pos = read_pos;
+		m->new_pos = write_pos;
+		m->size = chunk.size;
+		m->crc = 0;
+
+		// Grouping lists are entered, their size is patched once their last chunk is written
+		if (chunk.fcc == FOURCC_LIST && !list_end && chunk.size >= sizeof(FOURCC)) {
+			uint8_t head[sizeof(CHNK) + sizeof(FOURCC)];
+			if (fseek(f, read_pos, SEEK_SET) != 0 || fread(head, 1, sizeof(head), f) != sizeof(head)) break;
+			if (!put(f, write_pos, head, sizeof(head))) goto write_error;
+			list_pos = write_pos;
+			list_moved = moved_count - 1;
+			list_end = read_pos + (long)sizeof(CHNK) + (long)(chunk.size + (chunk.size & 1));
+			read_pos += sizeof(head);
+			write_pos += sizeof(head);
+			continue;
+		}
+
+		size_t padded = chunk.size + (chunk.size & 1);
+		if (read_pos + (long)sizeof(CHNK) + (long)padded > movi_end || !grow(&frame, &frame_cap, padded)) break;
+		if (fread(frame, 1, padded, f) != padded) break;
+		const uint8_t *data = frame;
+		size_t len = chunk.size;
+		if (chunk.fcc == FOURCC_00DC) {
+			job->frames++;
+			size_t n = grow(&out, &out_cap, 2 * len + 1024) ? rehuff_jpeg(rehuff, frame, len, out, out_cap) : 0;
+			if (n > 0 && n < len) {
+				data = out;
+				len = n;
+				job->rewritten++;
+			}
+			m->crc = crc32c_update(0, data, len);
+		}
+
+		static const uint8_t pad = 0;
+		chunk.size = (uint32_t)len;
+		m->size = chunk.size;
+		if (!put(f, write_pos, &chunk, sizeof(chunk)) || fwrite(data, 1, len, f) != len || (len & 1 && fwrite(&pad, 1, 1, f) != 1)) {
+			goto write_error;
+		}
+		read_pos += (long)(sizeof(CHNK) + padded);
+		write_pos += (long)(sizeof(CHNK) + len + (len & 1));
+	}
+	if (read_pos < movi_end) {
+		snprintf(job->error, sizeof(job->error), "read failed at %ld, file left partly rewritten", read_pos);
+		goto done;
+	}
+	if (list_end) {
+		uint32_t size = (uint32_t)(write_pos - list_pos - sizeof(CHNK));
+		if (!put(f, list_pos + (long)sizeof(FOURCC), &size, sizeof(size))) goto write_error;
+		moved[list_moved].size = size;
+	}
+
+	// The index follows the chunks it points at, offsets keep the base they had
+	for (uint32_t i = 0; i < avi.idx1_count; i++) {
+		const moved_t *m = find_moved(moved, moved_count, avi.idx1_base + (long)entries[i].offset);
+		if (!m) continue;
+		entries[i].offset = (uint32_t)(m->new_pos - avi.idx1_base);
+		entries[i].size = m->size;
+		if (crcs && i < avi.crcs_count && avi_is_frame(&entries[i])) crcs[i] = m->crc;
+	}
+	uint32_t movi_size = (uint32_t)(write_pos - avi.movi_pos);
+	CHNK idx1 = { FOURCC_IDX1, avi.idx1_count * (uint32_t)sizeof(IDX1) };
+	if (!put(f, write_pos, &idx1, sizeof(idx1)) || fwrite(entries, sizeof(IDX1), avi.idx1_count, f) != avi.idx1_count) goto write_error;
+	write_pos += (long)(sizeof(idx1) + idx1.size);
+	if (crcs) {
+		CHNK chunk = { FOURCC_CRCS, avi.crcs_count * (uint32_t)sizeof(uint32_t) };
+		if (!put(f, write_pos, &chunk, sizeof(chunk)) || fwrite(crcs, sizeof(uint32_t), avi.crcs_count, f) != avi.crcs_count) goto write_error;
+		write_pos += (long)(sizeof(chunk) + chunk.size);
+	}
+	uint32_t riff_size = (uint32_t)(write_pos - sizeof(CHNK));
+	if (!put(f, avi.movi_pos - (long)sizeof(uint32_t), &movi_size, sizeof(movi_size)) ||
+		!put(f, sizeof(FOURCC), &riff_size, sizeof(riff_size)) || fflush(f) != 0 || ftruncate(fileno(f), write_pos) != 0) {
+		goto write_error;
+	}
+	job->bytes_out = (uint64_t)write_pos;
+	job->ok = 1;
+	goto done;
+
+write_error:
+	snprintf(job->error, sizeof(job->error), "write failed, file left partly rewritten");
+done:
+	if (f && fclose(f) != 0 && job->ok) {
+		snprintf(job->error, sizeof(job->error), "write failed");
+		job->ok = 0;
+	}
+	free(rehuff);
+	free(entries);
+	free(crcs);
+	free(moved);
+	free(frame);
+	free(out);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-j THREADS] [-w WINDOW] file.avi ...\n", name);
+}
+
+int main(int argc, char **argv) {
+	int threads = 0;
+	uint32_t window = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:w:")) != -1) {
+		switch (opt) {
+		case 'j': threads = atoi(optarg); break;
+		case 'w': window = (uint32_t)strtoul(optarg, NULL, 0); break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	int files = argc - optind;
+	if (files <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (threads <= 0) threads = pool_default_threads();
+	if (threads > files) threads = files;
+
+	struct job *jobs = calloc(files, sizeof(*jobs));
+	if (!jobs) return 1;
+
+	// The tables are filled once here, before the workers share them
+	crc32c_init();
+
+	double start = now();
+	pool_t *pool = pool_create(threads);
+	if (!pool) return 1;
+	for (int i = 0; i < files; i++) {
+		jobs[i].path = argv[optind + i];
+		jobs[i].window = window;
+		pool_submit(pool, rehuff_file, &jobs[i]);
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+	double elapsed = now() - start;
+
+	int failed = 0;
+	uint64_t bytes_in = 0, bytes_out = 0;
+	for (int i = 0; i < files; i++) {
+		struct job *job = &jobs[i];
+		failed += !job->ok;
+		if (!job->ok) {
+			printf("%s: FAIL %s\n", job->path, job->error);
+			continue;
+		}
+		bytes_in += job->bytes_in;
+		bytes_out += job->bytes_out;
+		printf("%s: %u of %u frames re-encoded, %llu -> %llu bytes (%.1f%%)\n", job->path, job->rewritten, job->frames,
+			(unsigned long long)job->bytes_in, (unsigned long long)job->bytes_out, 100.0 * job->bytes_out / job->bytes_in);
+	}
+	printf("%d files, %d failed, %.1f MB saved in %.2f s (%d threads)\n", files, failed, (bytes_in - bytes_out) / 1e6, elapsed,
+		threads);
+	free(jobs);
+	return failed != 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * avi_serve.c - Serve recordings over HTTP from the host, with serve.c
+ *
+ * Runs the server of the device (../serve.c) on a directory, so it can be
+ * tried over loopback with curl:
+ *
+ *   avi_serve -p 8080 /path/to/recordings &
+ *   curl http://127.0.0.1:8080/
+ *   curl -r 0-1023 -o head.bin http://127.0.0.1:8080/name.avi
+ *
+ * With -l and -x a recording still being written (by a host build of
+ * mjpeg.c, or copied off a card mid-recording together with its index
+ * file) is served as live.avi and under its own name. On the device the
+ * muxer publishes its counters through mjpeg_live_snapshot(); here the
+ * header is read back from the file and the counters are left open, so the
+ * snapshot is bounded by what the two files hold, the same clamp the
+ * device relies on. An index file written with CONFIG_MJPEG_FRAME_CRC keeps
+ * 20 bytes per entry, pass -r 20 for it.
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o avi_serve avi_serve.c ../serve.c ../riff.c
+ *
+ * Usage:
+ *   avi_serve [-p PORT] [-b BUFFER_KB] [-l RECORDING.avi -x INDEX [-r RECORD_BYTES]] DIRECTORY
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../riff.h"
+#include "../serve.h"
+
+static uint32_t record_size = sizeof(IDX1);	// Of the index file, see -r
+
+// Finds the fields the muxer would publish in the header of the recording in progress
+static int live_from_file(void *arg, serve_live_t *live) {
+	const char *path = arg;
+	uint8_t head[SERVE_HEADER_MAX];
+	FILE *f = fopen(path, "rb");
+	size_t len = f ? fread(head, 1, sizeof(head), f) : 0;
+	size_t pos = sizeof(CHNK) + sizeof(FOURCC);
+	int have_avih = 0;
+	int have_strh = 0;
+
+	if (f) fclose(f);
+	while (pos + sizeof(CHNK) + sizeof(FOURCC) <= len) {
+		CHNK chunk;
+		FOURCC type;
+		memcpy(&chunk, head + pos, sizeof(chunk));
+		memcpy(&type, head + pos + sizeof(CHNK), sizeof(type));
+		if (chunk.fcc == FOURCC_LIST && type == FOURCC_MOVI) {
+			memcpy(live->header, head, pos + sizeof(CHNK) + sizeof(FOURCC));
+			live->header_len = (uint32_t)(pos + sizeof(CHNK) + sizeof(FOURCC));
+			live->riff_size_pos = sizeof(FOURCC);
+			live->movi_size_pos = (uint32_t)(pos + sizeof(FOURCC));
+			live->movi_size = UINT32_MAX;
+			live->entries = UINT32_MAX;
+			live->record_size = record_size;
+			return have_avih && have_strh;
+		}
+		if (chunk.fcc == FOURCC_LIST && (type == FOURCC_HDRL || type == FOURCC_HDLR) && pos + sizeof(CHNK) + chunk.size <= len) {
+			riff_span_t hdrl, strl;
+			riff_chunk_t c;
+			riff_span_init(&hdrl, head + pos + sizeof(CHNK) + sizeof(FOURCC), chunk.size - sizeof(FOURCC));
+			while (riff_span_next(&hdrl, &c)) {
+				size_t base = pos + sizeof(CHNK) + sizeof(FOURCC) + c.offset + sizeof(CHNK);
+				if (c.fcc == FOURCC_AVIH) {
+					live->total_frames_pos = (uint32_t)(base + offsetof(AVIH, totalFrames));
+					have_avih = 1;
+				} else if (c.fcc == FOURCC_LIST && c.type == FOURCC_STRL && !have_strh) {
+					riff_span_enter(&strl, &c);
+					while (riff_span_next(&strl, &c)) {
+						if (c.fcc != FOURCC_STRH) continue;
+						live->length_pos = (uint32_t)(pos + sizeof(CHNK) + sizeof(FOURCC) + c.offset + sizeof(CHNK) +
+							offsetof(STRH, length));
+						have_strh = 1;
+					}
+				}
+			}
+		}
+		pos += sizeof(CHNK) + chunk.size + (chunk.size & 1);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	serve_config_t config = { .port = SERVE_DEFAULT_PORT };
+	serve_t *server = malloc(sizeof(serve_t));
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:b:l:x:r:")) != -1) {
+		switch (opt) {
+		case 'p': config.port = (uint16_t)atoi(optarg); break;
+		case 'b': config.buffer_size = (size_t)atoi(optarg) * 1024; break;
+		case 'l': config.live_path = optarg; break;
+		case 'x': config.live_idx_path = optarg; break;
+		case 'r': record_size = (uint32_t)atoi(optarg); break;
+		default: goto usage;
+		}
+	}
+	if (optind != argc - 1 || !config.live_path != !config.live_idx_path || !server) goto usage;
+	config.root = argv[optind];
+	if (config.live_path) {
+		config.live = live_from_file;
+		config.live_arg = (void *)config.live_path;
+	}
+
+	if (!serve_open(server, &config)) {
+		perror("serve_open");
+		return 1;
+	}
+	printf("Serving %s on port %u with a %zu byte buffer%s%s\n", config.root, config.port, server->buffer_size,
+		config.live_path ? ", live: " : "", config.live_path ? config.live_path : "");
+	fflush(stdout);
+	while (serve_poll(server)) {
+	}
+	perror("accept");
+	serve_close(server);
+	return 1;
+
+usage:
+	fprintf(stderr, "usage: %s [-p PORT] [-b BUFFER_KB] [-l RECORDING.avi -x INDEX [-r RECORD_BYTES]] DIRECTORY\n", argv[0]);
+	return 2;
+}
@@ -0,0 +1,509 @@
+/*
+ * avi_verify.c - Validate and index recordings pulled off SD cards
+ *
+ * Every file is read exactly once, front to back, in large sequential reads.
+ * Files are spread over a work-stealing pool (pool.c) so a directory of
+ * recordings keeps every core and the disk busy.
+ *
+ * Checked per file:
+ *   - RIFF/AVI framing, header lists and chunk sizes
+ *   - every movi frame starts with SOI and ends with EOI
+ *   - every idx1 entry points at a real chunk of the right size
+ *   - the frame count in avih/strh matches the index
+ *   - the CRC32C of every frame, when the recording carries a 'crcs' chunk
+ *
+ * Build on the host (add -msse4.2 or -march=native for hardware CRC32C):
+ *   cc -O2 -pthread -I.. -o avi_verify avi_verify.c pool.c ../riff.c ../crc32c.c
+ *
+ * Usage:
+ *   avi_verify [-j THREADS] [-q] [-c] file.avi ...
+ *     -q  only report failing files
+ *     -c  print one CSV index line per file instead of the text report
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../riff.h"
+#include "../crc32c.h"
+#include "pool.h"
+
+#define VERIFY_READ_SIZE	(4 * 1024 * 1024)
+#define VERIFY_EOI_WINDOW	32	/* Camera buffers may carry a few bytes after EOI */
+
+struct chunk {
+	uint64_t offset;	// Offset of the chunk header, relative to the 'movi' fourcc
+	uint32_t size;
+	uint32_t refs;
+	uint32_t crc;
+};
+
+struct report {
+	const char *path;
+	int ok;
+	char error[160];
+	uint32_t errors;
+	uint64_t file_size;
+	uint32_t width;
+	uint32_t height;
+	uint32_t rate;
+	uint32_t scale;
+	uint32_t header_frames;
+	uint32_t frames;	// Index entries that are frames
+	uint32_t stored;	// Frame chunks present in movi
+	uint32_t repeats;	// Index entries re-using an earlier chunk (static scene fill)
+	uint32_t longest_gap;	// Longest run of repeats, in frames
+	uint32_t unindexed;
+	uint64_t movi_bytes;
+	uint32_t crc_checked;
+	uint32_t crc_bad;
+	int unfinalized;
+};
+
+struct stream {
+	int fd;
+	uint8_t *buf;
+	size_t cap;
+	size_t pos;
+	size_t len;
+	uint64_t offset;	// File offset of buf[0]
+	int eof;
+};
+
+struct worker {
+	uint8_t *buf;
+	struct chunk *chunks;
+	size_t chunk_cap;
+	uint32_t *entries;	// Chunk of every index entry, for the checksums that follow idx1
+	size_t entry_cap;
+};
+
+static struct worker *workers;
+
+static void fail(struct report *r, const char *fmt, uint64_t a, uint64_t b) {
+	if (r->errors++ == 0) snprintf(r->error, sizeof(r->error), fmt, (unsigned long long)a, (unsigned long long)b);
+	r->ok = 0;
+}
+
+static uint64_t stream_tell(const struct stream *s) {
+	return s->offset + s->pos;
+}
+
+// Makes n bytes available at buf + pos. Only ever reads forward.
+static const uint8_t *stream_need(struct stream *s, size_t n) {
+	if (s->len - s->pos >= n) return s->buf + s->pos;
+	if (n > s->cap) return NULL;
+	memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+	s->offset += s->pos;
+	s->len -= s->pos;
+	s->pos = 0;
+	while (s->len < n && !s->eof) {
+		ssize_t got = read(s->fd, s->buf + s->len, s->cap - s->len);
+		if (got <= 0) {
+			s->eof = 1;
+			break;
+		}
+		s->len += (size_t)got;
+	}
+	return s->len >= n ? s->buf : NULL;
+}
+
+static int stream_skip(struct stream *s, uint64_t n) {
+	while (n > 0) {
+		if (s->pos == s->len && !stream_need(s, 1)) return 0;
+		size_t step = s->len - s->pos < n ? s->len - s->pos : (size_t)n;
+		s->pos += step;
+		n -= step;
+	}
+	return 1;
+}
+
+// Like stream_skip(), checksumming the bytes on the way past
+static int stream_crc(struct stream *s, uint64_t n, uint32_t *crc) {
+	while (n > 0) {
+		if (s->pos == s->len && !stream_need(s, 1)) return 0;
+		size_t step = s->len - s->pos < n ? s->len - s->pos : (size_t)n;
+		*crc = crc32c_update(*crc, s->buf + s->pos, step);
+		s->pos += step;
+		n -= step;
+	}
+	return 1;
+}
+
+static int stream_seek(struct stream *s, uint64_t to) {
+	return to >= stream_tell(s) && stream_skip(s, to - stream_tell(s));
+}
+
+static void verify_hdrl(struct report *r, const uint8_t *p, uint32_t size) {
+	riff_span_t hdrl;
+	riff_span_t strl;
+	riff_chunk_t chunk;
+	int have_avih = 0;
+	int have_strh = 0;
+
+	riff_span_init(&hdrl, p, size);
+	while (riff_span_next(&hdrl, &chunk)) {
+		if (chunk.fcc == FOURCC_AVIH && chunk.data_size >= sizeof(AVIH)) {
+			AVIH avih;
+			memcpy(&avih, chunk.data, sizeof(avih));
+			r->width = avih.width;
+			r->height = avih.height;
+			r->header_frames = avih.totalFrames;
+			have_avih = 1;
+		} else if (chunk.fcc == FOURCC_LIST && chunk.type == FOURCC_STRL && !have_strh) {
+			// The first stream list describes the video
+			riff_span_enter(&strl, &chunk);
+			if (riff_span_find(&strl, FOURCC_STRH, 0, &chunk) && chunk.data_size >= sizeof(STRH)) {
+				STRH strh;
+				memcpy(&strh, chunk.data, sizeof(strh));
+				r->rate = strh.rate;
+				r->scale = strh.scale ? strh.scale : 1;
+				if (strh.type != FOURCC_VIDS) fail(r, "first stream is not video", 0, 0);
+				if (strh.length != r->header_frames && have_avih) fail(r, "strh length %llu disagrees with avih frames %llu", strh.length, r->header_frames);
+				have_strh = 1;
+			}
+		}
+	}
+	if (hdrl.error) fail(r, "malformed header list (riff error %llu)", hdrl.error, 0);
+	if (!have_avih) fail(r, "no avih header", 0, 0);
+	if (!have_strh) fail(r, "no video stream header", 0, 0);
+}
+
+static int chunk_push(struct worker *w, size_t *count, uint64_t offset, uint32_t size) {
+	if (*count == w->chunk_cap) {
+		size_t cap = w->chunk_cap ? w->chunk_cap * 2 : 4096;
+		struct chunk *chunks = realloc(w->chunks, cap * sizeof(*chunks));
+		if (!chunks) return 0;
+		w->chunks = chunks;
+		w->chunk_cap = cap;
+	}
+	w->chunks[(*count)++] = (struct chunk){ offset, size, 0, 0 };
+	return 1;
+}
+
+static struct chunk *chunk_find(struct worker *w, size_t count, uint64_t offset) {
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (w->chunks[mid].offset < offset) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo < count && w->chunks[lo].offset == offset ? &w->chunks[lo] : NULL;
+}
+
+// Walks movi up to end, checking every frame for SOI and EOI
+static void verify_movi(struct report *r, struct stream *s, struct worker *w, size_t *count, uint64_t movi_pos, uint64_t end) {
+	while (stream_tell(s) + sizeof(CHNK) <= end) {
+		uint64_t at = stream_tell(s);
+		const uint8_t *p = stream_need(s, sizeof(CHNK));
+		CHNK chnk;
+		if (!p) break;
+		memcpy(&chnk, p, sizeof(chnk));
+		s->pos += sizeof(CHNK);
+
+		if (chnk.fcc == FOURCC_LIST) {
+			// Grouped 'rec ' lists: step inside, their chunks follow linearly
+			if (!stream_skip(s, sizeof(FOURCC))) break;
+			continue;
+		}
+		if (at + sizeof(CHNK) + chnk.size > end) {
+			// A recording that was never finalised ends wherever it was cut, often inside a frame
+			if (r->unfinalized) break;
+			fail(r, "chunk at %llu overruns movi by %llu bytes", at, at + sizeof(CHNK) + chnk.size - end);
+			return;
+		}
+		if (chnk.fcc == FOURCC_00DC) {
+			r->stored++;
+			r->movi_bytes += chnk.size;
+			if (!chunk_push(w, count, at - movi_pos, chnk.size)) {
+				fail(r, "out of memory", 0, 0);
+				return;
+			}
+			p = chnk.size >= 4 ? stream_need(s, 2) : NULL;
+			if (!p || p[0] != 0xFF || p[1] != 0xD8) fail(r, "frame at %llu has no SOI (%llu)", at, r->stored - 1);
+
+			// The frame is checksummed as it streams past, whether or not the file turns out to carry checksums
+			uint32_t tail = chnk.size < VERIFY_EOI_WINDOW ? chnk.size : VERIFY_EOI_WINDOW;
+			uint32_t crc = 0;
+			if (!stream_crc(s, chnk.size - tail, &crc) || !(p = stream_need(s, tail))) break;
+			w->chunks[*count - 1].crc = crc32c_update(crc, p, tail);
+			int eoi = 0;
+			for (uint32_t i = tail; i >= 2 && !eoi; i--) {
+				eoi = p[i - 2] == 0xFF && p[i - 1] == 0xD9;
+			}
+			if (!eoi) fail(r, "frame at %llu has no EOI (%llu)", at, r->stored - 1);
+			s->pos += tail;
+			if ((chnk.size & 1) && !stream_skip(s, 1)) break;
+		} else if (!stream_skip(s, chnk.size + (chnk.size & 1))) {
+			break;
+		}
+	}
+	if (stream_tell(s) < end && !r->unfinalized) fail(r, "movi truncated at %llu of %llu", stream_tell(s), end);
+}
+
+static void verify_idx1(struct report *r, struct stream *s, struct worker *w, size_t count, uint64_t movi_pos, uint32_t entries) {
+	int64_t base = -1;
+	uint32_t gap = 0;
+
+	if (entries > w->entry_cap) {
+		uint32_t *grown = realloc(w->entries, entries * sizeof(*grown));
+		if (!grown) {
+			fail(r, "out of memory", 0, 0);
+			return;
+		}
+		w->entries = grown;
+		w->entry_cap = entries;
+	}
+	for (uint32_t i = 0; i < entries; i++) {
+		w->entries[i] = UINT32_MAX;
+	}
+	for (uint32_t i = 0; i < entries; i++) {
+		const uint8_t *p = stream_need(s, sizeof(IDX1));
+		IDX1 entry;
+		if (!p) {
+			fail(r, "index truncated after %llu of %llu entries", i, entries);
+			break;
+		}
+		memcpy(&entry, p, sizeof(entry));
+		s->pos += sizeof(IDX1);
+		if (entry.id != FOURCC_00DC || (entry.flags & AVIIF_LIST)) continue;
+
+		// Offsets are relative to 'movi' unless the writer used absolute ones
+		if (base < 0) base = entry.offset >= movi_pos && !chunk_find(w, count, entry.offset) ? (int64_t)movi_pos : 0;
+		struct chunk *chunk = chunk_find(w, count, entry.offset - (uint64_t)base);
+		r->frames++;
+		if (!chunk) {
+			fail(r, "index entry %llu points at offset %llu with no frame", r->frames - 1, entry.offset);
+			continue;
+		}
+		if (chunk->size != entry.size) fail(r, "index entry %llu size %llu disagrees with its chunk", r->frames - 1, entry.size);
+		w->entries[i] = (uint32_t)(chunk - w->chunks);
+		if (chunk->refs++ > 0) {
+			r->repeats++;
+			if (++gap > r->longest_gap) r->longest_gap = gap;
+		} else {
+			gap = 0;
+		}
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (w->chunks[i].refs == 0) r->unindexed++;
+	}
+	if (r->unindexed) fail(r, "%llu frames are missing from the index", r->unindexed, 0);
+	if (r->header_frames != r->frames) fail(r, "header says %llu frames, index has %llu", r->header_frames, r->frames);
+}
+
+// One CRC32C per index entry, compared against what the frames hashed to while streaming past
+static void verify_crcs(struct report *r, struct stream *s, struct worker *w, uint32_t entries, uint32_t crcs) {
+	if (crcs != entries) fail(r, "%llu checksums for %llu index entries", crcs, entries);
+	if (crcs > entries) crcs = entries;
+	for (uint32_t i = 0; i < crcs; i++) {
+		const uint8_t *p = stream_need(s, sizeof(uint32_t));
+		uint32_t crc;
+		if (!p) {
+			fail(r, "checksums truncated after %llu of %llu", i, crcs);
+			return;
+		}
+		memcpy(&crc, p, sizeof(crc));
+		s->pos += sizeof(uint32_t);
+		if (w->entries[i] == UINT32_MAX) continue;
+		r->crc_checked++;
+		if (w->chunks[w->entries[i]].crc != crc && r->crc_bad++ == 0) {
+			fail(r, "index entry %llu fails its CRC32C (frame at %llu)", i, w->chunks[w->entries[i]].offset);
+		}
+	}
+}
+
+// Whether the chunk whose header was just read continues movi: a 'rec ' list or a frame, as opposed to an index
+// written without its chunk header, whose entries also start with '00dc'
+static int movi_continues(struct stream *s, const CHNK *chnk) {
+	const uint8_t *p = stream_need(s, sizeof(FOURCC));
+	if (!p) return 0;
+	if (chnk->fcc == FOURCC_LIST) return memcmp(p, "rec ", 4) == 0;
+	return chnk->fcc == FOURCC_00DC && p[0] == 0xFF && p[1] == 0xD8;
+}
+
+static void verify_file(void *arg, int id) {
+	struct report *r = arg;
+	struct worker *w = &workers[id];
+	struct stream s = { .buf = w->buf, .cap = VERIFY_READ_SIZE };
+	uint64_t riff_end = 0;
+	uint64_t movi_pos = 0;
+	uint64_t movi_end = 0;
+	size_t count = 0;
+	int have_idx1 = 0;
+	uint32_t entries = 0;
+	const uint8_t *p;
+	CHNK chnk;
+
+	r->ok = 1;
+	s.fd = open(r->path, O_RDONLY);
+	if (s.fd < 0) {
+		fail(r, "cannot open", 0, 0);
+		return;
+	}
+	r->file_size = (uint64_t)lseek(s.fd, 0, SEEK_END);
+	lseek(s.fd, 0, SEEK_SET);
+	posix_fadvise(s.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	p = stream_need(&s, sizeof(CHNK) + sizeof(FOURCC));
+	if (!p || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "AVI ", 4) != 0) {
+		fail(r, "not a RIFF AVI file", 0, 0);
+		goto done;
+	}
+	memcpy(&chnk, p, sizeof(chnk));
+	if (chnk.size == 0) r->unfinalized = 1;
+	else riff_end = (uint64_t)chnk.size + sizeof(CHNK);
+	s.pos += sizeof(CHNK) + sizeof(FOURCC);
+
+	while ((p = stream_need(&s, sizeof(CHNK))) != NULL) {
+		uint64_t at = stream_tell(&s);
+		memcpy(&chnk, p, sizeof(chnk));
+		s.pos += sizeof(CHNK);
+
+		if (movi_pos && at == movi_end && !have_idx1 && movi_continues(&s, &chnk)) {
+			// Frames past the end the header gives movi: the header is from a checkpoint and the recording went on
+			r->unfinalized = 1;
+			s.pos -= sizeof(CHNK);
+			verify_movi(r, &s, w, &count, movi_pos, r->file_size);
+			break;
+		}
+		if (chnk.fcc == FOURCC_LIST && (p = stream_need(&s, sizeof(FOURCC))) != NULL) {
+			FOURCC type;
+			memcpy(&type, p, sizeof(type));
+			if (type == FOURCC_MOVI) {
+				movi_pos = stream_tell(&s);
+				movi_end = at + sizeof(CHNK) + chnk.size;
+				if (chnk.size == 0 || movi_end > r->file_size) {
+					// Never finalised: the frames run to the end of the file
+					r->unfinalized = 1;
+					movi_end = r->file_size;
+				}
+				s.pos += sizeof(FOURCC);
+				verify_movi(r, &s, w, &count, movi_pos, movi_end);
+				if (!stream_seek(&s, movi_end)) break;
+				continue;
+			}
+			if ((type == FOURCC_HDRL || type == FOURCC_HDLR) && chnk.size - sizeof(FOURCC) <= s.cap && (p = stream_need(&s, chnk.size))) {
+				verify_hdrl(r, p + sizeof(FOURCC), chnk.size - sizeof(FOURCC));
+			}
+		} else if (chnk.fcc == FOURCC_IDX1 && !have_idx1) {
+			entries = chnk.size / sizeof(IDX1);
+			verify_idx1(r, &s, w, count, movi_pos, entries);
+			have_idx1 = 1;
+		} else if (chnk.fcc == FOURCC_CRCS && have_idx1) {
+			verify_crcs(r, &s, w, entries, chnk.size / sizeof(uint32_t));
+		} else if (movi_pos && chnk.fcc == FOURCC_00DC) {
+			// Index written without its chunk header, it runs to the end of the file
+			s.pos -= sizeof(CHNK);
+			verify_idx1(r, &s, w, count, movi_pos, (uint32_t)((r->file_size - at) / sizeof(IDX1)));
+			have_idx1 = 1;
+			break;
+		}
+		if (!stream_seek(&s, at + sizeof(CHNK) + chnk.size + (chnk.size & 1))) break;
+	}
+
+	if (!movi_pos) fail(r, "no movi list", 0, 0);
+	else if (r->unfinalized) fail(r, "recording was never finalised (%llu frames recoverable)", r->stored, 0);
+	else if (!have_idx1) fail(r, "no index", 0, 0);
+	if (riff_end && !r->unfinalized && riff_end != r->file_size) fail(r, "RIFF size %llu, file size %llu", riff_end, r->file_size);
+
+done:
+	close(s.fd);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	int threads = 0;
+	int quiet = 0;
+	int csv = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:qc")) != -1) {
+		switch (opt) {
+		case 'j': threads = atoi(optarg); break;
+		case 'q': quiet = 1; break;
+		case 'c': csv = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-j THREADS] [-q] [-c] file.avi ...\n", argv[0]);
+			return 2;
+		}
+	}
+	int files = argc - optind;
+	if (files <= 0) {
+		fprintf(stderr, "usage: %s [-j THREADS] [-q] [-c] file.avi ...\n", argv[0]);
+		return 2;
+	}
+	if (threads <= 0) threads = pool_default_threads();
+	if (threads > files) threads = files;
+
+	struct report *reports = calloc(files, sizeof(*reports));
+	workers = calloc(threads, sizeof(*workers));
+	if (!reports || !workers) return 1;
+	for (int i = 0; i < threads; i++) {
+		workers[i].buf = malloc(VERIFY_READ_SIZE);
+		if (!workers[i].buf) return 1;
+	}
+
+	// The tables are filled once here, before the workers share them
+	crc32c_init();
+
+	double start = now();
+	pool_t *pool = pool_create(threads);
+	if (!pool) return 1;
+	for (int i = 0; i < files; i++) {
+		reports[i].path = argv[optind + i];
+		pool_submit(pool, verify_file, &reports[i]);
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+	double elapsed = now() - start;
+
+	int failed = 0;
+	uint64_t total_bytes = 0;
+	uint64_t total_frames = 0;
+	if (csv) printf("path,ok,frames,stored,repeats,longest_gap,width,height,duration_s,kbps,bytes,crc_checked,crc_bad,error\n");
+	for (int i = 0; i < files; i++) {
+		struct report *r = &reports[i];
+		double duration = r->rate ? (double)r->frames * r->scale / r->rate : 0;
+		double kbps = duration > 0 ? r->movi_bytes * 8 / duration / 1000 : 0;
+
+		failed += !r->ok;
+		total_bytes += r->file_size;
+		total_frames += r->frames;
+		if (csv) {
+			printf("%s,%d,%u,%u,%u,%u,%u,%u,%.3f,%.1f,%llu,%u,%u,\"%s\"\n", r->path, r->ok, r->frames, r->stored, r->repeats,
+				r->longest_gap, r->width, r->height, duration, kbps, (unsigned long long)r->file_size, r->crc_checked, r->crc_bad, r->error);
+		} else if (!quiet || !r->ok) {
+			printf("%s: %s %ux%u, %u frames (%u stored, %u repeated, longest gap %.1f s), %.1f s, %.1f kbps",
+				r->path, r->ok ? "OK" : "FAIL", r->width, r->height, r->frames, r->stored, r->repeats,
+				r->rate ? (double)r->longest_gap * r->scale / r->rate : 0, duration, kbps);
+			if (r->crc_checked) printf(", %u/%u CRC32C ok", r->crc_checked - r->crc_bad, r->crc_checked);
+			if (!r->ok) printf("\n    %s%s", r->error, r->errors > 1 ? " (and more)" : "");
+			printf("\n");
+		}
+	}
+	fprintf(stderr, "%d files, %d failed, %llu frames, %.1f MB in %.2f s (%.1f MB/s, %d threads)\n",
+		files, failed, (unsigned long long)total_frames, total_bytes / 1e6, elapsed,
+		elapsed > 0 ? total_bytes / 1e6 / elapsed : 0, threads);
+
+	for (int i = 0; i < threads; i++) {
+		free(workers[i].buf);
+		free(workers[i].chunks);
+		free(workers[i].entries);
+	}
+	free(workers);
+	free(reports);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * crop_bench.c - CPU cost of the lossless crop against the bytes it saves
+ *
+ * Crops each frame to the rectangle the way mjpeg.c does with
+ * CONFIG_MJPEG_CROP, repeatedly, and reports the time per frame next to
+ * the bytes kept out of storage. The time is what the crop adds to every
+ * frame write; the bytes saved are what the card no longer has to take,
+ * so a crop pays off as long as it costs less than writing those bytes at
+ * the card's throughput (tools/rate_sim and the muxer's rate log give it).
+ * With -o the cropped frames are written out for a visual check.
+ *
+ * On the target, mjpeg.c logs its own figures when a recording is
+ * finalised: "Cropped N frames to WxH, ...".
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o crop_bench crop_bench.c ../crop.c ../jpeg.c
+ *
+ * Usage:
+ *   crop_bench [-o DIRECTORY] X Y WIDTH HEIGHT FRAME.jpg...
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../crop.h"
+
+#define BENCH_TARGET_SECONDS	0.2
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *load(const char *path, size_t *len) {
+	FILE *f = fopen(path, "rb");
+	uint8_t *data = NULL;
+	long size;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET) != 0 ||
+		(data = malloc((size_t)size)) == NULL || fread(data, 1, (size_t)size, f) != (size_t)size) {
+		perror(path);
+		free(data);
+		data = NULL;
+	}
+	if (f != NULL) fclose(f);
+	*len = (size_t)size;
+	return data;
+}
+
+int main(int argc, char **argv) {
+	const char *dir = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		if (opt != 'o') goto usage;
+		dir = optarg;
+	}
+	if (argc - optind < 5) goto usage;
+	crop_rect_t request = {
+		(uint16_t)atoi(argv[optind]), (uint16_t)atoi(argv[optind + 1]),
+		(uint16_t)atoi(argv[optind + 2]), (uint16_t)atoi(argv[optind + 3]),
+	};
+
+	crop_t *crop = malloc(sizeof(crop_t));
+	if (crop == NULL) return 1;
+	double total_in = 0, total_out = 0, total_us = 0;
+	int frames = 0;
+
+	printf("%-24s %11s %11s %11s %7s %9s %11s\n", "frame", "size", "crop", "bytes in", "kept", "us/frame", "bytes/us");
+	for (int i = optind + 4; i < argc; i++) {
+		size_t len;
+		uint8_t *data = load(argv[i], &len);
+		if (data == NULL) continue;
+
+		crop_rect_t rect = request;
+		if (!jpeg_parse(&crop->jpeg, data, len) || !crop_align(&rect, crop->jpeg.width, crop->jpeg.height)) {
+			fprintf(stderr, "%s: not a baseline frame or the rectangle is outside it\n", argv[i]);
+			free(data);
+			continue;
+		}
+		size_t cap = 2 * len + 1024;
+		uint8_t *out = malloc(cap);
+		size_t out_len = out ? crop_jpeg(crop, data, len, &rect, out, cap) : 0;
+		if (out_len == 0) {
+			fprintf(stderr, "%s: crop to %ux%u+%u+%u failed\n", argv[i], rect.width, rect.height, rect.x, rect.y);
+			free(out);
+			free(data);
+			continue;
+		}
+
+		// Enough rounds to get a stable time
+		int rounds = 0;
+		double start = now();
+		double elapsed;
+		do {
+			crop_jpeg(crop, data, len, &rect, out, cap);
+			rounds++;
+			elapsed = now() - start;
+		} while (elapsed < BENCH_TARGET_SECONDS);
+		double us = elapsed * 1e6 / rounds;
+
+		char size[16], cropped[16];
+		snprintf(size, sizeof(size), "%ux%u", crop->jpeg.width, crop->jpeg.height);
+		snprintf(cropped, sizeof(cropped), "%ux%u", rect.width, rect.height);
+		const char *name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+		printf("%-24s %11s %11s %11zu %6.1f%% %9.1f %11.0f\n", name, size, cropped, len, 100.0 * out_len / len, us,
+			(len - out_len) / us);
+
+		if (dir != NULL) {
+			char path[512];
+			snprintf(path, sizeof(path), "%s/%s", dir, name);
+			FILE *f = fopen(path, "wb");
+			if (f == NULL || fwrite(out, 1, out_len, f) != out_len) perror(path);
+			if (f != NULL) fclose(f);
+		}
+		total_in += len;
+		total_out += out_len;
+		total_us += us;
+		frames++;
+		free(out);
+		free(data);
+	}
+	if (frames > 0) {
+		printf("%d frames: %.1f%% of the bytes kept, %.1f us per frame, %.0f bytes saved per us of CPU\n", frames,
+			100.0 * total_out / total_in, total_us / frames, (total_in - total_out) / total_us);
+	}
+	free(crop);
+	return frames > 0 ? 0 : 1;
+
+usage:
+	fprintf(stderr, "usage: %s [-o DIRECTORY] X Y WIDTH HEIGHT FRAME.jpg...\n", argv[0]);
+	return 1;
+}
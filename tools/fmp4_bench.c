@@ -0,0 +1,251 @@
+/*
+ * fmp4_bench.c - Per-frame overhead and finalize time, AVI vs fragmented MP4
+ *
+ * Replays the write pattern of mjpeg.c for both containers against real
+ * files: for AVI a 00dc chunk per frame plus a record in the temporary index
+ * file, then at the end the index copied entry by entry behind movi and the
+ * header patched; for fMP4 a reserved moof region and mdat per fragment,
+ * the moof written back over the region when the fragment closes, then at
+ * the end the last fragment and mehd. The fMP4 boxes come from ../fmp4.c,
+ * so the byte counts are the ones the device writes.
+ *
+ * Per frame it reports the container bytes and the calls into the file
+ * layer (writes, seeks, reads) that FATFS turns into card traffic, and the
+ * host time; for finalize the time and the calls, for recordings of
+ * increasing length. The AVI finalize grows with the frame count, the fMP4
+ * one does not. On the target, mjpeg.c logs its own figures when an fMP4
+ * recording is finalized: "fMP4 recording of N frames in M fragments, ...".
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o fmp4_bench fmp4_bench.c ../fmp4.c
+ *
+ * Usage:
+ *   fmp4_bench [FPS] [FRAGMENT_MS] [FRAME_BYTES] [DIRECTORY]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../fmp4.h"
+#include "../riff.h"
+
+#define BENCH_HEADER_BYTES	512	// About what write_riff_header() lays down, patched at the end
+#define BENCH_PATH_MAX		512
+
+typedef struct {
+	FILE *f;
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t seeks;
+	uint64_t reads;
+} bench_file_t;
+
+typedef struct {
+	double frame_us;	// Host time per frame, while recording
+	double frame_bytes;	// Container bytes per frame, beyond the JPEG itself
+	double frame_calls;	// File layer calls per frame
+	double final_us;
+	uint64_t final_calls;
+} bench_result_t;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_open(bench_file_t *file, const char *dir, const char *name) {
+	char path[BENCH_PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	memset(file, 0, sizeof(*file));
+	file->f = fopen(path, "wb+");
+	if (file->f == NULL) {
+		perror(path);
+		return 0;
+	}
+	return 1;
+}
+
+static void bench_close(bench_file_t *file, const char *dir, const char *name) {
+	char path[BENCH_PATH_MAX];
+	fclose(file->f);
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	remove(path);
+}
+
+static void bench_write(bench_file_t *file, const void *data, size_t len) {
+	fwrite(data, 1, len, file->f);
+	file->bytes += len;
+	file->writes++;
+}
+
+static void bench_seek(bench_file_t *file, long offset, int whence) {
+	fseek(file->f, offset, whence);
+	file->seeks++;
+}
+
+static void bench_read(bench_file_t *file, void *data, size_t len) {
+	if (fread(data, 1, len, file->f) != len) memset(data, 0, len);
+	file->reads++;
+}
+
+static uint64_t bench_calls(const bench_file_t *file) {
+	return file->writes + file->seeks + file->reads;
+}
+
+// Header patches go out sector by sector, the same for both containers
+static void bench_patch(bench_file_t *file, const uint8_t *header, long offset, size_t len) {
+	long end = ftell(file->f);
+	bench_seek(file, offset, SEEK_SET);
+	bench_write(file, header + offset, len);
+	bench_seek(file, end, SEEK_SET);
+}
+
+static void bench_avi(const char *dir, uint32_t frames, const uint8_t *jpeg, uint32_t frame_bytes, bench_result_t *result) {
+	static const uint8_t header[BENCH_HEADER_BYTES];
+	bench_file_t out, idx;
+	if (!bench_open(&out, dir, "bench.avi") || !bench_open(&idx, dir, "bench.idx")) exit(1);
+
+	bench_write(&out, header, sizeof(header));
+	uint64_t bytes = out.bytes + idx.bytes;
+	uint64_t calls = bench_calls(&out) + bench_calls(&idx);
+	uint32_t movi = sizeof(FOURCC);
+	uint8_t pad = 0;
+
+	double start = now();
+	for (uint32_t i = 0; i < frames; i++) {
+		IDX1 idx1 = { FOURCC_00DC, 0, movi, frame_bytes };
+		uint32_t chunk[2] = { FOURCC_00DC, frame_bytes };
+		bench_write(&idx, &idx1, sizeof(idx1));
+		bench_write(&out, chunk, sizeof(chunk));
+		bench_write(&out, jpeg, frame_bytes);
+		if (frame_bytes % 2 != 0) bench_write(&out, &pad, sizeof(pad));
+		movi += sizeof(chunk) + frame_bytes + frame_bytes % 2;
+	}
+	fflush(out.f);
+	fflush(idx.f);
+	result->frame_us = (now() - start) * 1e6 / frames;
+	result->frame_bytes = (double)(out.bytes + idx.bytes - bytes) / frames - frame_bytes;
+	result->frame_calls = (double)(bench_calls(&out) + bench_calls(&idx) - calls) / frames;
+
+	// write_final_riff_updates(): one read and one write per index entry, then the header
+	calls = bench_calls(&out) + bench_calls(&idx);
+	start = now();
+	bench_seek(&idx, 0, SEEK_SET);
+	uint32_t chunk[2] = { FOURCC_IDX1, frames * (uint32_t)sizeof(IDX1) };
+	bench_write(&out, chunk, sizeof(chunk));
+	for (uint32_t i = 0; i < frames; i++) {
+		IDX1 idx1;
+		bench_read(&idx, &idx1, sizeof(idx1));
+		bench_write(&out, &idx1, sizeof(idx1));
+	}
+	bench_patch(&out, header, 0, sizeof(header));
+	fflush(out.f);
+	result->final_us = (now() - start) * 1e6;
+	result->final_calls = bench_calls(&out) + bench_calls(&idx) - calls;
+
+	bench_close(&out, dir, "bench.avi");
+	bench_close(&idx, dir, "bench.idx");
+}
+
+static void bench_fmp4(const char *dir, uint32_t frames, uint32_t fps, uint32_t fragment_ms, const uint8_t *jpeg, uint32_t frame_bytes,
+		bench_result_t *result) {
+	const fmp4_track_t track = { 640, 480, 1000000 / fps };
+	uint32_t max = ((uint32_t)fragment_ms * 1000 + track.sample_duration - 1) / track.sample_duration;
+	size_t reserved = FMP4_MOOF_SIZE(max);
+	fmp4_sample_t *samples = malloc(max * sizeof(fmp4_sample_t));
+	uint8_t *region = malloc(reserved + FMP4_MDAT_HEADER);
+	uint8_t init[1024];
+	size_t mehd_pos;
+	bench_file_t out;
+	if (samples == NULL || region == NULL || !bench_open(&out, dir, "bench.mp4")) exit(1);
+
+	size_t init_len = fmp4_init_segment(init, sizeof(init), &track, &mehd_pos);
+	bench_write(&out, init, init_len);
+	uint64_t bytes = out.bytes;
+	uint64_t calls = bench_calls(&out);
+	uint32_t count = 0;
+	uint32_t sequence = 0;
+	uint64_t base_time = 0;
+	long fragment_pos = -1;
+
+	double start = now();
+	for (uint32_t i = 0; i <= frames; i++) {
+		// The extra round is finalize: only the open fragment is left to close
+		if (i == frames) {
+			fflush(out.f);
+			result->frame_us = (now() - start) * 1e6 / frames;
+			result->frame_bytes = (double)(out.bytes - bytes) / frames - frame_bytes;
+			result->frame_calls = (double)(bench_calls(&out) - calls) / frames;
+			calls = bench_calls(&out);
+			start = now();
+		} else {
+			if (fragment_pos < 0) {
+				fragment_pos = ftell(out.f);
+				fmp4_placeholder(region, reserved + FMP4_MDAT_HEADER, reserved);
+				bench_write(&out, region, reserved + FMP4_MDAT_HEADER);
+			}
+			bench_write(&out, jpeg, frame_bytes);
+			samples[count].duration = track.sample_duration;
+			samples[count].size = frame_bytes;
+			count++;
+		}
+		if (fragment_pos >= 0 && (count == max || i == frames)) {
+			size_t len = fmp4_moof(region, reserved + FMP4_MDAT_HEADER, ++sequence, base_time, samples, count, reserved);
+			long end = ftell(out.f);
+			bench_seek(&out, fragment_pos, SEEK_SET);
+			bench_write(&out, region, len);
+			bench_seek(&out, end, SEEK_SET);
+			base_time += (uint64_t)count * track.sample_duration;
+			count = 0;
+			fragment_pos = -1;
+		}
+	}
+	bench_patch(&out, init, (long)(mehd_pos / BENCH_HEADER_BYTES * BENCH_HEADER_BYTES), sizeof(uint32_t));
+	fflush(out.f);
+	result->final_us = (now() - start) * 1e6;
+	result->final_calls = bench_calls(&out) - calls;
+
+	bench_close(&out, dir, "bench.mp4");
+	free(samples);
+	free(region);
+}
+
+int main(int argc, char **argv) {
+	uint32_t fps = argc > 1 ? (uint32_t)atoi(argv[1]) : 15;
+	uint32_t fragment_ms = argc > 2 ? (uint32_t)atoi(argv[2]) : 1000;
+	uint32_t frame_bytes = argc > 3 ? (uint32_t)atoi(argv[3]) : 4096;
+	const char *dir = argc > 4 ? argv[4] : ".";
+	static const uint32_t minutes[] = { 1, 10, 60 };
+
+	if (fps == 0 || fragment_ms == 0 || frame_bytes < 4) {
+		fprintf(stderr, "usage: %s [FPS] [FRAGMENT_MS] [FRAME_BYTES] [DIRECTORY]\n", argv[0]);
+		return 1;
+	}
+	uint8_t *jpeg = malloc(frame_bytes);
+	if (jpeg == NULL) return 1;
+	memset(jpeg, 0x55, frame_bytes);
+	jpeg[0] = 0xFF;
+	jpeg[1] = 0xD8;
+	jpeg[frame_bytes - 2] = 0xFF;
+	jpeg[frame_bytes - 1] = 0xD9;
+
+	printf("%u fps, %u ms fragments, %u byte frames\n", fps, fragment_ms, frame_bytes);
+	printf("%-6s %8s %6s | %10s %10s %10s | %12s %10s\n", "", "minutes", "frames", "bytes/frm", "calls/frm", "us/frm",
+		"finalize us", "fin calls");
+	for (size_t m = 0; m < sizeof(minutes) / sizeof(minutes[0]); m++) {
+		uint32_t frames = minutes[m] * 60 * fps;
+		bench_result_t avi, mp4;
+		bench_avi(dir, frames, jpeg, frame_bytes, &avi);
+		bench_fmp4(dir, frames, fps, fragment_ms, jpeg, frame_bytes, &mp4);
+		printf("%-6s %8u %6u | %10.2f %10.2f %10.2f | %12.0f %10llu\n", "AVI", minutes[m], frames, avi.frame_bytes,
+			avi.frame_calls, avi.frame_us, avi.final_us, (unsigned long long)avi.final_calls);
+		printf("%-6s %8u %6u | %10.2f %10.2f %10.2f | %12.0f %10llu\n", "fMP4", minutes[m], frames, mp4.frame_bytes,
+			mp4.frame_calls, mp4.frame_us, mp4.final_us, (unsigned long long)mp4.final_calls);
+	}
+	free(jpeg);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+
+/*
+ * esp_heap_caps.h - Host stand-in, every capability is the C heap
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_SPIRAM	(1 << 10)
+#define MALLOC_CAP_INTERNAL	(1 << 11)
+
+void *heap_caps_malloc(size_t size, uint32_t caps);
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps);
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps);
+void heap_caps_free(void *ptr);
+
+#endif /* ESP_HEAP_CAPS_H */
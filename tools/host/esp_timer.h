@@ -0,0 +1,12 @@
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+/*
+ * esp_timer.h - Host stand-in, microseconds of the monotonic clock
+ */
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
+
+#endif /* ESP_TIMER_H */
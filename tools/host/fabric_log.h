@@ -0,0 +1,25 @@
+#ifndef FABRIC_LOG_H
+#define FABRIC_LOG_H
+
+/*
+ * fabric_log.h - Host stand-in for the fabric logger
+ *
+ * Info and above go to stderr. Debug and verbose print nothing, so a run of
+ * hours of frames does not drown in per-frame lines, but their arguments
+ * are still evaluated and checked against the format, as on the target.
+ */
+
+#include <stdio.h>
+
+static inline void __attribute__((format(printf, 2, 3))) fabric_log_discard(const char *tag, const char *fmt, ...) {
+	(void)tag;
+	(void)fmt;
+}
+
+#define FABRIC_LOG_ERROR(tag, fmt, ...)		fprintf(stderr, "E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define FABRIC_LOG_WARN(tag, fmt, ...)		fprintf(stderr, "W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define FABRIC_LOG_INFO(tag, fmt, ...)		fprintf(stderr, "I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define FABRIC_LOG_DEBUG(tag, fmt, ...)		fabric_log_discard(tag, fmt, ##__VA_ARGS__)
+#define FABRIC_LOG_VERBOSE(tag, fmt, ...)	fabric_log_discard(tag, fmt, ##__VA_ARGS__)
+
+#endif /* FABRIC_LOG_H */
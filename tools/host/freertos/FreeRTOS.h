@@ -0,0 +1,18 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+/*
+ * FreeRTOS.h - Host stand-in, only the types the component's headers name
+ */
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define tskIDLE_PRIORITY	0
+
+#endif /* FREERTOS_H */
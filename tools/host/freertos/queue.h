@@ -0,0 +1,8 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/*
+ * queue.h - Host stand-in, mjpeg.h includes it but uses nothing of it
+ */
+
+#endif /* QUEUE_H */
@@ -0,0 +1,8 @@
+#ifndef SEMPHR_H
+#define SEMPHR_H
+
+/*
+ * semphr.h - Host stand-in, only burst capture uses it, which the soak run leaves off
+ */
+
+#endif /* SEMPHR_H */
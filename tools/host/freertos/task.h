@@ -0,0 +1,8 @@
+#ifndef TASK_H
+#define TASK_H
+
+/*
+ * task.h - Host stand-in, the soak run never waits on another task
+ */
+
+#endif /* TASK_H */
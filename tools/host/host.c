@@ -0,0 +1,64 @@
+/*
+ * host.c - The ESP-IDF and sd calls the muxer makes, on the host
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_err.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "sd.h"
+
+const char *esp_err_to_name(esp_err_t code) {
+	static char name[16];
+	snprintf(name, sizeof(name), "0x%x", code);
+	return name;
+}
+
+void *heap_caps_malloc(size_t size, uint32_t caps) {
+	(void)caps;
+	return malloc(size);
+}
+
+void *heap_caps_calloc(size_t n, size_t size, uint32_t caps) {
+	(void)caps;
+	return calloc(n, size);
+}
+
+void *heap_caps_realloc(void *ptr, size_t size, uint32_t caps) {
+	(void)caps;
+	return realloc(ptr, size);
+}
+
+void heap_caps_free(void *ptr) {
+	free(ptr);
+}
+
+int64_t esp_timer_get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+esp_err_t write_file(sd_handle_t handle) {
+	(void)handle;
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t update_file(sd_handle_t handle) {
+	(void)handle;
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t seek_file(sd_handle_t handle) {
+	(void)handle;
+	return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t read_file(sd_handle_t handle) {
+	(void)handle;
+	return ESP_ERR_NOT_SUPPORTED;
+}
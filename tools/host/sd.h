@@ -0,0 +1,35 @@
+#ifndef SD_H
+#define SD_H
+
+/*
+ * sd.h - Host stand-in for the sd component
+ *
+ * The soak run sends every write to the simulated card, so the calls only
+ * have to link. They fail if anything reaches them.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "esp_err.h"
+
+typedef struct {
+	char *data;
+	size_t current_data_len;
+	size_t max_data_len;
+	long pos;
+} sd_payload_t;
+
+struct sd_handle {
+	long pos;
+	sd_payload_t payload;
+};
+
+typedef struct sd_handle *sd_handle_t;
+
+esp_err_t write_file(sd_handle_t handle);
+esp_err_t update_file(sd_handle_t handle);
+esp_err_t seek_file(sd_handle_t handle);
+esp_err_t read_file(sd_handle_t handle);
+
+#endif /* SD_H */
@@ -0,0 +1,84 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+/*
+ * sdkconfig.h - Host stand-in for the generated ESP-IDF configuration
+ *
+ * Every option of the component's Kconfig at its default, with the
+ * simulated card on. Any of them can be overridden on the cc line, for
+ * instance -DCONFIG_MJPEG_REC_GROUP=1, the options that depend on it are
+ * already here.
+ */
+
+#ifndef CONFIG_MJPEG_ASPECT_RATIO
+#define CONFIG_MJPEG_ASPECT_RATIO		0x00040003
+#endif
+#ifndef CONFIG_MJPEG_BIT_COUNT
+#define CONFIG_MJPEG_BIT_COUNT			24
+#endif
+#ifndef CONFIG_MJPEG_RECORD_FPS
+#define CONFIG_MJPEG_RECORD_FPS			5
+#endif
+#ifndef CONFIG_MJPEG_STORAGE_SIM
+#define CONFIG_MJPEG_STORAGE_SIM		1
+#endif
+
+#ifndef CONFIG_MJPEG_SCENE_SIZE_DELTA
+#define CONFIG_MJPEG_SCENE_SIZE_DELTA		40
+#endif
+#ifndef CONFIG_MJPEG_SCENE_DC_DELTA
+#define CONFIG_MJPEG_SCENE_DC_DELTA		4
+#endif
+#ifndef CONFIG_MJPEG_SCENE_MAX_SKIP
+#define CONFIG_MJPEG_SCENE_MAX_SKIP		50
+#endif
+#ifndef CONFIG_MJPEG_CHECKPOINT_FRAMES
+#define CONFIG_MJPEG_CHECKPOINT_FRAMES		0
+#endif
+#ifndef CONFIG_MJPEG_RATE_MIN_BYTES
+#define CONFIG_MJPEG_RATE_MIN_BYTES		8192
+#endif
+#ifndef CONFIG_MJPEG_RATE_MAX_BYTES
+#define CONFIG_MJPEG_RATE_MAX_BYTES		65536
+#endif
+#ifndef CONFIG_MJPEG_RATE_HIGH_LOAD
+#define CONFIG_MJPEG_RATE_HIGH_LOAD		80
+#endif
+#ifndef CONFIG_MJPEG_RATE_LOW_LOAD
+#define CONFIG_MJPEG_RATE_LOW_LOAD		50
+#endif
+#ifndef CONFIG_MJPEG_THUMB_INTERVAL
+#define CONFIG_MJPEG_THUMB_INTERVAL		25
+#endif
+#ifndef CONFIG_MJPEG_FMP4_FRAGMENT_MS
+#define CONFIG_MJPEG_FMP4_FRAGMENT_MS		1000
+#endif
+#ifndef CONFIG_MJPEG_CROP_X
+#define CONFIG_MJPEG_CROP_X			0
+#endif
+#ifndef CONFIG_MJPEG_CROP_Y
+#define CONFIG_MJPEG_CROP_Y			0
+#endif
+#ifndef CONFIG_MJPEG_CROP_WIDTH
+#define CONFIG_MJPEG_CROP_WIDTH			320
+#endif
+#ifndef CONFIG_MJPEG_CROP_HEIGHT
+#define CONFIG_MJPEG_CROP_HEIGHT		240
+#endif
+#ifndef CONFIG_MJPEG_REHUFF_WINDOW
+#define CONFIG_MJPEG_REHUFF_WINDOW		8
+#endif
+#ifndef CONFIG_MJPEG_REHUFF_BUDGET_PERCENT
+#define CONFIG_MJPEG_REHUFF_BUDGET_PERCENT	50
+#endif
+#ifndef CONFIG_MJPEG_REC_GROUP_FRAMES
+#define CONFIG_MJPEG_REC_GROUP_FRAMES		8
+#endif
+#ifndef CONFIG_MJPEG_REC_GROUP_MS
+#define CONFIG_MJPEG_REC_GROUP_MS		0
+#endif
+#ifndef CONFIG_MJPEG_REC_GROUP_KB
+#define CONFIG_MJPEG_REC_GROUP_KB		256
+#endif
+
+#endif /* SDKCONFIG_H */
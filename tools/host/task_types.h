@@ -0,0 +1,8 @@
+#ifndef TASK_TYPES_H
+#define TASK_TYPES_H
+
+/*
+ * task_types.h - Host stand-in, mjpeg.c includes it but uses nothing of it
+ */
+
+#endif /* TASK_TYPES_H */
@@ -0,0 +1,16 @@
+#ifndef TYPES_H
+#define TYPES_H
+
+/*
+ * types.h - Host stand-in for the types component
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	uint8_t *buffer;
+	size_t buffer_len;
+} frame_buffer_t;
+
+#endif /* TYPES_H */
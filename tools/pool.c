@@ -0,0 +1,194 @@
+/*
+ * pool.c - Small work-stealing thread pool for the host tools
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct job {
+	pool_fn_t fn;
+	void *arg;
+};
+
+struct deque {
+	pthread_mutex_t lock;
+	struct job *jobs;
+	size_t capacity;
+	size_t head;		// Oldest job, taken by thieves
+	size_t tail;		// One past the newest job, taken by the owner
+};
+
+struct pool {
+	int threads;
+	pthread_t *workers;
+	struct deque *deques;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t idle;
+	size_t pending;		// Submitted but not finished
+	size_t next;		// Round robin cursor for submissions
+	int stop;
+};
+
+struct worker_arg {
+	pool_t *pool;
+	int id;
+};
+
+int pool_default_threads(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+static int deque_push(struct deque *dq, struct job job) {
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->capacity) {
+		// Compact before growing, thieves leave a hole at the front
+		size_t used = dq->tail - dq->head;
+		if (dq->head > 0) {
+			memmove(dq->jobs, dq->jobs + dq->head, used * sizeof(struct job));
+			dq->head = 0;
+			dq->tail = used;
+		}
+		if (dq->tail == dq->capacity) {
+			size_t capacity = dq->capacity ? dq->capacity * 2 : 64;
+			struct job *jobs = realloc(dq->jobs, capacity * sizeof(struct job));
+			if (!jobs) {
+				pthread_mutex_unlock(&dq->lock);
+				return 0;
+			}
+			dq->jobs = jobs;
+			dq->capacity = capacity;
+		}
+	}
+	dq->jobs[dq->tail++] = job;
+	pthread_mutex_unlock(&dq->lock);
+	return 1;
+}
+
+static int deque_pop(struct deque *dq, struct job *job, int steal) {
+	int found = 0;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head < dq->tail) {
+		*job = steal ? dq->jobs[dq->head++] : dq->jobs[--dq->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
+
+static int pool_take(pool_t *pool, int id, struct job *job) {
+	if (deque_pop(&pool->deques[id], job, 0)) return 1;
+	for (int i = 1; i < pool->threads; i++) {
+		if (deque_pop(&pool->deques[(id + i) % pool->threads], job, 1)) return 1;
+	}
+	return 0;
+}
+
+static void *pool_worker(void *param) {
+	struct worker_arg *arg = param;
+	pool_t *pool = arg->pool;
+	int id = arg->id;
+	struct job job;
+
+	free(arg);
+	for (;;) {
+		int found = pool_take(pool, id, &job);
+		if (!found) {
+			pthread_mutex_lock(&pool->lock);
+			// Re-check under the lock, a submit may have slipped in after the scan
+			while (!(found = pool_take(pool, id, &job)) && !pool->stop) {
+				pthread_cond_wait(&pool->work, &pool->lock);
+			}
+			pthread_mutex_unlock(&pool->lock);
+			if (!found) return NULL;
+		}
+
+		job.fn(job.arg, id);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0) pthread_cond_broadcast(&pool->idle);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+pool_t *pool_create(int threads) {
+	pool_t *pool = calloc(1, sizeof(*pool));
+	if (!pool) return NULL;
+	if (threads < 1) threads = pool_default_threads();
+
+	pool->threads = threads;
+	pool->workers = calloc(threads, sizeof(pthread_t));
+	pool->deques = calloc(threads, sizeof(struct deque));
+	if (!pool->workers || !pool->deques) {
+		free(pool->workers);
+		free(pool->deques);
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->idle, NULL);
+	for (int i = 0; i < threads; i++) {
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+	}
+	for (int i = 0; i < threads; i++) {
+		struct worker_arg *arg = malloc(sizeof(*arg));
+		arg->pool = pool;
+		arg->id = i;
+		pthread_create(&pool->workers[i], NULL, pool_worker, arg);
+	}
+	return pool;
+}
+
+int pool_submit(pool_t *pool, pool_fn_t fn, void *arg) {
+	struct job job = { fn, arg };
+
+	pthread_mutex_lock(&pool->lock);
+	int target = (int)(pool->next++ % pool->threads);
+	pool->pending++;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!deque_push(&pool->deques[target], job)) {
+		pthread_mutex_lock(&pool->lock);
+		pool->pending--;
+		pthread_mutex_unlock(&pool->lock);
+		return 0;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return 1;
+}
+
+void pool_wait(pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0) {
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(pool_t *pool) {
+	if (!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (int i = 0; i < pool->threads; i++) {
+		pthread_join(pool->workers[i], NULL);
+	}
+	for (int i = 0; i < pool->threads; i++) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].jobs);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->idle);
+	free(pool->workers);
+	free(pool->deques);
+	free(pool);
+}
@@ -0,0 +1,23 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * pool.h - Small work-stealing thread pool for the host tools
+ *
+ * Every worker owns a deque. Jobs are dealt round robin, a worker takes the
+ * newest job of its own deque and, once that runs dry, steals the oldest job
+ * of another worker. Jobs are whole files, so a lock per deque is cheap
+ * enough and keeps the code obvious.
+ */
+
+typedef void (*pool_fn_t)(void *arg, int worker);
+
+typedef struct pool pool_t;
+
+int pool_default_threads(void);
+pool_t *pool_create(int threads);
+int pool_submit(pool_t *pool, pool_fn_t fn, void *arg);
+void pool_wait(pool_t *pool);
+void pool_destroy(pool_t *pool);
+
+#endif /* POOL_H */
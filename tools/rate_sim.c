@@ -0,0 +1,148 @@
+/*
+ * rate_sim.c - Frame drops under a throttled card, with and without rate.c
+ *
+ * Simulates a camera with a fixed number of frame buffers feeding the muxer
+ * at a steady frame rate. The card writes at a given throughput plus a fixed
+ * latency per frame, and slows down for a while in the middle of the run as
+ * it would during garbage collection or thermal throttling. A frame that
+ * finds every buffer still waiting for the card is dropped.
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o rate_sim rate_sim.c ../rate.c
+ *
+ * Usage:
+ *   rate_sim [-v]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../rate.h"
+
+#define SIM_FPS			10
+#define SIM_SECONDS		120
+#define SIM_BUFFERS		2		// Camera frame buffers, one being written and one waiting
+#define SIM_FRAME_BYTES		60000		// What the sensor produces at full quality
+#define SIM_MIN_BYTES		8000
+#define SIM_FAST_BPS		(1500 * 1024)
+#define SIM_SLOW_BPS		(320 * 1024)
+#define SIM_LATENCY_US		4000
+#define SIM_STALL_US		150000		// Occasional long write while the card is busy with itself
+#define SIM_SLOW_FROM		30		// Seconds
+#define SIM_SLOW_TO		80
+
+typedef struct {
+	int64_t finish;
+	uint32_t bytes;
+	uint32_t elapsed;
+} sim_write_t;
+
+typedef struct {
+	uint32_t captured;
+	uint32_t dropped;
+	uint32_t stored;
+	uint64_t bytes;
+	uint32_t changes;
+} sim_result_t;
+
+static uint32_t sim_random(uint32_t *state) {
+	*state = *state * 1664525u + 1013904223u;
+	return *state >> 8;
+}
+
+// Write time of one frame at a point in time
+static uint32_t sim_service_us(int64_t now, uint32_t bytes, uint32_t *seed) {
+	int slow = now >= (int64_t)SIM_SLOW_FROM * 1000000 && now < (int64_t)SIM_SLOW_TO * 1000000;
+	uint32_t bps = slow ? SIM_SLOW_BPS : SIM_FAST_BPS;
+	uint32_t us = SIM_LATENCY_US + (uint32_t)((uint64_t)bytes * 1000000 / bps);
+	if (slow && sim_random(seed) % 20 == 0) us += SIM_STALL_US;
+	return us;
+}
+
+static void sim_target_changed(uint32_t target, void *arg) {
+	*(uint32_t *)arg = target;
+}
+
+static sim_result_t simulate(int control, int verbose) {
+	const int64_t period = 1000000 / SIM_FPS;
+	const rate_config_t config = {
+		.frame_us	= (uint32_t)period,
+		.min_bytes	= SIM_MIN_BYTES,
+		.max_bytes	= SIM_FRAME_BYTES,
+		.high_permille	= 800,
+		.low_permille	= 500,
+		.down_frames	= 3,
+		.up_frames	= 3 * SIM_FPS,
+		.hold_frames	= SIM_FPS,
+	};
+	sim_write_t queue[SIM_BUFFERS];
+	sim_result_t result;
+	rate_t rate;
+	uint32_t target = SIM_FRAME_BYTES;
+	uint32_t seed = 12345;
+	uint32_t noise = 777;
+	int64_t busy_until = 0;
+	int queued = 0;
+
+	memset(&result, 0, sizeof(result));
+	rate_init(&rate, &config, sim_target_changed, &target);
+
+	for (int64_t frame = 0; frame < (int64_t)SIM_FPS * SIM_SECONDS; frame++) {
+		int64_t now = frame * period;
+
+		// Frames the card finished since the last capture hand their buffers back, and their timing to the controller
+		while (queued > 0 && queue[0].finish <= now) {
+			if (control) rate_update(&rate, queue[0].bytes, queue[0].elapsed);
+			memmove(queue, queue + 1, --queued * sizeof(sim_write_t));
+		}
+
+		result.captured++;
+		if (queued == SIM_BUFFERS) {
+			result.dropped++;
+			continue;
+		}
+
+		// The sensor lands within 15% of the size it was asked for
+		uint32_t bytes = target - target * 15 / 100 + (uint32_t)((uint64_t)target * 30 / 100 * (sim_random(&noise) % 1000) / 1000);
+		int64_t start = busy_until > now ? busy_until : now;
+		uint32_t service = sim_service_us(start, bytes, &seed);
+		busy_until = start + service;
+		queue[queued].finish = busy_until;
+		queue[queued].bytes = bytes;
+		queue[queued].elapsed = service;
+		queued++;
+		result.stored++;
+		result.bytes += bytes;
+
+		if (verbose && frame % (5 * SIM_FPS) == 0) {
+			printf("  %3lld s  target %6u  throughput %5u KB/s  load %3u%%  dropped %u\n", (long long)(now / 1000000),
+				target, rate.throughput / 1024, rate.utilisation / 10, result.dropped);
+		}
+	}
+	result.changes = rate.changes;
+	return result;
+}
+
+static void report(const char *name, const sim_result_t *r) {
+	printf("%-12s captured %5u  stored %5u  dropped %5u (%4.1f%%)  average %6llu bytes/frame  target changes %u\n",
+		name, r->captured, r->stored, r->dropped, 100.0 * r->dropped / r->captured,
+		(unsigned long long)(r->stored ? r->bytes / r->stored : 0), r->changes);
+}
+
+int main(int argc, char **argv) {
+	int verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
+
+	printf("%d fps, %d buffers, card %d KB/s, throttled to %d KB/s from %d s to %d s\n", SIM_FPS, SIM_BUFFERS,
+		SIM_FAST_BPS / 1024, SIM_SLOW_BPS / 1024, SIM_SLOW_FROM, SIM_SLOW_TO);
+
+	if (verbose) printf("fixed quality:\n");
+	sim_result_t fixed = simulate(0, verbose);
+	if (verbose) printf("rate control:\n");
+	sim_result_t controlled = simulate(1, verbose);
+
+	report("fixed", &fixed);
+	report("controlled", &controlled);
+	return 0;
+}
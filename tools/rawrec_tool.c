@@ -0,0 +1,199 @@
+/*
+ * rawrec_tool.c - Manage raw recording regions on the host
+ *
+ * Works on a card image or a file standing in for the region, one block of
+ * the file per block of the region. Recordings pulled off a card with
+ * something like "dd if=/dev/sdX of=card.img skip=FIRST_LBA count=BLOCKS"
+ * are listed and exported as they are.
+ *
+ * "record" lays an existing AVI down as the muxer would, header and movi
+ * with no index. Given a byte count it stops there without closing the
+ * recording, which is what a power loss leaves behind.
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o rawrec_tool rawrec_tool.c ../rawrec.c ../riff.c ../crc32c.c
+ *
+ * Usage:
+ *   rawrec_tool format IMAGE BLOCKS
+ *   rawrec_tool list IMAGE
+ *   rawrec_tool export IMAGE INDEX out.avi
+ *   rawrec_tool record IMAGE in.avi [BYTES]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../riff.h"
+#include "../crc32c.h"
+#include "../rawrec.h"
+
+#define TOOL_STAGE_SIZE		(64 * 1024)
+
+static int image_read(void *dev, uint32_t lba, void *buf, uint32_t count) {
+	FILE *f = dev;
+	if (fseek(f, (long)lba * RAWREC_BLOCK_SIZE, SEEK_SET) != 0) return -1;
+	return fread(buf, RAWREC_BLOCK_SIZE, count, f) == count ? 0 : -1;
+}
+
+static int image_write(void *dev, uint32_t lba, const void *buf, uint32_t count) {
+	FILE *f = dev;
+	if (fseek(f, (long)lba * RAWREC_BLOCK_SIZE, SEEK_SET) != 0) return -1;
+	return fwrite(buf, RAWREC_BLOCK_SIZE, count, f) == count ? 0 : -1;
+}
+
+static FILE *image_open(const char *path, rawrec_dev_t *dev) {
+	FILE *f = fopen(path, "rb+");
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	dev->dev = f;
+	dev->read = image_read;
+	dev->write = image_write;
+	dev->first_lba = 0;
+	dev->block_count = (uint32_t)(ftell(f) / RAWREC_BLOCK_SIZE);
+	return f;
+}
+
+static const char *state_name(uint32_t state) {
+	return state == RAWREC_CLOSED ? "closed" : state == RAWREC_OPEN ? "open" : "?";
+}
+
+static int list(rawrec_t *raw) {
+	const rawrec_super_t *super = &raw->super;
+	printf("generation %lu, %lu of %lu blocks used, %lu recordings\n", (unsigned long)super->generation,
+		(unsigned long)super->next_block, (unsigned long)super->block_count, (unsigned long)super->count);
+	for (uint32_t i = 0; i < super->count; i++) {
+		const rawrec_entry_t *entry = &super->entries[i];
+		printf("%3lu  id %-5lu block %-9lu %10lu bytes  %s\n", (unsigned long)i, (unsigned long)entry->id,
+			(unsigned long)entry->start, (unsigned long)entry->bytes, state_name(entry->state));
+	}
+	return 0;
+}
+
+static int export(rawrec_t *raw, int index, const char *path) {
+	uint32_t frames = 0;
+	FILE *out = fopen(path, "wb");
+	if (!out) {
+		perror(path);
+		return 1;
+	}
+	int err = rawrec_export(raw, index, out, &frames);
+	if (fclose(out) != 0 && err == RAWREC_OK) err = RAWREC_ERR_IO;
+	if (err != RAWREC_OK) {
+		fprintf(stderr, "export of recording %d failed: %d\n", index, err);
+		return 1;
+	}
+	printf("%s: %lu frames\n", path, (unsigned long)frames);
+	return 0;
+}
+
+// Copies everything up to the end of movi, the part the muxer writes to the region
+static int record(rawrec_t *raw, const char *path, long limit) {
+	uint8_t buf[16 * 1024];
+	long end = 0;
+	FOURCC fcc;
+	uint32_t size;
+	FILE *in = fopen(path, "rb");
+	if (!in) {
+		perror(path);
+		return 1;
+	}
+	fseek(in, 3 * sizeof(uint32_t), SEEK_SET);
+	while (freadchunk(&fcc, &size, in)) {
+		FOURCC type;
+		long payload = ftell(in);
+		if (fcc == FOURCC_LIST && freadcc(&type, in) && type == FOURCC_MOVI) {
+			end = payload + size;
+			break;
+		}
+		fseek(in, payload + size + (size & 1), SEEK_SET);
+	}
+	if (!end) {
+		fprintf(stderr, "%s: no movi list\n", path);
+		return 1;
+	}
+	if (limit >= 0 && limit < end) end = limit;
+
+	int err = rawrec_begin(raw);
+	rewind(in);
+	for (long done = 0; err == RAWREC_OK && done < end; ) {
+		size_t n = end - done < (long)sizeof(buf) ? (size_t)(end - done) : sizeof(buf);
+		if (fread(buf, 1, n, in) != n) break;
+		err = rawrec_write(raw, buf, n);
+		done += (long)n;
+	}
+	fclose(in);
+	if (err == RAWREC_OK && limit < 0) err = rawrec_end(raw);
+	if (err != RAWREC_OK) {
+		fprintf(stderr, "record failed: %d\n", err);
+		return 1;
+	}
+	printf("recorded %ld bytes in %lu device writes, %lu commits%s\n", end, (unsigned long)raw->writes,
+		(unsigned long)raw->commits, limit < 0 ? "" : ", left open");
+	return 0;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s format IMAGE BLOCKS\n", name);
+	fprintf(stderr, "       %s list IMAGE\n", name);
+	fprintf(stderr, "       %s export IMAGE INDEX out.avi\n", name);
+	fprintf(stderr, "       %s record IMAGE in.avi [BYTES]\n", name);
+}
+
+int main(int argc, char **argv) {
+	static uint8_t stage[TOOL_STAGE_SIZE];
+	rawrec_dev_t dev;
+	rawrec_t raw;
+	int ret;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return 2;
+	}
+	crc32c_init();
+
+	if (strcmp(argv[1], "format") == 0) {
+		if (argc != 4) {
+			usage(argv[0]);
+			return 2;
+		}
+		FILE *f = fopen(argv[2], "ab");
+		if (!f) {
+			perror(argv[2]);
+			return 1;
+		}
+		fclose(f);
+		if (truncate(argv[2], (off_t)strtoul(argv[3], NULL, 0) * RAWREC_BLOCK_SIZE) != 0) {
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	FILE *image = image_open(argv[2], &dev);
+	if (!image) return 1;
+	int err = rawrec_init(&raw, &dev, stage, sizeof(stage));
+	if (strcmp(argv[1], "format") == 0) {
+		err = rawrec_format(&raw);
+		ret = err != RAWREC_OK;
+		if (!ret) list(&raw);
+	} else if (err != RAWREC_OK) {
+		fprintf(stderr, "%s: %s\n", argv[2], err == RAWREC_ERR_FORMAT ? "no valid superblock" : "unreadable");
+		ret = 1;
+	} else if (strcmp(argv[1], "list") == 0) {
+		ret = list(&raw);
+	} else if (strcmp(argv[1], "export") == 0 && argc == 5) {
+		ret = export(&raw, atoi(argv[3]), argv[4]);
+	} else if (strcmp(argv[1], "record") == 0 && (argc == 4 || argc == 5)) {
+		ret = record(&raw, argv[3], argc == 5 ? strtol(argv[4], NULL, 0) : -1);
+	} else {
+		usage(argv[0]);
+		ret = 2;
+	}
+	fclose(image);
+	return ret;
+}
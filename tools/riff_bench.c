@@ -0,0 +1,240 @@
+/*
+ * riff_bench.c - Chunks parsed per second, span iterator vs FILE* helpers
+ *
+ * Builds a synthetic recording with the movi layout of mjpeg.c, then walks
+ * every chunk of it with riff_span_next() over memory and over an mmap of
+ * the file, and with freadchunk()/fseek() through stdio.
+ *
+ * With GROUP_FRAMES the frames are stored in 'rec ' lists of that many, the
+ * layout of CONFIG_MJPEG_REC_GROUP, and the file is also played back front
+ * to back the two ways an indexed player can: one read per frame, and one
+ * read per list. REQUEST_US adds a fixed cost per read to the playback
+ * times, for a card or a network link where every request costs a round trip.
+ *
+ * Build on the host:
+ *   cc -O2 -I.. -o riff_bench riff_bench.c ../riff.c
+ *
+ * Usage:
+ *   riff_bench [FRAMES] [AVERAGE_FRAME_BYTES] [GROUP_FRAMES] [REQUEST_US]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../riff.h"
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put32(uint8_t **p, uint32_t v) {
+	memcpy(*p, &v, sizeof(v));
+	*p += sizeof(v);
+}
+
+// One read of the playback: a whole chunk, or a whole list, as its index entry describes it
+typedef struct {
+	long pos;
+	uint32_t size;
+} bench_read_t;
+
+// RIFF AVI with a movi list of frames and nothing else, in 'rec ' lists of group frames unless group is 0.
+// Records where every frame and every list sits, returns the total size
+static size_t build(uint8_t *buf, uint32_t frames, uint32_t average, uint32_t group, bench_read_t *frame_reads,
+	bench_read_t *list_reads, uint32_t *lists) {
+	uint8_t *p = buf + 3 * sizeof(uint32_t) + sizeof(CHNK) + sizeof(FOURCC);
+	uint8_t *list = NULL;
+	srand(1);
+	*lists = 0;
+	for (uint32_t i = 0; i < frames; i++) {
+		uint32_t size = average / 2 + (uint32_t)rand() % average;
+		if (group > 0 && i % group == 0) {
+			list = p;
+			put32(&p, FOURCC_LIST);
+			put32(&p, 0);
+			put32(&p, FOURCC_REC);
+		}
+		frame_reads[i].pos = (long)(p - buf);
+		frame_reads[i].size = (uint32_t)sizeof(CHNK) + size + (size & 1);
+		put32(&p, FOURCC_00DC);
+		put32(&p, size);
+		memset(p, 0, size + (size & 1));
+		p[0] = 0xFF;
+		p[1] = 0xD8;
+		p += size + (size & 1);
+		if (list && (i % group == group - 1 || i == frames - 1)) {
+			uint8_t *q = list + sizeof(FOURCC);
+			put32(&q, (uint32_t)(p - list - sizeof(CHNK)));
+			list_reads[*lists].pos = (long)(list - buf);
+			list_reads[(*lists)++].size = (uint32_t)(p - list);
+			list = NULL;
+		}
+	}
+	size_t total = (size_t)(p - buf);
+	p = buf;
+	put32(&p, FOURCC_RIFF);
+	put32(&p, (uint32_t)(total - sizeof(CHNK)));
+	put32(&p, FOURCC_AVI);
+	put32(&p, FOURCC_LIST);
+	put32(&p, (uint32_t)(total - 3 * sizeof(uint32_t) - sizeof(CHNK)));
+	put32(&p, FOURCC_MOVI);
+	return total;
+}
+
+static uint64_t walk_span(const uint8_t *buf, size_t size) {
+	riff_span_t top;
+	riff_span_t riff;
+	riff_span_t movi;
+	riff_chunk_t chunk;
+	uint64_t chunks = 0;
+
+	riff_span_init(&top, buf, size);
+	if (!riff_span_find(&top, FOURCC_RIFF, FOURCC_AVI, &chunk)) return 0;
+	riff_span_enter(&riff, &chunk);
+	if (!riff_span_find(&riff, FOURCC_LIST, FOURCC_MOVI, &chunk)) return 0;
+	riff_span_enter(&movi, &chunk);
+	while (riff_span_next(&movi, &chunk)) {
+		if (chunk.fcc == FOURCC_LIST && chunk.type == FOURCC_REC) {
+			riff_span_t rec;
+			riff_span_enter(&rec, &chunk);
+			while (riff_span_next(&rec, &chunk)) {
+				chunks += chunk.fcc == FOURCC_00DC && chunk.data[0] == 0xFF;
+			}
+			if (rec.error) return 0;
+			continue;
+		}
+		chunks += chunk.fcc == FOURCC_00DC && chunk.data[0] == 0xFF;
+	}
+	return movi.error ? 0 : chunks;
+}
+
+static uint64_t walk_file(FILE *in) {
+	FOURCC fcc;
+	uint32_t size;
+	uint64_t chunks = 0;
+
+	rewind(in);
+	if (!freadchunk(&fcc, &size, in) || fseek(in, sizeof(FOURCC), SEEK_CUR) != 0) return 0;
+	if (!freadchunk(&fcc, &size, in) || fseek(in, sizeof(FOURCC), SEEK_CUR) != 0) return 0;
+	while (freadchunk(&fcc, &size, in)) {
+		// 'rec ' lists are stepped into, their chunks follow linearly
+		if (fcc == FOURCC_LIST) {
+			if (fseek(in, sizeof(FOURCC), SEEK_CUR) != 0) break;
+			continue;
+		}
+		int c = fgetc(in);
+		chunks += fcc == FOURCC_00DC && c == 0xFF;
+		if (fseek(in, (long)(size + (size & 1)) - 1, SEEK_CUR) != 0) break;
+	}
+	return chunks;
+}
+
+// Reads the recording front to back as the reads list it, and counts the frames that come out
+static uint64_t play(int fd, const bench_read_t *reads, uint32_t count, uint8_t *scratch) {
+	uint64_t chunks = 0;
+
+	for (uint32_t i = 0; i < count; i++) {
+		riff_span_t span;
+		riff_chunk_t chunk;
+		if (pread(fd, scratch, reads[i].size, reads[i].pos) != (ssize_t)reads[i].size) return 0;
+		riff_span_init(&span, scratch, reads[i].size);
+		while (riff_span_next(&span, &chunk)) {
+			if (chunk.fcc == FOURCC_LIST && chunk.type == FOURCC_REC) {
+				riff_span_enter(&span, &chunk);
+				continue;
+			}
+			chunks += chunk.fcc == FOURCC_00DC && chunk.data[0] == 0xFF;
+		}
+	}
+	return chunks;
+}
+
+int main(int argc, char **argv) {
+	uint32_t frames = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : 200000;
+	uint32_t average = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 2000;
+	uint32_t group = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 0) : 0;
+	uint32_t request_us = argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 0) : 0;
+	size_t cap = 64 + (size_t)frames * (2 * sizeof(CHNK) + sizeof(FOURCC) + average + average / 2 + 2);
+	uint8_t *buf = malloc(cap);
+	bench_read_t *frame_reads = malloc((size_t)frames * sizeof(bench_read_t));
+	bench_read_t *list_reads = malloc((size_t)frames * sizeof(bench_read_t));
+	uint32_t lists;
+	double start;
+	uint64_t chunks;
+	int rounds = 5;
+
+	if (!buf || !frame_reads || !list_reads || frames == 0) return 1;
+	size_t size = build(buf, frames, average, group, frame_reads, list_reads, &lists);
+
+	FILE *file = tmpfile();
+	if (!file || fwrite(buf, 1, size, file) != size || fflush(file) != 0) return 1;
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+	if (map == MAP_FAILED) return 1;
+
+	printf("%u frames, %.1f MB", frames, size / 1e6);
+	if (lists > 0) printf(", %u 'rec ' lists of %u frames", lists, group);
+	printf("\n");
+
+	start = now();
+	chunks = 0;
+	for (int r = 0; r < rounds; r++) chunks += walk_span(buf, size);
+	printf("span, memory : %12.0f chunks/s\n", chunks / (now() - start));
+
+	start = now();
+	chunks = 0;
+	for (int r = 0; r < rounds; r++) chunks += walk_span(map, size);
+	printf("span, mmap   : %12.0f chunks/s\n", chunks / (now() - start));
+
+	start = now();
+	chunks = 0;
+	for (int r = 0; r < rounds; r++) chunks += walk_file(file);
+	printf("FILE* helpers: %12.0f chunks/s\n", chunks / (now() - start));
+
+	if (chunks != (uint64_t)frames * rounds) {
+		fprintf(stderr, "walked %llu chunks, expected %llu\n", (unsigned long long)chunks, (unsigned long long)frames * rounds);
+		return 1;
+	}
+
+	// Sequential playback, every read at its own offset as a player going by the index issues them
+	if (lists > 0) {
+		uint32_t largest = 0;
+		for (uint32_t i = 0; i < lists; i++) {
+			if (list_reads[i].size > largest) largest = list_reads[i].size;
+		}
+		uint8_t *scratch = malloc(largest);
+		double per_frame;
+		double per_list;
+		if (!scratch) return 1;
+
+		start = now();
+		chunks = 0;
+		for (int r = 0; r < rounds; r++) chunks += play(fileno(file), frame_reads, frames, scratch);
+		per_frame = (now() - start) / rounds + (double)frames * request_us / 1e6;
+		printf("read per frame: %8u reads, %8.1f MB/s\n", frames, size / per_frame / 1e6);
+
+		start = now();
+		for (int r = 0; r < rounds; r++) chunks += play(fileno(file), list_reads, lists, scratch);
+		per_list = (now() - start) / rounds + (double)lists * request_us / 1e6;
+		printf("read per list : %8u reads, %8.1f MB/s, %.1fx%s\n", lists, size / per_list / 1e6, per_frame / per_list,
+			request_us ? " with the request cost" : "");
+		free(scratch);
+
+		if (chunks != 2ULL * frames * rounds) {
+			fprintf(stderr, "played %llu frames, expected %llu\n", (unsigned long long)chunks, 2ULL * frames * rounds);
+			return 1;
+		}
+	}
+	munmap(map, size);
+	fclose(file);
+	free(list_reads);
+	free(frame_reads);
+	free(buf);
+	return 0;
+}
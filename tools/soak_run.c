@@ -0,0 +1,154 @@
+/*
+ * soak_run.c - Hours of recording against a simulated card, on the host
+ *
+ * Runs mjpeg_soak_run() (soak.h): the real muxer records the given frames
+ * in a loop to a simulated card (simstore.h) for the given simulated time,
+ * split into recordings, with a camera holding a fixed number of frame
+ * buffers. Prints how many frames were dropped and the frame latency
+ * percentiles, from capture until the frame is written, so the time a frame
+ * waits behind a stalled write shows up in the tail. The same seed gives the
+ * same card behaviour run after run; only the muxer's own CPU time, which is
+ * the host's, varies.
+ *
+ * host/ stands in for ESP-IDF and the sd, types and fabric components, just
+ * enough for mjpeg.c to run. The muxer is built with every option at its
+ * Kconfig default and the simulated card on (host/sdkconfig.h); other
+ * options of the frame path can be turned on with -D, for instance
+ * -DCONFIG_MJPEG_REC_GROUP=1 to compare drops with and without lists.
+ *
+ * Build on the host:
+ *   cc -O2 -Ihost -I.. -o soak_run soak_run.c host/host.c ../soak.c ../simstore.c ../mjpeg.c ../riff.c ../patch.c \
+ *     ../jpeg.c ../scene.c ../rate.c ../crc32c.c ../crop.c ../rehuff.c ../fmp4.c ../thumb.c
+ *
+ * Usage:
+ *   soak_run [-s SECONDS] [-g SEGMENT_SECONDS] [-f FPS] [-b BUFFERS] [-w CARD_KBPS] [-c CALL_US]
+ *            [-k GC_KB] [-t GC_MS] [-p SPIKE_PPM] [-m SPIKE_MIN_MS] [-M SPIKE_MAX_MS] [-r SEED] FRAME.jpg...
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mjpeg.h"
+#include "soak.h"
+#include "jpeg.h"
+
+static uint8_t *load(const char *path, size_t *len) {
+	FILE *f = fopen(path, "rb");
+	uint8_t *data = NULL;
+	long size = 0;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) <= 0 || fseek(f, 0, SEEK_SET) != 0 ||
+		(data = malloc((size_t)size)) == NULL || fread(data, 1, (size_t)size, f) != (size_t)size) {
+		perror(path);
+		free(data);
+		data = NULL;
+	}
+	if (f != NULL) fclose(f);
+	*len = (size_t)size;
+	return data;
+}
+
+int main(int argc, char **argv) {
+	static mjpeg_context_t prototype;
+	static mjpeg_soak_result_t result;
+	mjpeg_soak_config_t config = {
+		.buffers		= 2,
+		.seconds		= 3600,
+		.segment_seconds	= 300,
+		.storage		= {
+			.bandwidth	= 2048 * 1024,
+			.call_us	= 1500,
+			.gc_bytes	= 4096 * 1024,
+			.gc_us		= 120000,
+			.spike_ppm	= 500,
+			.spike_min_us	= 150000,
+			.spike_max_us	= 600000,
+			.seed		= 7,
+		},
+	};
+	uint32_t fps = 10;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:g:f:b:w:c:k:t:p:m:M:r:")) != -1) {
+		uint32_t value = (uint32_t)strtoul(optarg, NULL, 0);
+		switch (opt) {
+		case 's': config.seconds = value; break;
+		case 'g': config.segment_seconds = value; break;
+		case 'f': fps = value; break;
+		case 'b': config.buffers = (uint8_t)value; break;
+		case 'w': config.storage.bandwidth = value * 1024; break;
+		case 'c': config.storage.call_us = value; break;
+		case 'k': config.storage.gc_bytes = value * 1024; break;
+		case 't': config.storage.gc_us = value * 1000; break;
+		case 'p': config.storage.spike_ppm = value; break;
+		case 'm': config.storage.spike_min_us = value * 1000; break;
+		case 'M': config.storage.spike_max_us = value * 1000; break;
+		case 'r': config.storage.seed = value; break;
+		default: goto usage;
+		}
+	}
+	if (optind >= argc || fps == 0 || fps > 255 || config.buffers == 0) goto usage;
+
+	size_t count = (size_t)(argc - optind);
+	frame_buffer_t *frames = calloc(count, sizeof(frame_buffer_t));
+	jpeg_info_t *info = malloc(sizeof(jpeg_info_t));
+	if (frames == NULL || info == NULL) return 1;
+	for (size_t i = 0; i < count; i++) {
+		frames[i].buffer = load(argv[optind + i], &frames[i].buffer_len);
+		if (frames[i].buffer == NULL) return 1;
+	}
+	if (!jpeg_parse(info, frames[0].buffer, frames[0].buffer_len)) {
+		fprintf(stderr, "%s: not a baseline JPEG frame\n", argv[optind]);
+		return 1;
+	}
+
+	// The context an application would set up for the camera, see write_riff_header()
+	prototype.fps				= (uint8_t)fps;
+	prototype.width				= info->width;
+	prototype.height			= info->height;
+	prototype.avih.microSecPerFrame		= 1000000 / fps;
+	prototype.avih.width			= info->width;
+	prototype.avih.height			= info->height;
+	prototype.avih.streams			= 1;
+	prototype.avih.flags			= AVIF_HASINDEX;
+	prototype.strh.type			= FOURCC_VIDS;
+	prototype.strh.handler			= FOURCC_JPEG;
+	prototype.strh.scale			= 1;
+	prototype.strh.rate			= fps;
+	prototype.bmph.size			= sizeof(BMPH);
+	prototype.bmph.width			= info->width;
+	prototype.bmph.height			= info->height;
+	prototype.bmph.planes			= 1;
+	prototype.bmph.bitCount			= CONFIG_MJPEG_BIT_COUNT;
+	prototype.bmph.compression		= FOURCC_JPEG;
+	config.prototype			= &prototype;
+	config.frames				= frames;
+	config.frame_count			= count;
+
+	esp_err_t err = mjpeg_soak_run(&config, &result);
+
+	printf("%u s at %u fps, %u buffers, %u recordings, card %u KB/s with %u us per call\n", config.seconds, fps,
+		config.buffers, result.recordings, config.storage.bandwidth / 1024, config.storage.call_us);
+	printf("frames    %u captured, %u stored, %u dropped (%.3f%%), longest run of drops %u\n", result.captured,
+		result.stored, result.dropped, result.captured ? 100.0 * result.dropped / result.captured : 0.0,
+		result.longest_drop_run);
+	printf("latency   p50 %.1f ms, p99 %.1f ms, p99.9 %.1f ms, max %.1f ms, capture to written\n", result.p50_us / 1e3,
+		result.p99_us / 1e3, result.p999_us / 1e3, result.max_us / 1e3);
+	printf("closing   worst %.1f ms\n", result.finalize_max_us / 1e3);
+	printf("card      %llu MB written, %u stalls, %u spikes\n", (unsigned long long)(result.bytes >> 20), result.stalls,
+		result.spikes);
+	printf("muxer     %.1f us of host CPU per captured frame\n", result.captured ? (double)result.cpu_us / result.captured : 0.0);
+
+	for (size_t i = 0; i < count; i++) free(frames[i].buffer);
+	free(frames);
+	free(info);
+	return err == ESP_OK ? 0 : 1;
+
+usage:
+	fprintf(stderr, "usage: %s [-s SECONDS] [-g SEGMENT_SECONDS] [-f FPS] [-b BUFFERS] [-w CARD_KBPS] [-c CALL_US]\n"
+		"       [-k GC_KB] [-t GC_MS] [-p SPIKE_PPM] [-m SPIKE_MIN_MS] [-M SPIKE_MAX_MS] [-r SEED] FRAME.jpg...\n", argv[0]);
+	return 1;
+}
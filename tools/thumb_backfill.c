@@ -0,0 +1,226 @@
+/*
+ * thumb_backfill.c - Write thumbnail strips for existing recordings
+ *
+ * Produces the same strip the muxer writes with CONFIG_MJPEG_THUMBNAILS
+ * (see thumb.h) next to every recording, as name.thm. Only every Nth frame
+ * is read, with one seek per thumbnail, and decoded from its DC
+ * coefficients. Files are spread over the work-stealing pool (pool.c).
+ *
+ * Build on the host:
+ *   cc -O2 -pthread -I.. -o thumb_backfill thumb_backfill.c pool.c ../avi.c ../riff.c ../jpeg.c ../thumb.c ../crc32c.c
+ *
+ * Usage:
+ *   thumb_backfill [-j THREADS] [-n INTERVAL] [-f] file.avi ...
+ *     -n  frames between thumbnails, 25 by default
+ *     -f  replace strips that already exist
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../avi.h"
+#include "../crc32c.h"
+#include "../jpeg.h"
+#include "../thumb.h"
+#include "pool.h"
+
+#define BACKFILL_INDEX_BATCH	1024
+
+struct job {
+	const char *path;
+	char out_path[4096];
+	uint32_t interval;
+	int force;
+	int ok;
+	int skipped;
+	uint32_t cells;
+	uint32_t decoded;
+	char error[160];
+};
+
+static void strip_path(struct job *job) {
+	const char *dot = strrchr(job->path, '.');
+	const char *slash = strrchr(job->path, '/');
+	int len = dot && (!slash || dot > slash) ? (int)(dot - job->path) : (int)strlen(job->path);
+	snprintf(job->out_path, sizeof(job->out_path), "%.*s.thm", len, job->path);
+}
+
+static int read_frame(avi_file_t *avi, const IDX1 *entry, uint8_t **buf, size_t *buf_size) {
+	if (entry->size > *buf_size) {
+		uint8_t *grown = realloc(*buf, entry->size);
+		if (!grown) return 0;
+		*buf = grown;
+		*buf_size = entry->size;
+	}
+	return fseek(avi->file, avi->idx1_base + (long)entry->offset + (long)sizeof(CHNK), SEEK_SET) == 0 &&
+		fread(*buf, 1, entry->size, avi->file) == entry->size;
+}
+
+static void backfill_file(void *arg, int worker) {
+	struct job *job = arg;
+	jpeg_info_t *info = malloc(sizeof(*info));
+	IDX1 *entries = malloc(BACKFILL_INDEX_BATCH * sizeof(IDX1));
+	uint8_t *frame = NULL;
+	uint8_t *pixels = NULL;
+	size_t frame_size = 0;
+	size_t cell_size = 0;
+	thumb_header_t header = { 0 };
+	uint32_t frames = 0;		// Frame entries seen so far, the numbering of the strip
+	uint32_t pending = 0;		// Cells owed for frames before the cell size was known
+	avi_file_t avi;
+	FILE *in = NULL;
+	FILE *out = NULL;
+
+	(void)worker;
+	strip_path(job);
+	if (!job->force && access(job->out_path, F_OK) == 0) {
+		job->ok = 1;
+		job->skipped = 1;
+		goto done;
+	}
+	if (!info || !entries) {
+		snprintf(job->error, sizeof(job->error), "out of memory");
+		goto done;
+	}
+	in = fopen(job->path, "rb");
+	if (!in || !avi_open(&avi, in)) {
+		snprintf(job->error, sizeof(job->error), in ? "not a recording" : "cannot open");
+		goto done;
+	}
+	if (avi.idx1_count == 0) {
+		snprintf(job->error, sizeof(job->error), "no index");
+		goto done;
+	}
+
+	for (uint32_t first = 0; first < avi.idx1_count; first += BACKFILL_INDEX_BATCH) {
+		uint32_t count = avi_read_index(&avi, first, BACKFILL_INDEX_BATCH, entries);
+		if (count == 0) break;
+		for (uint32_t i = 0; i < count; i++) {
+			if (!avi_is_frame(&entries[i]) || frames++ % job->interval != 0) continue;
+			int readable = read_frame(&avi, &entries[i], &frame, &frame_size);
+
+			if (!pixels) {
+				uint16_t width;
+				uint16_t height;
+				// Like the muxer, the first frame that parses sets the cell size
+				if (!readable || !jpeg_parse(info, frame, entries[i].size) || !thumb_size(info, &width, &height)) {
+					pending++;
+					continue;
+				}
+				thumb_header_init(&header, width, height, job->interval);
+				cell_size = (size_t)width * height;
+				out = fopen(job->out_path, "wb");
+				if (!(pixels = malloc(cell_size)) || !out || fwrite(&header, sizeof(header), 1, out) != 1) {
+					snprintf(job->error, sizeof(job->error), "cannot write the strip");
+					goto done;
+				}
+				memset(pixels, THUMB_FILL, cell_size);
+				for (; pending > 0; pending--, job->cells++) fwrite(pixels, 1, cell_size, out);
+			}
+
+			if (readable && thumb_decode(info, frame, entries[i].size, pixels, header.width, header.height)) {
+				job->decoded++;
+			} else {
+				memset(pixels, THUMB_FILL, cell_size);
+			}
+			if (fwrite(pixels, 1, cell_size, out) != cell_size) {
+				snprintf(job->error, sizeof(job->error), "cannot write the strip");
+				goto done;
+			}
+			job->cells++;
+		}
+	}
+	if (!pixels) {
+		snprintf(job->error, sizeof(job->error), "no decodable frame");
+		goto done;
+	}
+	job->ok = 1;
+
+done:
+	if (out && fclose(out) != 0 && job->ok) {
+		snprintf(job->error, sizeof(job->error), "cannot write the strip");
+		job->ok = 0;
+	}
+	if (in) fclose(in);
+	free(info);
+	free(entries);
+	free(frame);
+	free(pixels);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr, "usage: %s [-j THREADS] [-n INTERVAL] [-f] file.avi ...\n", name);
+}
+
+int main(int argc, char **argv) {
+	int threads = 0;
+	uint32_t interval = 25;
+	int force = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:n:f")) != -1) {
+		switch (opt) {
+		case 'j': threads = atoi(optarg); break;
+		case 'n': interval = (uint32_t)strtoul(optarg, NULL, 0); break;
+		case 'f': force = 1; break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	int files = argc - optind;
+	if (files <= 0 || interval == 0) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (threads <= 0) threads = pool_default_threads();
+	if (threads > files) threads = files;
+
+	struct job *jobs = calloc(files, sizeof(*jobs));
+	if (!jobs) return 1;
+
+	// The tables are filled once here, before the workers share them
+	crc32c_init();
+
+	double start = now();
+	pool_t *pool = pool_create(threads);
+	if (!pool) return 1;
+	for (int i = 0; i < files; i++) {
+		jobs[i].path = argv[optind + i];
+		jobs[i].interval = interval;
+		jobs[i].force = force;
+		pool_submit(pool, backfill_file, &jobs[i]);
+	}
+	pool_wait(pool);
+	pool_destroy(pool);
+	double elapsed = now() - start;
+
+	int failed = 0;
+	uint64_t cells = 0;
+	for (int i = 0; i < files; i++) {
+		struct job *job = &jobs[i];
+		failed += !job->ok;
+		cells += job->cells;
+		if (!job->ok) {
+			printf("%s: FAIL %s\n", job->path, job->error);
+		} else if (job->skipped) {
+			printf("%s: %s exists\n", job->path, job->out_path);
+		} else {
+			printf("%s: %u thumbnails (%u decoded) in %s\n", job->path, job->cells, job->decoded, job->out_path);
+		}
+	}
+	printf("%d files, %d failed, %llu thumbnails in %.2f s (%d threads)\n", files, failed,
+		(unsigned long long)cells, elapsed, threads);
+	free(jobs);
+	return failed != 0;
+}